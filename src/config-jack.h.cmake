@@ -0,0 +1,2 @@
+#cmakedefine HAVE_JACK
+#cmakedefine HAVE_SAMPLERATE
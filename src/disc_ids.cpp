@@ -0,0 +1,81 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "disc_ids.h"
+
+#include <cstring>
+
+#include <QCryptographicHash>
+
+extern "C"
+{
+	#include "wmlib/include/wm_cddb.h"
+}
+
+static char *hex(char *p, unsigned value, int digits)
+{
+	static const char digit[] = "0123456789ABCDEF";
+
+	for (int i = digits - 1; i >= 0; --i, value >>= 4)
+		p[i] = digit[value & 0xF];
+
+	return p + digits;
+}
+
+KCompactDiscIds::KCompactDiscIds(const QList<unsigned> &trackStartFrames, bool lastTrackAudio) :
+	cddb(0)
+{
+	char musicBrainz[2 + 2 + 8 + 99 * 8];
+	unsigned i, frames, lba, lastAudio, leadout, arId1 = 0, arId2 = 0;
+	const unsigned tracks = trackStartFrames.size() - 1;
+
+	if (trackStartFrames.size() < 2 || tracks > 99)
+		return;
+
+	// The data session of an enhanced CD is not part of the audio disc ids,
+	// the audio session ends 11400 frames before it.
+	lastAudio = tracks;
+	leadout = trackStartFrames[tracks];
+	if (tracks > 1 && !lastTrackAudio) {
+		lastAudio = tracks - 1;
+		leadout = trackStartFrames[tracks - 1] - 11400;
+	}
+
+	memset(musicBrainz, '0', sizeof(musicBrainz));
+	hex(hex(hex(musicBrainz, 1, 2), lastAudio, 2), leadout, 8);
+
+	for (i = 1; i <= lastAudio; ++i) {
+		frames = trackStartFrames[i - 1];
+		lba = frames - 150;
+		arId1 += lba;
+		arId2 += (lba ? lba : 1) * i;
+		hex(musicBrainz + 12 + (i - 1) * 8, frames, 8);
+	}
+
+	// The CDDB id is the one wmlib computes, over all tracks.
+	cddb = cddb_discid_toc(trackStartFrames.constData(), tracks);
+
+	arId1 += leadout - 150;
+	arId2 += (leadout - 150) * (lastAudio + 1);
+	accurateRip = QString::asprintf("%03u-%08x-%08x-%08x", lastAudio, arId1, arId2, cddb);
+
+	QByteArray sha1 = QCryptographicHash::hash(QByteArray::fromRawData(musicBrainz, sizeof(musicBrainz)),
+		QCryptographicHash::Sha1).toBase64();
+	sha1.replace('+', '.').replace('/', '_').replace('=', '-');
+	this->musicBrainz = QString::fromLatin1(sha1);
+}
@@ -0,0 +1,46 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef DISC_IDS_H
+#define DISC_IDS_H
+
+#include <QList>
+#include <QString>
+
+/*
+ * Disc ids computed from the TOC: the CDDB id as wmlib computes it, the
+ * MusicBrainz id (SHA-1, base64 in the MusicBrainz alphabet) and the
+ * AccurateRip id. The data session of an enhanced CD is left out of the
+ * MusicBrainz and AccurateRip ids, as they require.
+ */
+class KCompactDiscIds
+{
+	public:
+		/*
+		 * trackStartFrames holds the start of every track and the
+		 * lead-out, in frames including the 2 second lead-in as in the
+		 * TOC. All ids stay empty for more than 99 tracks or no track.
+		 */
+		KCompactDiscIds(const QList<unsigned> &trackStartFrames, bool lastTrackAudio);
+
+		unsigned cddb;
+		QString musicBrainz;
+		QString accurateRip;
+};
+
+#endif // DISC_IDS_H
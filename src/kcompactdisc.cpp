@@ -21,87 +21,218 @@
 
 #include "kcompactdisc.h"
 #include "kcompactdisc_p.h"
+#include "metadata_index.h"
 
 #include <config-alsa.h>
+#include <config-pipewire.h>
+#include <config-jack.h>
 
 #include <QDBusInterface>
 #include <QDBusReply>
+#include <QHash>
+#include <QReadWriteLock>
+#include <QStandardPaths>
+#include <QThread>
 #include <QUrl>
 #include <QtGlobal>
 
 #include <Solid/Device>
+#include <Solid/DeviceNotifier>
 #include <Solid/Block>
 #include <Solid/OpticalDrive>
 
-static QMap<QString, QUrl> cdromsNameToDeviceUrl;
-static QMap<QString, QString> cdromsNameToUdi;
-static QString ___null = QString();
+#include <algorithm>
 
-static void refreshListOfCdromDevices()
-{
-    cdromsNameToDeviceUrl.clear();
-    cdromsNameToUdi.clear();
-    QString name, type;
-    QUrl url;
-
-    //get a list of all devices that are Cdrom
-    const auto devices = Solid::Device::listFromType(Solid::DeviceInterface::OpticalDrive);
-    for (const Solid::Device &device : devices) {
-        qDebug() << device.udi().toLatin1().constData();
-        const Solid::Block *b = device.as<Solid::Block>();
-        
-        if(!b) {
-            continue;
-        }
+static QString ___null = QString();
+static QString metadataIndexFile;
+static bool metadataIndexSet = false;
 
-        const Solid::OpticalDrive *o = device.as<Solid::OpticalDrive>();
-        Solid::OpticalDrive::MediumTypes mediumType = o->supportedMedia();
-
-        url = QUrl::fromUserInput(QLatin1String( b->device().toLatin1() ));
-        //TODO translate them ?
-        if(mediumType < Solid::OpticalDrive::Cdrw) {
-            type = QLatin1String( "CD-ROM" );
-        } else if(mediumType < Solid::OpticalDrive::Dvd) {
-            type = QLatin1String( "CDRW" );
-        } else if(mediumType < Solid::OpticalDrive::Dvdr) {
-            type = QLatin1String( "DVD-ROM" );
-        } else if(mediumType < Solid::OpticalDrive::Bd) {
-            type = QLatin1String( "DVDRW" );
-        } else if(mediumType < Solid::OpticalDrive::HdDvd) {
-            type = QLatin1String( "Blu-ray" );
-        } else {
-            type = QLatin1String( "High Density DVD" );
-        }
+/*
+ * Optical drives known to Solid, indexed by name, URL and UDI. Filled by
+ * one enumeration in a thread of its own, started when the application
+ * comes up, and kept up to date from the hot-plug signals of
+ * Solid::DeviceNotifier afterwards. A lookup only waits for the
+ * enumeration if the drive asked for is not known yet.
+ */
+class CdromRegistry
+{
+public:
+    CdromRegistry();
+    ~CdromRegistry();
 
-        if(!device.vendor().isEmpty())
-            name = (QLatin1Char('[') + type + QLatin1String( " - " ) + device.vendor() + QLatin1String( " - " ) + device.product() + QLatin1Char( ']' ));
-        else
-            name = (QLatin1Char('[') + type + QLatin1String( " - unknown vendor - " ) + device.product() + QLatin1Char( ']' ));
+    QStringList names();
+    QUrl url(const QString &name);
+    QString udi(const QString &name);
+    QString nameOfUrl(const QUrl &url);
 
-        cdromsNameToDeviceUrl.insert(name, url);
-        cdromsNameToUdi.insert(name, device.udi());
+private:
+    struct Entry
+    {
+        QUrl url;
+        QString udi;
+    };
+
+    void populate();
+    void add(const Solid::Device &device);
+    void remove(const QString &udi);
+
+    QReadWriteLock m_lock;
+    QThread *m_enumeration;
+    QStringList m_names; // sorted, the first one is the default drive
+    QHash<QString, Entry> m_byName;
+    QHash<QString, QString> m_nameByUdi;
+    QHash<QUrl, QString> m_nameByUrl;
+};
+
+// Created, and the enumeration started, by the first drive lookup.
+Q_GLOBAL_STATIC(CdromRegistry, cdromRegistry)
+
+static QString cdromName(const Solid::Device &device, const Solid::OpticalDrive *o)
+{
+    Solid::OpticalDrive::MediumTypes mediumType = o->supportedMedia();
+    QString type;
+
+    //TODO translate them ?
+    if(mediumType < Solid::OpticalDrive::Cdrw) {
+        type = QLatin1String( "CD-ROM" );
+    } else if(mediumType < Solid::OpticalDrive::Dvd) {
+        type = QLatin1String( "CDRW" );
+    } else if(mediumType < Solid::OpticalDrive::Dvdr) {
+        type = QLatin1String( "DVD-ROM" );
+    } else if(mediumType < Solid::OpticalDrive::Bd) {
+        type = QLatin1String( "DVDRW" );
+    } else if(mediumType < Solid::OpticalDrive::HdDvd) {
+        type = QLatin1String( "Blu-ray" );
+    } else {
+        type = QLatin1String( "High Density DVD" );
     }
-#if 0
-    if(cdromsNameToDeviceUrl.empty()) {
-        cdromsNameToDeviceUrl.insert(QString("Generic CDROM []"), QUrl::fromPath(wm_drive_default_device()));
+
+    if(!device.vendor().isEmpty())
+        return (QLatin1Char('[') + type + QLatin1String( " - " ) + device.vendor() + QLatin1String( " - " ) + device.product() + QLatin1Char( ']' ));
+    else
+        return (QLatin1Char('[') + type + QLatin1String( " - unknown vendor - " ) + device.product() + QLatin1Char( ']' ));
+}
+
+CdromRegistry::CdromRegistry()
+{
+    // Solid delivers these in the thread of the notifier, the main thread.
+    Solid::DeviceNotifier *notifier = Solid::DeviceNotifier::instance();
+    QObject::connect(notifier, &Solid::DeviceNotifier::deviceAdded, notifier, [this](const QString &udi) {
+        const Solid::Device device(udi);
+        if(!device.is<Solid::OpticalDrive>())
+            return;
+        QWriteLocker locker(&m_lock);
+        add(device);
+    });
+    QObject::connect(notifier, &Solid::DeviceNotifier::deviceRemoved, notifier, [this](const QString &udi) {
+        QWriteLocker locker(&m_lock);
+        remove(udi);
+    });
+
+    // Solid keeps its backends per thread, this one has its own.
+    m_enumeration = QThread::create([this]() {
+        //get a list of all devices that are Cdrom
+        const auto devices = Solid::Device::listFromType(Solid::DeviceInterface::OpticalDrive);
+        QWriteLocker locker(&m_lock);
+        for (const Solid::Device &device : devices)
+            add(device);
+    });
+    m_enumeration->setObjectName(QStringLiteral("KCompactDisc drives"));
+    m_enumeration->start();
+}
+
+CdromRegistry::~CdromRegistry()
+{
+    m_enumeration->wait();
+    delete m_enumeration;
+}
+
+void CdromRegistry::populate()
+{
+    m_enumeration->wait();
+}
+
+/* Called with the write lock held. */
+void CdromRegistry::add(const Solid::Device &device)
+{
+    const Solid::Block *b = device.as<Solid::Block>();
+    const Solid::OpticalDrive *o = device.as<Solid::OpticalDrive>();
+    Entry entry;
+    QString name;
+
+    if(!b || !o || m_nameByUdi.contains(device.udi()))
+        return;
+
+    name = cdromName(device, o);
+    // A second drive of the same model is told apart by its device node.
+    if(m_byName.contains(name))
+        name += QLatin1Char(' ') + b->device();
+
+    entry.url = QUrl::fromUserInput(QLatin1String( b->device().toLatin1() ));
+    entry.udi = device.udi();
+
+    m_names.insert(std::lower_bound(m_names.begin(), m_names.end(), name), name);
+    m_byName.insert(name, entry);
+    m_nameByUdi.insert(entry.udi, name);
+    m_nameByUrl.insert(entry.url, name);
+}
+
+/* Called with the write lock held. */
+void CdromRegistry::remove(const QString &udi)
+{
+    const QString name = m_nameByUdi.take(udi);
+
+    if(name.isEmpty())
+        return;
+
+    m_nameByUrl.remove(m_byName.take(name).url);
+    m_names.removeOne(name);
+}
+
+QStringList CdromRegistry::names()
+{
+    populate();
+    QReadLocker locker(&m_lock);
+    return m_names;
+}
+
+QUrl CdromRegistry::url(const QString &name)
+{
+    {
+        QReadLocker locker(&m_lock);
+        if(m_byName.contains(name))
+            return m_byName.value(name).url;
     }
-#endif
+
+    populate();
+    QReadLocker locker(&m_lock);
+    return m_byName.value(name).url;
 }
 
-static QMap<QString, QUrl> &getListOfCdromDevicesNamesAndUrl()
+QString CdromRegistry::udi(const QString &name)
 {
-    if(cdromsNameToDeviceUrl.empty())
-        refreshListOfCdromDevices();
+    {
+        QReadLocker locker(&m_lock);
+        if(m_byName.contains(name))
+            return m_byName.value(name).udi;
+    }
 
-    return cdromsNameToDeviceUrl;
+    populate();
+    QReadLocker locker(&m_lock);
+    return m_byName.value(name).udi;
 }
 
-static QMap<QString, QString> &getListOfCdromDevicesNamesAndUdi()
+QString CdromRegistry::nameOfUrl(const QUrl &url)
 {
-    if(cdromsNameToUdi.empty())
-        refreshListOfCdromDevices();
+    {
+        QReadLocker locker(&m_lock);
+        if(m_nameByUrl.contains(url))
+            return m_nameByUrl.value(url);
+    }
 
-    return cdromsNameToUdi;
+    populate();
+    QReadLocker locker(&m_lock);
+    return m_nameByUrl.value(url);
 }
 
 QString KCompactDisc::urlToDevice(const QUrl &deviceUrl)
@@ -132,6 +263,15 @@ const QStringList KCompactDisc::audioSystems()
     QStringList list;
 
     list << QLatin1String( "phonon" )
+#ifdef USE_WMLIB
+        << QLatin1String( "phonon-pcm" )
+#endif
+#if defined(HAVE_PIPEWIRE)
+        << QLatin1String( "pipewire" )
+#endif
+#if defined(HAVE_JACK)
+        << QLatin1String( "jack" )
+#endif
 #if defined(HAVE_ALSA)
         << QLatin1String( "alsa" )
 #endif
@@ -144,36 +284,29 @@ const QStringList KCompactDisc::audioSystems()
 
 const QStringList KCompactDisc::cdromDeviceNames()
 {
-    return getListOfCdromDevicesNamesAndUrl().keys();
+    return cdromRegistry()->names();
 }
 
 const QString KCompactDisc::defaultCdromDeviceName()
 {
-    const QStringList names = getListOfCdromDevicesNamesAndUrl().keys();
+    const QStringList names = cdromRegistry()->names();
     if (!names.isEmpty()) return names[0];
     else return QString();
 }
 
 const QUrl KCompactDisc::defaultCdromDeviceUrl()
 {
-    const QList<QUrl> urls = getListOfCdromDevicesNamesAndUrl().values();
-    if (!urls.isEmpty()) return urls[0];
-    else return QUrl();
+    return cdromRegistry()->url(defaultCdromDeviceName());
 }
 
 const QUrl KCompactDisc::cdromDeviceUrl(const QString &cdromDeviceName)
 {
-    const QMap<QString, QUrl> &nameUrls = getListOfCdromDevicesNamesAndUrl();
-    QUrl result = nameUrls.value(cdromDeviceName);
+    QUrl result = cdromRegistry()->url(cdromDeviceName);
     if (!result.isValid())
     {
         const QUrl passedUrl = QUrl::fromLocalFile(cdromDeviceName);
-        for (const QUrl &url : nameUrls) {
-            if (url == passedUrl)
-            {
-                return passedUrl;
-            }
-        }
+        if (!cdromRegistry()->nameOfUrl(passedUrl).isEmpty())
+            return passedUrl;
         result = KCompactDisc::defaultCdromDeviceUrl();
     }
     return result;
@@ -181,14 +314,33 @@ const QUrl KCompactDisc::cdromDeviceUrl(const QString &cdromDeviceName)
 
 const QString KCompactDisc::defaultCdromDeviceUdi()
 {
-    const QStringList udis = getListOfCdromDevicesNamesAndUdi().values();
-    if (!udis.isEmpty()) return udis[0];
-    else return QString();
+    return cdromRegistry()->udi(defaultCdromDeviceName());
 }
 
 const QString KCompactDisc::cdromDeviceUdi(const QString &cdromDeviceName)
 {
-    return getListOfCdromDevicesNamesAndUdi().value(cdromDeviceName, KCompactDisc::defaultCdromDeviceUdi());
+    const QString udi = cdromRegistry()->udi(cdromDeviceName);
+    if (udi.isEmpty())
+        return KCompactDisc::defaultCdromDeviceUdi();
+    return udi;
+}
+
+void KCompactDisc::setMetadataIndex(const QString &fileName)
+{
+    metadataIndexFile = fileName;
+    metadataIndexSet = true;
+}
+
+const QString KCompactDisc::metadataIndex()
+{
+    if(!metadataIndexSet)
+        return QStandardPaths::locate(QStandardPaths::GenericDataLocation, QStringLiteral("kcompactdisc/freedb.index"));
+    return metadataIndexFile;
+}
+
+bool KCompactDisc::buildMetadataIndex(const QString &dumpDirectory, const QString &fileName)
+{
+    return KCompactDiscMetadataIndex::build(dumpDirectory, fileName);
 }
 
 KCompactDisc::KCompactDisc(InformationMode infoMode) :
@@ -240,6 +392,24 @@ unsigned KCompactDisc::discId()
     return d->m_discId;
 }
 
+const QString &KCompactDisc::discMusicBrainzId()
+{
+    Q_D(KCompactDisc);
+    return d->m_discMusicBrainzId;
+}
+
+const QString &KCompactDisc::discAccurateRipId()
+{
+    Q_D(KCompactDisc);
+    return d->m_discAccurateRipId;
+}
+
+const QString &KCompactDisc::discMcn()
+{
+    Q_D(KCompactDisc);
+    return d->m_discMcn;
+}
+
 const QList<unsigned> &KCompactDisc::discSignature()
 {
     Q_D(KCompactDisc);
@@ -315,6 +485,14 @@ QString KCompactDisc::trackTitle(unsigned track)
     return d->m_trackTitles[track];
 }
 
+QString KCompactDisc::trackIsrc(unsigned track)
+{
+    Q_D(KCompactDisc);
+    if (!track)
+        return QString();
+    return d->m_trackIsrcs.value(track - 1);
+}
+
 unsigned KCompactDisc::trackLength()
 {
 	Q_D(KCompactDisc);
@@ -373,6 +551,32 @@ bool KCompactDisc::isAudio(unsigned track)
     return d->isTrackAudio(track);
 }
 
+QList<unsigned> KCompactDisc::cdtextBlocks()
+{
+	Q_D(KCompactDisc);
+	return d->cdtextBlocks();
+}
+
+QString KCompactDisc::cdtext(KCompactDisc::CdtextField field, unsigned track, unsigned block)
+{
+	Q_D(KCompactDisc);
+	if (track > d->m_tracks)
+		return QString();
+	return d->cdtext(field, track, block);
+}
+
+unsigned KCompactDisc::cdtextGenre(unsigned block)
+{
+	Q_D(KCompactDisc);
+	return d->cdtextGenre(block);
+}
+
+QString KCompactDisc::cdtextGenreText(unsigned block)
+{
+	Q_D(KCompactDisc);
+	return d->cdtextGenreText(block);
+}
+
 void KCompactDisc::playTrack(unsigned track)
 {
 	Q_D(KCompactDisc);
@@ -518,6 +722,20 @@ void KCompactDisc::setLoopPlaylist(bool loop)
 	Q_EMIT loopPlaylistChanged(d->m_loopPlaylist);
 }
 
+void KCompactDisc::setCrossfade(unsigned int ms)
+{
+	Q_D(KCompactDisc);
+	d->m_crossfade = ms;
+	d->setCrossfade(d->m_crossfade, d->m_silenceTrim);
+}
+
+void KCompactDisc::setSilenceTrim(bool trim)
+{
+	Q_D(KCompactDisc);
+	d->m_silenceTrim = trim;
+	d->setCrossfade(d->m_crossfade, d->m_silenceTrim);
+}
+
 void KCompactDisc::setAutoMetadataLookup(bool autoMetadata)
 {
 	Q_D(KCompactDisc);
@@ -556,4 +774,52 @@ void KCompactDisc::setBalance(unsigned balance)
 	d->setBalance(balance);
 }
 
+unsigned KCompactDisc::changerSlots()
+{
+    Q_D(KCompactDisc);
+    return qMax(1, int(d->m_changerSlots.size()));
+}
+
+unsigned KCompactDisc::changerSlot()
+{
+    Q_D(KCompactDisc);
+    return d->m_changerSlot;
+}
+
+unsigned KCompactDisc::changerSlotDiscId(unsigned slot)
+{
+    Q_D(KCompactDisc);
+    return d->m_changerSlots.value(slot).discId;
+}
+
+unsigned KCompactDisc::changerSlotTracks(unsigned slot)
+{
+    Q_D(KCompactDisc);
+    return d->m_changerSlots.value(slot).tracks;
+}
+
+QString KCompactDisc::changerSlotArtist(unsigned slot)
+{
+    Q_D(KCompactDisc);
+    return d->m_changerSlots.value(slot).artist;
+}
+
+QString KCompactDisc::changerSlotTitle(unsigned slot)
+{
+    Q_D(KCompactDisc);
+    return d->m_changerSlots.value(slot).title;
+}
+
+void KCompactDisc::selectChangerSlot(unsigned slot)
+{
+    Q_D(KCompactDisc);
+    d->selectChangerSlot(slot);
+}
+
+void KCompactDisc::scanChanger()
+{
+    Q_D(KCompactDisc);
+    d->scanChanger();
+}
+
 #include "moc_kcompactdisc.cpp"
@@ -55,6 +55,8 @@ class KCompactDiscPrivate;
  *
  * @see setRandomPlaylist(bool): Shuffle the playlist.
  * @see setLoopPlaylist(bool): Couple begin and end of playlist.
+ * @see setCrossfade(unsigned int): Fade each track into the next one.
+ * @see setSilenceTrim(bool): Cut the silence between the tracks.
  *
  *
  *  The disc lifecycle is modelled by these signals:
@@ -120,8 +122,8 @@ public Q_SLOTS:
 public:
     enum InformationMode
     {
-        Synchronous, // Return and emit signal when cdrom and cddb information arrives.
-        Asynchronous // Block until cdrom and cddb information has been obtained
+        Synchronous, // Drive I/O is done on the caller's thread.
+        Asynchronous // Drive I/O is done on a dedicated thread, results arrive as queued signals.
     };
 
 	enum DiscCommand
@@ -151,7 +153,20 @@ public:
     {
         Cdtext,
         Cddb,
-        PhononMetadata
+        PhononMetadata,
+        LocalDatabase,
+        DiscCodes // discMcn() and trackIsrc()
+    };
+
+    enum CdtextField
+    {
+        CdtextTitle,
+        CdtextPerformer,
+        CdtextSongwriter,
+        CdtextComposer,
+        CdtextArranger,
+        CdtextMessage,
+        CdtextCode // ISRC of a track, UPC/EAN of the disc
     };
 
     explicit KCompactDisc(InformationMode = KCompactDisc::Synchronous);
@@ -213,6 +228,22 @@ public:
      */
 	static const QString cdromDeviceUdi(const QString &);
 
+    /**
+     * Index file used to look up titles of an inserted disc without
+     * network access. Defaults to kcompactdisc/freedb.index in the
+     * generic data location.
+     */
+    static void setMetadataIndex(const QString &fileName);
+    static const QString metadataIndex();
+
+    /**
+     * Build an index file for setMetadataIndex() from an unpacked
+     * freedb format dump.
+     *
+     * @return true if the index was written.
+     */
+    static bool buildMetadataIndex(const QString &dumpDirectory, const QString &fileName);
+
     /**
      * SCSI parameter VENDOR of current CDROM device.
      *
@@ -251,6 +282,28 @@ public:
      */
     unsigned discId();
 
+    /**
+     * MusicBrainz disc id of current disc.
+     *
+     * @return Disc id or null string if no disc or impossible to calculate id.
+     */
+    const QString &discMusicBrainzId();
+
+    /**
+     * AccurateRip disc id of current disc, in the form
+     * "<audio tracks>-<id1>-<id2>-<cddb id>".
+     *
+     * @return Disc id or null string if no disc or impossible to calculate id.
+     */
+    const QString &discAccurateRipId();
+
+    /**
+     * Media catalogue number (UPC/EAN) of current disc.
+     *
+     * @return Number or null string if the disc has none or it is not read yet.
+     */
+    const QString &discMcn();
+
     /**
      * CDDB signature of disc, empty if no disc or not possible to deliver.
      */
@@ -326,6 +379,13 @@ public:
      */
     QString trackTitle(unsigned track);
 
+    /**
+     * ISRC of given track.
+     *
+     * @return ISRC or null string if the track has none or it is not read yet.
+     */
+    QString trackIsrc(unsigned track);
+
     /**
      * Length of current track.
      *
@@ -380,6 +440,59 @@ public:
      */
     bool isAudio(unsigned track);
 
+    /**
+     * CD-Text blocks of current disc. Every block holds the text
+     * in one language.
+     *
+     * @return Block numbers, empty if there is no CD-Text.
+     */
+    QList<unsigned> cdtextBlocks();
+
+    /**
+     * CD-Text field of given track. The field is decoded on first access.
+     *
+     * @param field Field to return.
+     * @param track Track number, 0 for the whole disc.
+     * @param block Block number as returned by cdtextBlocks().
+     * @return Field text or null string.
+     */
+    QString cdtext(KCompactDisc::CdtextField field, unsigned track = 0, unsigned block = 0);
+
+    /**
+     * CD-Text genre code of current disc.
+     *
+     * @return Genre code, 0 if not present.
+     */
+    unsigned cdtextGenre(unsigned block = 0);
+
+    /**
+     * CD-Text supplementary genre information of current disc.
+     *
+     * @return Genre text or null string.
+     */
+    QString cdtextGenreText(unsigned block = 0);
+
+    /**
+     * Number of slots of a disc changer, 1 for a plain drive.
+     */
+    unsigned changerSlots();
+
+    /**
+     * Slot of the current disc, counted from 0.
+     */
+    unsigned changerSlot();
+
+    /**
+     * Disc id, tracks, artist and title of the disc in a changer slot, as
+     * found by the inventory taken in the background after setDevice().
+     *
+     * @return 0 or null string if the slot is empty or not scanned yet.
+     */
+    unsigned changerSlotDiscId(unsigned slot);
+    unsigned changerSlotTracks(unsigned slot);
+    QString changerSlotArtist(unsigned slot);
+    QString changerSlotTitle(unsigned slot);
+
 
 public Q_SLOTS:
 
@@ -469,6 +582,28 @@ public Q_SLOTS:
     void setLoopPlaylist(bool);
 	void setAutoMetadataLookup(bool);
 
+    /**
+     * Crossfade of ms milliseconds between the tracks of the playlist,
+     * 0 to play them one after the other. Digital playback only.
+     */
+    void setCrossfade(unsigned int ms);
+
+    /**
+     * Cut the silence at the end and the start of the tracks when the
+     * next one is played. Digital playback only.
+     */
+    void setSilenceTrim(bool);
+
+    /**
+     * Load the disc of a changer slot.
+     */
+    void selectChangerSlot(unsigned int slot);
+
+    /**
+     * Take the changer inventory again, e.g. after magazines were swapped.
+     */
+    void scanChanger();
+
 
 Q_SIGNALS:
 
@@ -521,6 +656,11 @@ Q_SIGNALS:
      */
     void balanceChanged(unsigned int balance);
 
+    /**
+     * The changer inventory or the current slot changed
+     */
+    void changerChanged();
+
 
 protected:
     KCompactDiscPrivate * d_ptr;
@@ -22,7 +22,7 @@
 
 #include "wmlib_interface.h"
 #include "phonon_interface.h"
-
+#include "disc_ids.h"
 
 #include <KLocalizedString>
 
@@ -43,10 +43,13 @@ KCompactDiscPrivate::KCompactDiscPrivate(KCompactDisc *p, const QString& dev) :
     m_trackExpectedPosition(0),
     m_seek(0),
 
+    m_changerSlot(0),
     m_randSequence(QRandomGenerator::global()->generate()),
     m_loopPlaylist(false),
     m_randomPlaylist(false),
     m_autoMetadata(true),
+    m_crossfade(0),
+    m_silenceTrim(false),
 
     m_deviceVendor(QString()),
     m_deviceModel(QString()),
@@ -89,6 +92,8 @@ bool KCompactDiscPrivate::moveInterface(const QString &deviceName,
 #endif
 
 	pNew->m_infoMode = m_infoMode;
+	pNew->m_crossfade = m_crossfade;
+	pNew->m_silenceTrim = m_silenceTrim;
 
 	if(pNew->createInterface()) {
 		q->d_ptr = pNew;
@@ -164,6 +169,29 @@ unsigned KCompactDiscPrivate::getNextTrackInPlaylist()
 	return m_playlist[current_index];
 }
 
+/*
+ * The track getNextTrackInPlaylist() would pick after track, without
+ * touching the playlist. 0 when that is not known yet, a wrap of a
+ * random playlist reshuffles it first.
+ */
+unsigned KCompactDiscPrivate::peekNextTrackInPlaylist(unsigned track) const
+{
+	int current_index;
+
+	if(m_playlist.empty())
+		return 0;
+
+	current_index = m_playlist.indexOf(track);
+	if(current_index < 0)
+		return m_playlist.first();
+	if(current_index < m_playlist.size() - 1)
+		return m_playlist[current_index + 1];
+	if(m_loopPlaylist && !m_randomPlaylist)
+		return m_playlist.first();
+
+	return 0;
+}
+
 unsigned KCompactDiscPrivate::getPrevTrackInPlaylist()
 {
     int current_index, min_index, max_index;
@@ -238,17 +266,38 @@ const QString KCompactDiscPrivate::discStatusI18n(KCompactDisc::DiscStatus statu
     }
 }
 
+void KCompactDiscPrivate::calculateDiscIds()
+{
+	m_discId = 0;
+	m_discMusicBrainzId.clear();
+	m_discAccurateRipId.clear();
+
+	if (!m_tracks || (unsigned)m_trackStartFrames.size() != m_tracks + 1)
+		return;
+
+#ifdef USE_WMLIB
+	const KCompactDiscIds ids(m_trackStartFrames, isTrackAudio(m_tracks));
+	m_discId = ids.cddb;
+	m_discMusicBrainzId = ids.musicBrainz;
+	m_discAccurateRipId = ids.accurateRip;
+#endif
+}
+
 void KCompactDiscPrivate::clearDiscInfo()
 {
 	Q_Q(KCompactDisc);
 
 	m_discId = 0;
+	m_discMusicBrainzId.clear();
+	m_discAccurateRipId.clear();
 	m_discLength = 0;
 	m_seek = 0;
 	m_track = 0;
 	m_tracks = 0;
 	m_trackArtists.clear();
 	m_trackTitles.clear();
+	m_discMcn.clear();
+	m_trackIsrcs.clear();
 	m_trackStartFrames.clear();
 	Q_EMIT q->discChanged(m_tracks);
 }
@@ -283,6 +332,14 @@ void KCompactDiscPrivate::closetray()
 {
 }
 
+void KCompactDiscPrivate::setCrossfade(unsigned, bool)
+{
+}
+
+void KCompactDiscPrivate::queueTrack(unsigned)
+{
+}
+
 void KCompactDiscPrivate::setVolume(unsigned)
 {
 }
@@ -305,4 +362,52 @@ void KCompactDiscPrivate::queryMetadata()
 {
 }
 
+bool KCompactDiscPrivate::lookupLocalMetadata()
+{
+	Q_Q(KCompactDisc);
+	const QString fileName = KCompactDisc::metadataIndex();
+
+	if(fileName != m_metadataIndexFile) {
+		m_metadataIndexFile = fileName;
+		if(fileName.isEmpty())
+			m_metadataIndex.close();
+		else
+			m_metadataIndex.open(fileName);
+	}
+
+	if(!m_discId || !m_metadataIndex.lookup(m_discId, m_trackStartFrames, m_trackArtists, m_trackTitles))
+		return false;
+
+	Q_EMIT q->discInformation(KCompactDisc::LocalDatabase);
+	return true;
+}
+
+void KCompactDiscPrivate::selectChangerSlot(unsigned)
+{
+}
+
+void KCompactDiscPrivate::scanChanger()
+{
+}
+
+QList<unsigned> KCompactDiscPrivate::cdtextBlocks()
+{
+	return QList<unsigned>();
+}
+
+QString KCompactDiscPrivate::cdtext(KCompactDisc::CdtextField, unsigned, unsigned)
+{
+	return QString();
+}
+
+unsigned KCompactDiscPrivate::cdtextGenre(unsigned)
+{
+	return 0;
+}
+
+QString KCompactDiscPrivate::cdtextGenreText(unsigned)
+{
+	return QString();
+}
+
 #include "moc_kcompactdisc_p.cpp"
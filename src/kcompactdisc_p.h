@@ -28,9 +28,21 @@
 #include <QRandomGenerator>
 
 #include "kcompactdisc.h"
+#include "metadata_index.h"
 
 Q_DECLARE_LOGGING_CATEGORY(CD_PLAYLIST)
 
+/*
+ * Inventory entry of one disc changer slot, discId 0 if empty.
+ */
+struct KCompactDiscChangerSlot
+{
+	unsigned discId = 0;
+	unsigned tracks = 0;
+	QString artist;
+	QString title;
+};
+
 class KCompactDiscPrivate : public QObject
 {
 	Q_OBJECT
@@ -49,6 +61,9 @@ class KCompactDiscPrivate : public QObject
 		KCompactDisc::DiscStatus m_status;
 		KCompactDisc::DiscStatus m_statusExpected;
 		unsigned m_discId;
+		QString m_discMusicBrainzId;
+		QString m_discAccurateRipId;
+		QString m_discMcn;
 		unsigned m_discLength;
 		unsigned m_track;
 		unsigned m_tracks;
@@ -60,20 +75,32 @@ class KCompactDiscPrivate : public QObject
 		QList<unsigned> m_trackStartFrames;
 		QStringList m_trackArtists;
 		QStringList m_trackTitles;
+		QStringList m_trackIsrcs;
 	
+		QList<KCompactDiscChangerSlot> m_changerSlots;
+		unsigned m_changerSlot;
+
 		QRandomGenerator m_randSequence;
 		QList<unsigned> m_playlist;
 		bool m_loopPlaylist;
 		bool m_randomPlaylist;
 		bool m_autoMetadata;
+		unsigned m_crossfade;
+		bool m_silenceTrim;
+
+		/* opened again when KCompactDisc::metadataIndex() changes */
+		KCompactDiscMetadataIndex m_metadataIndex;
+		QString m_metadataIndexFile;
 	
 		void make_playlist();
 		unsigned getNextTrackInPlaylist();
+		unsigned peekNextTrackInPlaylist(unsigned) const;
 		unsigned getPrevTrackInPlaylist();
 		bool skipStatusChange(KCompactDisc::DiscStatus);
 		static const QString discStatusI18n(KCompactDisc::DiscStatus);
 
 		void clearDiscInfo();
+		void calculateDiscIds();
 
 		virtual unsigned trackLength(unsigned);
 		virtual bool isTrackAudio(unsigned);
@@ -82,6 +109,8 @@ class KCompactDiscPrivate : public QObject
 		virtual void stop();
 		virtual void eject();
 		virtual void closetray();
+		virtual void setCrossfade(unsigned, bool);
+		virtual void queueTrack(unsigned);
 	
 		virtual void setVolume(unsigned);
 		virtual void setBalance(unsigned);
@@ -89,6 +118,15 @@ class KCompactDiscPrivate : public QObject
 		virtual unsigned balance();
 
 		virtual void queryMetadata();
+		bool lookupLocalMetadata();
+
+		virtual void selectChangerSlot(unsigned);
+		virtual void scanChanger();
+
+		virtual QList<unsigned> cdtextBlocks();
+		virtual QString cdtext(KCompactDisc::CdtextField, unsigned, unsigned);
+		virtual unsigned cdtextGenre(unsigned);
+		virtual QString cdtextGenreText(unsigned);
 	
 		QString m_deviceVendor;
 		QString m_deviceModel;
@@ -0,0 +1,362 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "metadata_index.h"
+
+#include <QDebug>
+#include <QDirIterator>
+#include <QHash>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <cstring>
+
+/*
+ * File layout, host byte order:
+ *
+ *   IndexHeader
+ *   IndexEntry[count]            sorted by discId
+ *   records                      tracks, frames[tracks + 1],
+ *                                (artist, title)[tracks + 1] as (offset, length)
+ *   strings                      UTF-8, not terminated
+ */
+static const char indexMagic[4] = { 'K', 'C', 'D', 'I' };
+static const quint32 indexVersion = 1;
+
+struct IndexHeader
+{
+	char magic[4];
+	quint32 version;
+	quint32 count;
+	quint32 records; // file offset of the records
+	quint32 strings; // file offset of the strings
+};
+
+struct IndexEntry
+{
+	quint32 discId;
+	quint32 record; // offset into the records
+};
+
+static quint32 recordSize(quint32 tracks)
+{
+	return sizeof(quint32) * (1 + (tracks + 1) + 4 * (tracks + 1));
+}
+
+KCompactDiscMetadataIndex::KCompactDiscMetadataIndex() :
+	m_data(nullptr),
+	m_size(0),
+	m_count(0),
+	m_records(0),
+	m_strings(0)
+{
+}
+
+KCompactDiscMetadataIndex::~KCompactDiscMetadataIndex()
+{
+	close();
+}
+
+bool KCompactDiscMetadataIndex::open(const QString &fileName)
+{
+	const IndexHeader *header;
+
+	close();
+
+	m_file.setFileName(fileName);
+	if(!m_file.open(QIODevice::ReadOnly))
+		return false;
+
+	m_size = m_file.size();
+	if(m_size < (qint64)sizeof(IndexHeader) || !(m_data = m_file.map(0, m_size))) {
+		close();
+		return false;
+	}
+
+	header = reinterpret_cast<const IndexHeader *>(m_data);
+	if(memcmp(header->magic, indexMagic, sizeof(indexMagic)) || header->version != indexVersion ||
+		sizeof(IndexHeader) + (qint64)header->count * sizeof(IndexEntry) > header->records ||
+		header->records > header->strings || header->strings > m_size) {
+		qDebug() << "invalid metadata index" << fileName;
+		close();
+		return false;
+	}
+
+	m_count = header->count;
+	m_records = header->records;
+	m_strings = header->strings;
+
+	return true;
+}
+
+void KCompactDiscMetadataIndex::close()
+{
+	if(m_data)
+		m_file.unmap(const_cast<uchar *>(m_data));
+	m_file.close();
+
+	m_data = nullptr;
+	m_size = 0;
+	m_count = 0;
+}
+
+bool KCompactDiscMetadataIndex::isOpen() const
+{
+	return m_data;
+}
+
+const uchar *KCompactDiscMetadataIndex::at(quint32 offset, quint32 length) const
+{
+	if((qint64)offset + length > m_size)
+		return nullptr;
+
+	return m_data + offset;
+}
+
+QString KCompactDiscMetadataIndex::string(const quint32 *ref) const
+{
+	const uchar *text = at(m_strings + ref[0], ref[1]);
+
+	if(!text)
+		return QString();
+
+	return QString::fromUtf8(reinterpret_cast<const char *>(text), ref[1]);
+}
+
+bool KCompactDiscMetadataIndex::lookup(unsigned discId, const QList<unsigned> &trackStartFrames,
+	QStringList &artists, QStringList &titles) const
+{
+	const IndexEntry *entries, *it;
+	const quint32 *record, *best = nullptr;
+	quint32 tracks, i;
+
+	if(!m_data || trackStartFrames.size() < 2)
+		return false;
+
+	tracks = trackStartFrames.size() - 1;
+	entries = reinterpret_cast<const IndexEntry *>(m_data + sizeof(IndexHeader));
+	it = std::lower_bound(entries, entries + m_count, discId,
+		[](const IndexEntry &entry, unsigned id) { return entry.discId < id; });
+
+	for(; it != entries + m_count && it->discId == discId; ++it) {
+		record = reinterpret_cast<const quint32 *>(at(m_records + it->record, recordSize(tracks)));
+		if(!record || record[0] != tracks)
+			continue;
+
+		if(!best)
+			best = record;
+		for(i = 0; i < tracks && record[1 + i] == trackStartFrames[i]; ++i)
+			;
+		if(i == tracks) {
+			best = record;
+			break;
+		}
+	}
+
+	if(!best)
+		return false;
+
+	artists.clear();
+	titles.clear();
+	for(i = 0, record = best + 1 + tracks + 1; i <= tracks; ++i, record += 4) {
+		artists.append(string(record));
+		titles.append(string(record + 2));
+	}
+
+	return true;
+}
+
+/*
+ * One disc of the dump.
+ */
+struct DumpDisc
+{
+	QList<quint32> ids;
+	QList<quint32> frames; // tracks + 1, the last one from the disc length
+	QByteArray artist;
+	QByteArray title;
+	QList<QByteArray> trackTitles;
+};
+
+static QByteArray unescape(const QByteArray &value)
+{
+	QByteArray ret;
+	int i;
+
+	ret.reserve(value.size());
+	for(i = 0; i < value.size(); ++i) {
+		if(value[i] == '\\' && i + 1 < value.size()) {
+			switch(value[++i]) {
+			case 'n': ret += '\n'; break;
+			case 't': ret += '\t'; break;
+			default: ret += value[i]; break;
+			}
+		} else {
+			ret += value[i];
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Old entries of the dump are Latin-1, newer ones UTF-8.
+ */
+static QByteArray toUtf8(const QByteArray &value)
+{
+	QString text = QString::fromUtf8(unescape(value));
+
+	if(text.contains(QChar::ReplacementCharacter))
+		text = QString::fromLatin1(unescape(value));
+
+	return text.trimmed().toUtf8();
+}
+
+static bool parseDumpFile(const QString &fileName, DumpDisc &disc)
+{
+	QFile file(fileName);
+	QByteArray line, key, value, dtitle;
+	bool offsets = false;
+	int separator, track;
+
+	if(!file.open(QIODevice::ReadOnly))
+		return false;
+
+	const QList<QByteArray> lines = file.readAll().split('\n');
+	for(const QByteArray &raw : lines) {
+		line = raw.endsWith('\r') ? raw.left(raw.size() - 1) : raw;
+
+		if(line.startsWith('#')) {
+			line = line.mid(1).trimmed();
+			if(line.startsWith("Track frame offsets")) {
+				offsets = true;
+			} else if(line.startsWith("Disc length:")) {
+				offsets = false;
+				disc.frames.append(line.mid(12).trimmed().split(' ').value(0).toUInt() * 75);
+			} else if(offsets && !line.isEmpty()) {
+				disc.frames.append(line.toUInt());
+			}
+			continue;
+		}
+
+		if((separator = line.indexOf('=')) < 0)
+			continue;
+		key = line.left(separator);
+		value = line.mid(separator + 1);
+
+		// Long values continue on further lines with the same key.
+		if(key == "DISCID") {
+			for(const QByteArray &id : value.split(','))
+				disc.ids.append(id.trimmed().toUInt(nullptr, 16));
+		} else if(key == "DTITLE") {
+			dtitle += value;
+		} else if(key.startsWith("TTITLE")) {
+			track = key.mid(6).toInt();
+			if(track >= 0 && track < 100) {
+				while(disc.trackTitles.size() <= track)
+					disc.trackTitles.append(QByteArray());
+				disc.trackTitles[track] += value;
+			}
+		}
+	}
+
+	// "Artist / Title", or the title alone if artist and title are the same.
+	dtitle = toUtf8(dtitle);
+	separator = dtitle.indexOf(" / ");
+	disc.artist = separator < 0 ? dtitle : dtitle.left(separator);
+	disc.title = separator < 0 ? dtitle : dtitle.mid(separator + 3);
+	for(QByteArray &title : disc.trackTitles)
+		title = toUtf8(title);
+
+	return !disc.ids.isEmpty() && disc.frames.size() >= 2 &&
+		disc.trackTitles.size() == disc.frames.size() - 1;
+}
+
+bool KCompactDiscMetadataIndex::build(const QString &dumpDirectory, const QString &fileName)
+{
+	QList<IndexEntry> entries;
+	QByteArray records, strings;
+	QHash<QByteArray, quint32> stringOffsets;
+	IndexHeader header;
+	IndexEntry entry;
+	DumpDisc disc;
+	quint32 tracks, i;
+	int separator;
+
+	auto appendWord = [&records](quint32 word) {
+		records.append(reinterpret_cast<const char *>(&word), sizeof(word));
+	};
+	// Equal strings, e.g. the artist of every track of an album, are stored once.
+	auto appendString = [&](const QByteArray &text) {
+		QHash<QByteArray, quint32>::const_iterator it = stringOffsets.constFind(text);
+		if(it == stringOffsets.constEnd()) {
+			it = stringOffsets.insert(text, strings.size());
+			strings += text;
+		}
+		appendWord(*it);
+		appendWord(text.size());
+	};
+
+	QDirIterator dump(dumpDirectory, QDir::Files, QDirIterator::Subdirectories);
+	while(dump.hasNext()) {
+		disc = DumpDisc();
+		if(!parseDumpFile(dump.next(), disc))
+			continue;
+
+		tracks = disc.frames.size() - 1;
+		entry.record = records.size();
+		for(quint32 id : std::as_const(disc.ids)) {
+			entry.discId = id;
+			entries.append(entry);
+		}
+
+		appendWord(tracks);
+		for(quint32 frames : std::as_const(disc.frames))
+			appendWord(frames);
+
+		appendString(disc.artist);
+		appendString(disc.title);
+		for(i = 0; i < tracks; ++i) {
+			// Compilations name the artist per track.
+			const QByteArray &title = disc.trackTitles[i];
+			separator = title.indexOf(" / ");
+			appendString(separator < 0 ? disc.artist : title.left(separator));
+			appendString(separator < 0 ? title : title.mid(separator + 3));
+		}
+	}
+
+	std::stable_sort(entries.begin(), entries.end(),
+		[](const IndexEntry &a, const IndexEntry &b) { return a.discId < b.discId; });
+
+	memcpy(header.magic, indexMagic, sizeof(indexMagic));
+	header.version = indexVersion;
+	header.count = entries.size();
+	header.records = sizeof(IndexHeader) + entries.size() * sizeof(IndexEntry);
+	header.strings = header.records + records.size();
+
+	QSaveFile file(fileName);
+	if(!file.open(QIODevice::WriteOnly))
+		return false;
+
+	file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char *>(entries.constData()), entries.size() * sizeof(IndexEntry));
+	file.write(records);
+	file.write(strings);
+
+	return file.commit();
+}
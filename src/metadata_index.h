@@ -0,0 +1,71 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef METADATA_INDEX_H
+#define METADATA_INDEX_H
+
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+/*
+ * Local disc metadata, built once from a freedb format dump.
+ *
+ * The index file is mapped into memory and used as is: a table of
+ * (disc id, record) pairs sorted by disc id, the records with the frame
+ * offsets of each disc, and a heap of UTF-8 strings shared by all records.
+ * A lookup is a binary search plus one record, nothing is parsed.
+ */
+class KCompactDiscMetadataIndex
+{
+	public:
+		KCompactDiscMetadataIndex();
+		~KCompactDiscMetadataIndex();
+
+		bool open(const QString &fileName);
+		void close();
+		bool isOpen() const;
+
+		/*
+		 * Artists and titles of the disc, entry 0 is the disc itself.
+		 * Among entries sharing the disc id, the one with the same frame
+		 * offsets wins, else the first with the same number of tracks.
+		 */
+		bool lookup(unsigned discId, const QList<unsigned> &trackStartFrames,
+			QStringList &artists, QStringList &titles) const;
+
+		/*
+		 * Convert an unpacked freedb dump (category directories with one
+		 * file per disc) into an index file.
+		 */
+		static bool build(const QString &dumpDirectory, const QString &fileName);
+
+	private:
+		const uchar *at(quint32 offset, quint32 length) const;
+		QString string(const quint32 *ref) const;
+
+		QFile m_file;
+		const uchar *m_data;
+		qint64 m_size;
+		quint32 m_count;
+		quint32 m_records;
+		quint32 m_strings;
+};
+
+#endif // METADATA_INDEX_H
@@ -20,31 +20,42 @@
 #include "../include/wm_config.h"
 
 #include <config-alsa.h>
+#include <config-pipewire.h>
+#include <config-jack.h>
 
 #include <string.h>
 
-struct audio_oops *setup_phonon(const char *dev, const char *ctl);
+struct audio_oops *setup_phonon(const char *dev, const char *ctl, int latency);
 struct audio_oops *setup_arts(const char *dev, const char *ctl);
-struct audio_oops *setup_alsa(const char *dev, const char *ctl);
+struct audio_oops *setup_alsa(const char *dev, const char *ctl, int latency);
+struct audio_oops *setup_pipewire(const char *dev, const char *ctl, int latency);
+struct audio_oops *setup_jack(const char *dev, const char *ctl, int latency);
 
-struct audio_oops *setup_soundsystem(const char *ss, const char *dev, const char *ctl)
+struct audio_oops *setup_soundsystem(const char *ss, const char *dev, const char *ctl, int latency)
 {
   if(!ss) {
 	ERRORLOG("audio: Internal error, trying to setup a NULL soundsystem.\n");
     return NULL;
   }
 
-  if(!strcmp(ss, "phonon")) {
-    ERRORLOG("audio: phonon has own reader and output driver.\n");
-    return NULL;
-  }
+  /* "phonon" alone plays the disc without wmlib, see KCompactDisc */
+  if(!strcmp(ss, "phonon") || !strcmp(ss, "phonon-pcm"))
+    return setup_phonon(dev, ctl, latency);
 #ifdef USE_ARTS
   if(!strcmp(ss, "arts"))
     return setup_arts(dev, ctl);
 #endif
+#if defined(HAVE_PIPEWIRE)
+  if(!strcmp(ss, "pipewire"))
+    return setup_pipewire(dev, ctl, latency);
+#endif
+#if defined(HAVE_JACK)
+  if(!strcmp(ss, "jack"))
+    return setup_jack(dev, ctl, latency);
+#endif
 #if defined(HAVE_ALSA)
   if(!strcmp(ss, "alsa"))
-    return setup_alsa(dev, ctl);
+    return setup_alsa(dev, ctl, latency);
 #endif
 #if defined(sun) || defined(__sun__)
   if(!strcmp(ss, "sun"))
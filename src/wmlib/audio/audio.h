@@ -23,6 +23,7 @@
 #define NULL 0
 #endif
 struct wm_cdda_block;
+struct wm_audio_stats;
 
 struct audio_oops {
   int (*wmaudio_open)(void);
@@ -32,13 +33,15 @@ struct audio_oops {
   int (*wmaudio_stop)(void);
   int (*wmaudio_state)(struct wm_cdda_block*);
   int (*wmaudio_balvol)(int, int *, int *);
+  int (*wmaudio_resume)(void);
+  int (*wmaudio_stats)(struct wm_audio_stats*);
 };
 
 #ifdef __cplusplus
     extern "C" {
 #endif
 
-struct audio_oops *setup_soundsystem(const char *, const char *, const char *);
+struct audio_oops *setup_soundsystem(const char *, const char *, const char *, int);
 
 #ifdef __cplusplus
     }
@@ -25,6 +25,7 @@
 #include "audio.h"
 #include "../include/wm_struct.h"
 #include "../include/wm_config.h"
+#include "../include/wm_cdrom.h"
 
 #include <config-alsa.h>
 
@@ -34,11 +35,49 @@
 #define _DEFAULT_SOURCE /* stop glibc whining about the previous line */
 
 #include <alsa/asoundlib.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 static char *device = NULL;
 static snd_pcm_t *handle;
 
+/*
+ * The pcm is non-blocking, the play thread sleeps in poll() on the pcm
+ * descriptors and on wake_fd. Stop and pause set their flag, kick wake_fd
+ * and take pcm_mutex, which the play thread only gives up while sleeping.
+ * The play thread also checks the flags without the mutex, so they are
+ * only accessed atomically.
+ */
+static pthread_mutex_t pcm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fd = -1;
+static struct pollfd *pfds = NULL;                      /* wake_fd, then the pcm */
+static int npfds = 0;
+static unsigned int stop_seq = 0;
+static int paused = 0;
+static int can_pause = 0;
+
 static snd_pcm_format_t format = SND_PCM_FORMAT_S16;    /* sample format */
+static int use_mmap = 0;                                /* write straight into the ring */
+
+/*
+ * Period and buffer wanted by the latency profiles, in us. The device may
+ * grant less or more, see set_hwparams.
+ */
+static const struct {
+  unsigned int period_time;
+  unsigned int buffer_time;
+} profiles[] = {
+  [WM_LATENCY_LOW]        = {  10000,   40000 },
+  [WM_LATENCY_DEFAULT]    = { 100000, 2000000 },
+  [WM_LATENCY_POWERSAVE]  = { 500000, 4000000 }
+};
+static int profile = WM_LATENCY_DEFAULT;
+
+/* geometry and measured latency, under pcm_mutex */
+static struct wm_audio_stats stats;
 
 #if (SND_LIB_MAJOR < 1)
 int rate = 44100;                                /* stream rate */
@@ -66,14 +105,23 @@ snd_pcm_uframes_t period_size;
 int alsa_open(void);
 int alsa_close(void);
 int alsa_stop(void);
+int alsa_pause(void);
+int alsa_resume(void);
 int alsa_play(struct wm_cdda_block *blk);
 int alsa_state(struct wm_cdda_block *blk);
-struct audio_oops* setup_alsa(const char *dev, const char *ctl);
+int alsa_stats(struct wm_audio_stats *out);
+struct audio_oops* setup_alsa(const char *dev, const char *ctl, int latency);
 
 static int set_hwparams(snd_pcm_hw_params_t *params,
                         snd_pcm_access_t accesspar)
 {
        int err, dir;
+#if !(SND_LIB_MAJOR < 1)
+        unsigned int limit;
+#endif
+
+        buffer_time = profiles[profile].buffer_time;
+        period_time = profiles[profile].period_time;
 
         /* choose all parameters */
         err = snd_pcm_hw_params_any(handle, params);
@@ -99,21 +147,35 @@ static int set_hwparams(snd_pcm_hw_params_t *params,
                 ERRORLOG("Channels count (%i) not available for playbacks: %s\n", channels, snd_strerror(err));
                 return err;
         }
-        /* set the stream rate */
+        /* set the stream rate, let alsa-lib resample if the hardware can't */
 #if (SND_LIB_MAJOR < 1)
         err = new_rate = snd_pcm_hw_params_set_rate_near(handle, params, rate, 0);
 #else
+        snd_pcm_hw_params_set_rate_resample(handle, params, 1);
         new_rate = rate;
-        err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0);
+        err = snd_pcm_hw_params_set_rate_near(handle, params, &new_rate, 0);
 #endif
         if (err < 0) {
                 ERRORLOG("Rate %iHz not available for playback: %s\n", rate, snd_strerror(err));
                 return err;
         }
+        /* a clock a bit off is inaudible, anything else plays at the wrong pitch */
         if (new_rate != rate) {
-                ERRORLOG("Rate does not match (requested %iHz, get %iHz)\n", rate, new_rate);
-                return -EINVAL;
+                if ((new_rate > rate ? new_rate - rate : rate - new_rate) * 200 > rate) {
+                        ERRORLOG("Rate does not match (requested %iHz, get %iHz)\n", rate, new_rate);
+                        return -EINVAL;
+                }
+                DEBUGLOG("Rate does not match (requested %iHz, get %iHz), using it\n", rate, new_rate);
         }
+        /* fit the profile into the limits of the device */
+#if !(SND_LIB_MAJOR < 1)
+        if (!snd_pcm_hw_params_get_buffer_time_max(params, &limit, &dir) && buffer_time > limit)
+                buffer_time = limit;
+        if (!snd_pcm_hw_params_get_period_time_min(params, &limit, &dir) && period_time < limit)
+                period_time = limit;
+#endif
+        if (period_time > buffer_time / 2)
+                period_time = buffer_time / 2;
         /* set the buffer time */
 #if (SND_LIB_MAJOR < 1)
          err = snd_pcm_hw_params_set_buffer_time_near(handle, params, buffer_time, &dir);
@@ -163,6 +225,16 @@ static int set_hwparams(snd_pcm_hw_params_t *params,
                 ERRORLOG("Unable to set hw params for playback: %s\n", snd_strerror(err));
                 return err;
         }
+
+        memset(&stats, 0, sizeof(stats));
+        stats.profile = profile;
+        stats.rate = new_rate;
+        stats.channels = channels;
+        stats.buffer_frames = buffer_size;
+        stats.period_frames = period_size;
+        DEBUGLOG("profile %i: %uHz, buffer %lu, period %lu frames\n", profile, new_rate,
+                 (unsigned long)buffer_size, (unsigned long)period_size);
+
         return 0;
 }
 
@@ -215,20 +287,43 @@ int alsa_open( void )
   snd_pcm_hw_params_alloca(&hwparams);
   snd_pcm_sw_params_alloca(&swparams);
 
-  if((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0/*SND_PCM_NONBLOCK*/)) < 0 ) {
+  if((err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0 ) {
     ERRORLOG("open failed: %s\n", snd_strerror(err));
     return -1;
   }
 
-  if((err = set_hwparams(hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-    ERRORLOG("Setting of hwparams failed: %s\n", snd_strerror(err));
-    return -1;
+  /* mmap if the device can, read/write otherwise */
+  use_mmap = 1;
+  if(set_hwparams(hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0) {
+    use_mmap = 0;
+    if((err = set_hwparams(hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+      ERRORLOG("Setting of hwparams failed: %s\n", snd_strerror(err));
+      return -1;
+    }
   }
+  DEBUGLOG("using %s access\n", use_mmap ? "mmap" : "read/write");
+  can_pause = snd_pcm_hw_params_can_pause(hwparams);
+
   if((err = set_swparams(swparams)) < 0) {
     ERRORLOG("Setting of swparams failed: %s\n", snd_strerror(err));
     return -1;
   }
 
+  if(wake_fd < 0 && (wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    ERRORLOG("eventfd failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  npfds = snd_pcm_poll_descriptors_count(handle) + 1;
+  pfds = calloc(npfds, sizeof(struct pollfd));
+  if(!pfds || npfds < 2) {
+    ERRORLOG("Unable to get poll descriptors\n");
+    return -1;
+  }
+  pfds[0].fd = wake_fd;
+  pfds[0].events = POLLIN;
+  __atomic_store_n(&paused, 0, __ATOMIC_RELEASE);
+
   return 0;
 }
 
@@ -246,31 +341,185 @@ int alsa_close( void )
    err = snd_pcm_close(handle);
 #endif
 
+  free(pfds);
+  pfds = NULL;
+  npfds = 0;
+  if(wake_fd >= 0) {
+    close(wake_fd);
+    wake_fd = -1;
+  }
+
   free(device);
 
   return err;
 }
 
+static int alsa_recover(int err)
+{
+  if(err == -EPIPE)
+    stats.xruns++;
+  err = snd_pcm_recover(handle, err, 1);
+  if(err < 0)
+    ERRORLOG("Unable to recover pcm stream: %s\n", snd_strerror(err));
+  return err;
+}
+
+static void alsa_wakeup(void)
+{
+  uint64_t one = 1;
+
+  if(write(wake_fd, &one, sizeof(one)) < 0)
+    ERRORLOG("Unable to wake up the play thread: %s\n", strerror(errno));
+}
+
+/* whether a pause or a stop came in since the block started */
+static int alsa_interrupted(unsigned int seq)
+{
+  return __atomic_load_n(&paused, __ATOMIC_ACQUIRE) ||
+    __atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE) != seq;
+}
+
 /*
- * Play some audio and pass a status message upstream, if applicable.
- * Returns 0 on success.
+ * Sleep until the pcm has room, or until a stop. While paused only
+ * wake_fd is polled. Called with pcm_mutex held.
+ * Returns 0 if there may be room, 1 if stopped, < 0 on error.
  */
-int
-alsa_play(struct wm_cdda_block *blk)
+static int alsa_wait(unsigned int seq)
+{
+  unsigned short revents;
+  uint64_t count;
+  int err, sleeping;
+
+  for(;;) {
+    if(__atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE) != seq)
+      return 1;
+
+    sleeping = __atomic_load_n(&paused, __ATOMIC_ACQUIRE);
+    if(!sleeping && (err = snd_pcm_poll_descriptors(handle, pfds + 1, npfds - 1)) < 0)
+      return err;
+
+    pthread_mutex_unlock(&pcm_mutex);
+    err = poll(pfds, sleeping ? 1 : npfds, sleeping ? -1 : 1000);
+    pthread_mutex_lock(&pcm_mutex);
+
+    if(err < 0) {
+      if(errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if(pfds[0].revents & POLLIN) {
+      if(read(wake_fd, &count, sizeof(count)) < 0)
+        ERRORLOG("Unable to read the wake up: %s\n", strerror(errno));
+      continue;
+    }
+    if(sleeping)
+      continue;
+    if(!err)
+      return 0;
+
+    err = snd_pcm_poll_descriptors_revents(handle, pfds + 1, npfds - 1, &revents);
+    if(err < 0)
+      return err;
+    if(revents & POLLERR)
+      return -EPIPE;
+    if(revents & POLLOUT)
+      return 0;
+  }
+}
+
+/*
+ * mmap access: the block is copied right into the ring of the device,
+ * there is no intermediate buffer inside alsa-lib.
+ */
+static int
+alsa_play_mmap(struct wm_cdda_block *blk, unsigned int seq)
+{
+  const signed short *ptr = (const signed short *)blk->buf;
+  snd_pcm_uframes_t frames = blk->buflen / (channels * 2);
+  snd_pcm_uframes_t offset, size;
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_sframes_t avail, committed;
+  signed short *ring;
+  int err;
+
+  while(frames > 0) {
+    if(alsa_interrupted(seq)) {
+      if((err = alsa_wait(seq)) > 0)
+        return 0;
+      if(err < 0 && (err = alsa_recover(err)) < 0)
+        return err;
+      continue;
+    }
+
+    avail = snd_pcm_avail_update(handle);
+    if(avail < 0) {
+      if((err = alsa_recover(avail)) < 0)
+        return err;
+      continue;
+    }
+
+    if((snd_pcm_uframes_t)avail < period_size && (snd_pcm_uframes_t)avail < frames) {
+      /* the ring is full, start it or wait for room */
+      if(snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+        err = snd_pcm_start(handle);
+      else if((err = alsa_wait(seq)) > 0)
+        return 0;
+      if(err < 0 && (err = alsa_recover(err)) < 0)
+        return err;
+      continue;
+    }
+
+    size = frames;
+    err = snd_pcm_mmap_begin(handle, &areas, &offset, &size);
+    if(err < 0) {
+      if((err = alsa_recover(err)) < 0)
+        return err;
+      continue;
+    }
+
+    ring = (signed short *)((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+    memcpy(ring, ptr, size * channels * 2);
+
+    committed = snd_pcm_mmap_commit(handle, offset, size);
+    if(committed < 0 || (snd_pcm_uframes_t)committed != size) {
+      if((err = alsa_recover(committed >= 0 ? -EPIPE : committed)) < 0)
+        return err;
+    }
+
+    ptr += size * channels;
+    frames -= size;
+  }
+
+  return 0;
+}
+
+/*
+ * read/write access, the fallback if the device has no mmap support.
+ */
+static int
+alsa_play_rw(struct wm_cdda_block *blk, unsigned int seq)
 {
-  signed short *ptr;
+  const signed short *ptr;
   int err = 0, frames;
 
-  ptr = (signed short *)blk->buf;
+  ptr = (const signed short *)blk->buf;
   frames = blk->buflen / (channels * 2);
   DEBUGLOG("play %i frames, %lu bytes\n", frames, blk->buflen);
   while (frames > 0) {
-    err = snd_pcm_writei(handle, ptr, frames);
+    if(alsa_interrupted(seq))
+      err = -EAGAIN;
+    else
+      err = snd_pcm_writei(handle, ptr, frames);
 
-    if (err == -EAGAIN)
-      continue;
-    if(err == -EPIPE) {
-      err = snd_pcm_prepare(handle);
+    if (err == -EAGAIN) {
+      if((err = alsa_wait(seq)) > 0)
+        return 0;
+      if(err == 0)
+        continue;
+    }
+    if(err == -EPIPE || err == -ESTRPIPE) {
+      if((err = alsa_recover(err)) < 0)
+        break;
       continue;
     } else if (err < 0)
       break;
@@ -280,6 +529,25 @@ alsa_play(struct wm_cdda_block *blk)
     DEBUGLOG("played %i, rest %i\n", err, frames);
   }
 
+  return err < 0 ? err : 0;
+}
+
+/*
+ * Play some audio and pass a status message upstream, if applicable.
+ * Returns 0 on success.
+ */
+int
+alsa_play(struct wm_cdda_block *blk)
+{
+  snd_pcm_sframes_t delay;
+  unsigned int seq;
+  int err;
+
+  pthread_mutex_lock(&pcm_mutex);
+  seq = __atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE);
+
+  err = use_mmap ? alsa_play_mmap(blk, seq) : alsa_play_rw(blk, seq);
+
   if (err < 0) {
     ERRORLOG("alsa_write failed: %s\n", snd_strerror(err));
     err = snd_pcm_prepare(handle);
@@ -288,9 +556,30 @@ alsa_play(struct wm_cdda_block *blk)
       ERRORLOG("Unable to snd_pcm_prepare pcm stream: %s\n", snd_strerror(err));
     }
     blk->status = WM_CDM_CDDAERROR;
+    pthread_mutex_unlock(&pcm_mutex);
     return err;
   }
 
+  /* what is queued in front of the block's end is its latency */
+  if(!snd_pcm_delay(handle, &delay) && delay > 0)
+    stats.device_latency_us = (unsigned long long)delay * 1000000 / new_rate;
+  else
+    stats.device_latency_us = 0;
+
+  pthread_mutex_unlock(&pcm_mutex);
+  return 0;
+}
+
+/*
+ * Geometry of the device and the latency when the last block was queued.
+ */
+int
+alsa_stats(struct wm_audio_stats *out)
+{
+  pthread_mutex_lock(&pcm_mutex);
+  *out = stats;
+  pthread_mutex_unlock(&pcm_mutex);
+
   return 0;
 }
 
@@ -304,6 +593,12 @@ alsa_stop( void )
 
   DEBUGLOG("alsa_stop\n");
 
+  /* throw the play thread out of its block, then drop what is queued */
+  __atomic_add_fetch(&stop_seq, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&paused, 0, __ATOMIC_RELEASE);
+  alsa_wakeup();
+
+  pthread_mutex_lock(&pcm_mutex);
   err = snd_pcm_drop(handle);
   if (err < 0) {
     ERRORLOG("Unable to drop pcm stream: %s\n", snd_strerror(err));
@@ -313,6 +608,59 @@ alsa_stop( void )
   if (err < 0) {
     ERRORLOG("Unable to snd_pcm_prepare pcm stream: %s\n", snd_strerror(err));
   }
+  pthread_mutex_unlock(&pcm_mutex);
+
+  return err;
+}
+
+/*
+ * Pause the audio immediately. Without hardware pause the queued
+ * audio is dropped, the rest of the current block stays.
+ */
+int
+alsa_pause( void )
+{
+  int err;
+
+  DEBUGLOG("alsa_pause\n");
+
+  __atomic_store_n(&paused, 1, __ATOMIC_RELEASE);
+  alsa_wakeup();
+
+  pthread_mutex_lock(&pcm_mutex);
+  if(snd_pcm_state(handle) != SND_PCM_STATE_RUNNING)
+    err = 0;
+  else if(can_pause)
+    err = snd_pcm_pause(handle, 1);
+  else if(!(err = snd_pcm_drop(handle)))
+    err = snd_pcm_prepare(handle);
+  pthread_mutex_unlock(&pcm_mutex);
+
+  if (err < 0) {
+    ERRORLOG("Unable to pause pcm stream: %s\n", snd_strerror(err));
+  }
+
+  return err;
+}
+
+int
+alsa_resume( void )
+{
+  int err = 0;
+
+  DEBUGLOG("alsa_resume\n");
+
+  pthread_mutex_lock(&pcm_mutex);
+  if(snd_pcm_state(handle) == SND_PCM_STATE_PAUSED)
+    err = snd_pcm_pause(handle, 0);
+  __atomic_store_n(&paused, 0, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pcm_mutex);
+
+  alsa_wakeup();
+
+  if (err < 0) {
+    ERRORLOG("Unable to resume pcm stream: %s\n", snd_strerror(err));
+  }
 
   return err;
 }
@@ -321,13 +669,16 @@ static struct audio_oops alsa_oops = {
   .wmaudio_open    = alsa_open,
   .wmaudio_close   = alsa_close,
   .wmaudio_play    = alsa_play,
+  .wmaudio_pause   = alsa_pause,
+  .wmaudio_resume  = alsa_resume,
   .wmaudio_stop    = alsa_stop,
   .wmaudio_state   = NULL,
-  .wmaudio_balvol  = NULL
+  .wmaudio_balvol  = NULL,
+  .wmaudio_stats   = alsa_stats
 };
 
 struct audio_oops*
-setup_alsa(const char *dev, const char *ctl)
+setup_alsa(const char *dev, const char *ctl, int latency)
 {
   static int init_complete = 0;
 
@@ -344,6 +695,9 @@ setup_alsa(const char *dev, const char *ctl)
     device = strdup("plughw:0,0"); /* playback device */
   }
 
+  if(latency >= WM_LATENCY_LOW && latency <= WM_LATENCY_POWERSAVE)
+    profile = latency;
+
   if(!alsa_open())
     init_complete = 1;
   else
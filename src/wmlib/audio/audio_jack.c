@@ -0,0 +1,582 @@
+/*  This file is part of the KDE project
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License version 2 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include "audio.h"
+#include "../include/wm_struct.h"
+#include "../include/wm_config.h"
+#include "../include/wm_cdrom.h"
+
+#include <config-jack.h>
+
+#ifdef HAVE_JACK
+
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+#ifdef HAVE_SAMPLERATE
+#include <samplerate.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CDDA_RATE 44100
+#define CDDA_STRIDE 4   /* S16, 2 channels */
+#define FLOAT_STRIDE (2 * sizeof(float))
+
+static char *device = NULL;
+static int profile = WM_LATENCY_DEFAULT;
+
+/*
+ * The play thread fills ring, the process callback drains it. The callback
+ * never blocks: it only trylocks ring_mutex to wake a waiting play thread,
+ * which therefore waits with a timeout. Stop asks the callback to drop the
+ * ring up to what was written by then, only the reader side may move the
+ * read pointer. written and consumed count bytes since the open, the flags
+ * are shared between threads and only accessed atomically.
+ */
+static jack_client_t *client = NULL;
+static jack_port_t *ports[2];
+static jack_ringbuffer_t *ring = NULL;
+static pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int stop_seq = 0;
+static unsigned long written = 0;       /* play thread */
+static unsigned long consumed = 0;      /* process callback */
+static unsigned long drop_to = 0;       /* written at the last stop */
+static int paused = 0;
+static int running = 0;                 /* the ring was filled once, underruns count */
+static int server_gone = 0;             /* the server shut the client down */
+static unsigned long xruns = 0;
+static jack_nframes_t server_rate;
+static size_t stride = CDDA_STRIDE;     /* FLOAT_STRIDE behind the resampler */
+
+/* gain of the conversion, 1/32768 at full volume */
+static volatile float gain_left = 1.0f / 32768;
+static volatile float gain_right = 1.0f / 32768;
+static int volume_left = 100;
+static int volume_right = 100;
+
+#ifdef HAVE_SAMPLERATE
+static SRC_STATE *resampler = NULL;
+static unsigned int resampler_seq = 0;  /* stop_seq the resampler state belongs to */
+static float *src_in = NULL, *src_out = NULL;
+static long src_out_frames = 0;
+#endif
+
+/* ring length per latency profile, in frames */
+static const unsigned int ring_frames[] = {
+  [WM_LATENCY_LOW]        = 2048,
+  [WM_LATENCY_DEFAULT]    = 22050,
+  [WM_LATENCY_POWERSAVE]  = 88200
+};
+
+int wmjack_open(void);
+int wmjack_close(void);
+int wmjack_play(struct wm_cdda_block *blk);
+int wmjack_pause(void);
+int wmjack_resume(void);
+int wmjack_stop(void);
+int wmjack_balvol(int setit, int *left, int *right);
+int wmjack_stats(struct wm_audio_stats *out);
+struct audio_oops* setup_jack(const char *dev, const char *ctl, int latency);
+
+/*
+ * S16 interleaved to float planar, scaled. SSE2 converts four frames per
+ * step, the tail and other CPUs take the scalar loop.
+ */
+static void convert_frames(float *left, float *right, const short *src, jack_nframes_t frames)
+{
+  const float gl = gain_left, gr = gain_right;
+  jack_nframes_t i = 0;
+
+#ifdef __SSE2__
+  const __m128 vgl = _mm_set1_ps(gl), vgr = _mm_set1_ps(gr);
+  __m128i v, lo, hi;
+  __m128 flo, fhi;
+
+  for(; i + 4 <= frames; i += 4) {
+    v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    /* sign extend L0 R0 L1 R1 and L2 R2 L3 R3 */
+    lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+    hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+    flo = _mm_cvtepi32_ps(lo);
+    fhi = _mm_cvtepi32_ps(hi);
+    _mm_storeu_ps(left + i, _mm_mul_ps(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(2, 0, 2, 0)), vgl));
+    _mm_storeu_ps(right + i, _mm_mul_ps(_mm_shuffle_ps(flo, fhi, _MM_SHUFFLE(3, 1, 3, 1)), vgr));
+  }
+#endif
+
+  for(; i < frames; i++) {
+    left[i] = src[2 * i] * gl;
+    right[i] = src[2 * i + 1] * gr;
+  }
+}
+
+#ifdef HAVE_SAMPLERATE
+/*
+ * The resampler output stays in float, interleaved to planar.
+ */
+static void convert_float_frames(float *left, float *right, const float *src, jack_nframes_t frames)
+{
+  const float gl = gain_left * 32768, gr = gain_right * 32768;
+  jack_nframes_t i;
+
+  for(i = 0; i < frames; i++) {
+    left[i] = src[2 * i] * gl;
+    right[i] = src[2 * i + 1] * gr;
+  }
+}
+#endif
+
+static void wakeup_writer(void)
+{
+  if(!pthread_mutex_trylock(&ring_mutex)) {
+    pthread_cond_signal(&ring_cond);
+    pthread_mutex_unlock(&ring_mutex);
+  }
+}
+
+static int wmjack_process(jack_nframes_t nframes, void *arg)
+{
+  float *left = jack_port_get_buffer(ports[0], nframes);
+  float *right = jack_port_get_buffer(ports[1], nframes);
+  jack_ringbuffer_data_t vec[2];
+  jack_nframes_t done = 0, n;
+  unsigned long drop;
+  size_t space;
+  int i;
+
+  (void) arg;
+
+  /* a play() right after the stop may have written already, keep that */
+  drop = __atomic_load_n(&drop_to, __ATOMIC_ACQUIRE) - consumed;
+  if(drop && drop <= ULONG_MAX / 2) {
+    space = jack_ringbuffer_read_space(ring);
+    if(drop > space)
+      drop = space;
+    jack_ringbuffer_read_advance(ring, drop);
+    consumed += drop;
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+  }
+
+  if(!__atomic_load_n(&paused, __ATOMIC_ACQUIRE)) {
+    jack_ringbuffer_get_read_vector(ring, vec);
+    for(i = 0; i < 2 && done < nframes; i++) {
+      n = vec[i].len / stride;
+      if(n > nframes - done)
+        n = nframes - done;
+#ifdef HAVE_SAMPLERATE
+      if(stride == FLOAT_STRIDE)
+        convert_float_frames(left + done, right + done, (const float *)vec[i].buf, n);
+      else
+#endif
+        convert_frames(left + done, right + done, (const short *)vec[i].buf, n);
+      done += n;
+    }
+    jack_ringbuffer_read_advance(ring, done * stride);
+    consumed += done * stride;
+    if(done < nframes && __atomic_exchange_n(&running, 0, __ATOMIC_RELAXED))
+      __atomic_add_fetch(&xruns, 1, __ATOMIC_RELAXED);
+  }
+
+  if(done < nframes) {
+    memset(left + done, 0, (nframes - done) * sizeof(float));
+    memset(right + done, 0, (nframes - done) * sizeof(float));
+  }
+
+  if(done)
+    wakeup_writer();
+
+  return 0;
+}
+
+static int wmjack_xrun(void *arg)
+{
+  (void) arg;
+  __atomic_add_fetch(&xruns, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/*
+ * The client stays open, wmjack_close() still has to close it.
+ */
+static void wmjack_shutdown(void *arg)
+{
+  (void) arg;
+  ERRORLOG("jack server went away\n");
+  __atomic_store_n(&server_gone, 1, __ATOMIC_RELEASE);
+  wakeup_writer();
+}
+
+static void connect_ports(void)
+{
+  const char **targets;
+  int i;
+
+  /* the device is a pattern for the ports to feed, the speakers otherwise */
+  targets = jack_get_ports(client, device, JACK_DEFAULT_AUDIO_TYPE,
+    JackPortIsInput | (device ? 0 : JackPortIsPhysical));
+  if(!targets) {
+    ERRORLOG("no jack ports to connect to\n");
+    return;
+  }
+
+  for(i = 0; i < 2 && targets[i]; i++) {
+    if(jack_connect(client, jack_port_name(ports[i]), targets[i]))
+      ERRORLOG("Unable to connect to %s\n", targets[i]);
+  }
+  jack_free(targets);
+}
+
+int wmjack_open(void)
+{
+  jack_status_t status;
+#ifdef HAVE_SAMPLERATE
+  int err;
+#endif
+
+  DEBUGLOG("wmjack_open\n");
+
+  client = jack_client_open("kcompactdisc", JackNoStartServer, &status);
+  if(!client) {
+    ERRORLOG("Unable to open a jack client, status 0x%x\n", status);
+    return -1;
+  }
+
+  server_rate = jack_get_sample_rate(client);
+  stride = CDDA_STRIDE;
+  if(server_rate != CDDA_RATE) {
+#ifdef HAVE_SAMPLERATE
+    resampler = src_new(SRC_SINC_BEST_QUALITY, 2, &err);
+    if(!resampler) {
+      ERRORLOG("Unable to create the resampler: %s\n", src_strerror(err));
+      goto open_failed;
+    }
+    DEBUGLOG("resampling from %u to %u Hz\n", CDDA_RATE, server_rate);
+    stride = FLOAT_STRIDE;
+#else
+    ERRORLOG("jack runs at %u Hz and there is no resampler\n", server_rate);
+    goto open_failed;
+#endif
+  }
+
+  ring = jack_ringbuffer_create(ring_frames[profile] * stride);
+  ports[0] = jack_port_register(client, "out_left", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  ports[1] = jack_port_register(client, "out_right", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+  if(!ring || !ports[0] || !ports[1]) {
+    ERRORLOG("Unable to register the jack ports\n");
+    goto open_failed;
+  }
+  jack_ringbuffer_mlock(ring);
+
+  jack_set_process_callback(client, wmjack_process, NULL);
+  jack_set_xrun_callback(client, wmjack_xrun, NULL);
+  jack_on_shutdown(client, wmjack_shutdown, NULL);
+
+  stop_seq = 0;
+  written = consumed = drop_to = 0;
+  paused = 0;
+  running = 0;
+  server_gone = 0;
+  xruns = 0;
+#ifdef HAVE_SAMPLERATE
+  resampler_seq = 0;
+#endif
+
+  if(jack_activate(client)) {
+    ERRORLOG("Unable to activate the jack client\n");
+    goto open_failed;
+  }
+  connect_ports();
+
+  return 0;
+
+open_failed:
+  wmjack_close();
+  return -1;
+}
+
+int wmjack_close(void)
+{
+  DEBUGLOG("wmjack_close\n");
+
+  if(client) {
+    if(!__atomic_load_n(&server_gone, __ATOMIC_ACQUIRE))
+      jack_deactivate(client);
+    jack_client_close(client);
+    client = NULL;
+  }
+  if(ring) {
+    jack_ringbuffer_free(ring);
+    ring = NULL;
+  }
+#ifdef HAVE_SAMPLERATE
+  if(resampler)
+    resampler = src_delete(resampler);
+  free(src_in);
+  free(src_out);
+  src_in = src_out = NULL;
+  src_out_frames = 0;
+#endif
+
+  return 0;
+}
+
+/*
+ * Wait a little for room in the ring. 0 if there may be room, 1 if stopped.
+ */
+static int wait_for_room(unsigned int seq)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 20000000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&ring_mutex);
+  if(__atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE) == seq
+    && !__atomic_load_n(&server_gone, __ATOMIC_ACQUIRE))
+    pthread_cond_timedwait(&ring_cond, &ring_mutex, &ts);
+  pthread_mutex_unlock(&ring_mutex);
+
+  return __atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE) != seq;
+}
+
+static int write_frames(const char *buf, size_t len, unsigned int seq)
+{
+  size_t n;
+
+  while(len > 0) {
+    if(__atomic_load_n(&server_gone, __ATOMIC_ACQUIRE))
+      return -1;
+    if(__atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE) != seq)
+      return 1;
+
+    n = jack_ringbuffer_write_space(ring);
+    n -= n % stride;
+    if(!n) {
+      __atomic_store_n(&running, 1, __ATOMIC_RELAXED);
+      if(wait_for_room(seq))
+        return 1;
+      continue;
+    }
+
+    if(n > len)
+      n = len;
+    jack_ringbuffer_write(ring, buf, n);
+    __atomic_store_n(&written, written + n, __ATOMIC_RELEASE);
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+#ifdef HAVE_SAMPLERATE
+/*
+ * Resample a block to the rate of the server. The ring takes the float
+ * output as it is, there is no second quantisation to S16.
+ */
+static int resample_frames(struct wm_cdda_block *blk, unsigned int seq)
+{
+  long frames = blk->buflen / CDDA_STRIDE, needed;
+  SRC_DATA data;
+  int err;
+
+  /* nothing of what was resampled before the last stop carries over */
+  if(seq != resampler_seq) {
+    src_reset(resampler);
+    resampler_seq = seq;
+  }
+
+  needed = (long)((double)frames * server_rate / CDDA_RATE) + 64;
+  if(needed > src_out_frames) {
+    free(src_in);
+    free(src_out);
+    src_in = malloc(frames * 2 * sizeof(float));
+    src_out = malloc(needed * 2 * sizeof(float));
+    src_out_frames = (src_in && src_out) ? needed : 0;
+    if(!src_out_frames)
+      return -1;
+  }
+
+  src_short_to_float_array((const short *)blk->buf, src_in, frames * 2);
+
+  memset(&data, 0, sizeof(data));
+  data.data_in = src_in;
+  data.input_frames = frames;
+  data.data_out = src_out;
+  data.output_frames = src_out_frames;
+  data.src_ratio = (double)server_rate / CDDA_RATE;
+  if((err = src_process(resampler, &data))) {
+    ERRORLOG("resampling failed: %s\n", src_strerror(err));
+    return -1;
+  }
+
+  return write_frames((const char *)src_out, data.output_frames_gen * FLOAT_STRIDE, seq);
+}
+#endif
+
+/*
+ * Queue a block for the process callback.
+ * Returns 0 on success.
+ */
+int
+wmjack_play(struct wm_cdda_block *blk)
+{
+  unsigned int seq = __atomic_load_n(&stop_seq, __ATOMIC_ACQUIRE);
+  int err;
+
+#ifdef HAVE_SAMPLERATE
+  if(resampler)
+    err = resample_frames(blk, seq);
+  else
+#endif
+    err = write_frames(blk->buf, blk->buflen, seq);
+
+  if(err < 0) {
+    ERRORLOG("wmjack_play failed\n");
+    blk->status = WM_CDM_CDDAERROR;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+wmjack_pause(void)
+{
+  DEBUGLOG("wmjack_pause\n");
+
+  __atomic_store_n(&paused, 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int
+wmjack_resume(void)
+{
+  DEBUGLOG("wmjack_resume\n");
+
+  __atomic_store_n(&paused, 0, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/*
+ * Stop the audio immediately. Drops what was written so far, not what a
+ * next play() writes.
+ */
+int
+wmjack_stop(void)
+{
+  DEBUGLOG("wmjack_stop\n");
+
+  pthread_mutex_lock(&ring_mutex);
+  __atomic_add_fetch(&stop_seq, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&drop_to, __atomic_load_n(&written, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  __atomic_store_n(&paused, 0, __ATOMIC_RELEASE);
+  pthread_cond_signal(&ring_cond);
+  pthread_mutex_unlock(&ring_mutex);
+
+  return 0;
+}
+
+/*
+ * Volume of the conversion, left and right in percent.
+ */
+int
+wmjack_balvol(int setit, int *left, int *right)
+{
+  if(setit) {
+    volume_left = *left < 0 ? 0 : (*left > 100 ? 100 : *left);
+    volume_right = *right < 0 ? 0 : (*right > 100 ? 100 : *right);
+    gain_left = volume_left / (100.0f * 32768);
+    gain_right = volume_right / (100.0f * 32768);
+  } else {
+    *left = volume_left;
+    *right = volume_right;
+  }
+
+  return 0;
+}
+
+int
+wmjack_stats(struct wm_audio_stats *out)
+{
+  jack_latency_range_t range = { 0, 0 };
+  unsigned long queued;
+
+  memset(out, 0, sizeof(*out));
+  if(!client || __atomic_load_n(&server_gone, __ATOMIC_ACQUIRE))
+    return -1;
+
+  out->profile = profile;
+  out->rate = server_rate;
+  out->channels = 2;
+  out->buffer_frames = ring_frames[profile];
+  out->period_frames = jack_get_buffer_size(client);
+  out->xruns = __atomic_load_n(&xruns, __ATOMIC_RELAXED);
+
+  jack_port_get_latency_range(ports[0], JackPlaybackLatency, &range);
+  queued = jack_ringbuffer_read_space(ring) / stride + range.max;
+  out->device_latency_us = (unsigned long long)queued * 1000000 / server_rate;
+
+  return 0;
+}
+
+static struct audio_oops wmjack_oops = {
+  .wmaudio_open    = wmjack_open,
+  .wmaudio_close   = wmjack_close,
+  .wmaudio_play    = wmjack_play,
+  .wmaudio_pause   = wmjack_pause,
+  .wmaudio_resume  = wmjack_resume,
+  .wmaudio_stop    = wmjack_stop,
+  .wmaudio_state   = NULL,
+  .wmaudio_balvol  = wmjack_balvol,
+  .wmaudio_stats   = wmjack_stats
+};
+
+struct audio_oops*
+setup_jack(const char *dev, const char *ctl, int latency)
+{
+  DEBUGLOG("setup_jack\n");
+
+  wmjack_close();
+
+  free(device);
+  device = (dev && strlen(dev) > 0) ? strdup(dev) : NULL;
+  if(latency >= WM_LATENCY_LOW && latency <= WM_LATENCY_POWERSAVE)
+    profile = latency;
+
+  if(wmjack_open())
+    return NULL;
+
+  return &wmjack_oops;
+}
+
+#endif /* HAVE_JACK */
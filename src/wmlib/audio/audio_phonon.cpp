@@ -19,65 +19,125 @@
 */
 
 #include "audio_phonon.h"
-#include "audio.h"
 
-#include <QDataStream>
+extern "C"
+{
+    #include "audio.h"
+    #include "../include/wm_struct.h"
+    #include "../include/wm_config.h"
+    #include "../include/wm_cdrom.h"
+    #include "../include/wm_helpers.h"
+}
+
+#include <QCoreApplication>
+#include <QMutexLocker>
+#include <QThread>
+
+#include <phonon/AudioOutput>
+#include <phonon/MediaObject>
+#include <phonon/Path>
+
+#include <cstring>
+
+/* one chunk handed to Phonon per latency profile, in frames */
+static const qint64 chunkFrames[] = { 441, 4410, 22050 };
+
+LibWMPcmRing::LibWMPcmRing(qint64 size) :
+    m_head(0),
+    m_tail(0)
+{
+    qint64 capacity = 1;
+
+    while(capacity < size)
+        capacity <<= 1;
+    m_data.resize(capacity);
+    m_mask = capacity - 1;
+}
+
+qint64 LibWMPcmRing::available() const
+{
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+}
 
-#include <phonon/audiooutput.h>
-#include <phonon/audiopath.h>
-#include <phonon/mediaobject.h>
+qint64 LibWMPcmRing::write(const char *data, qint64 len)
+{
+    const quint64 head = m_head.load(std::memory_order_relaxed);
+    const quint64 tail = m_tail.load(std::memory_order_acquire);
+    qint64 offset = head & m_mask, first;
+
+    len = qMin(len, size() - qint64(head - tail));
+    first = qMin(len, size() - offset);
+    memcpy(m_data.data() + offset, data, first);
+    memcpy(m_data.data(), data + first, len - first);
+
+    m_head.store(head + len, std::memory_order_release);
+    return len;
+}
 
-LibWMPcmPlayer::LibWMPcmPlayer() : AbstractMediaStream(NULL),
-    m_media(NULL),
-    m_cmd(WM_CDM_UNKNOWN),
-    m_blk(NULL)
+qint64 LibWMPcmRing::read(char *data, qint64 len)
 {
-    Phonon::AudioOutput* m_output = new Phonon::AudioOutput(Phonon::MusicCategory, this);
-    Phonon::AudioPath* m_path = new Phonon::AudioPath(this);
-    m_path->addOutput(m_output);
+    const quint64 tail = m_tail.load(std::memory_order_relaxed);
+    const quint64 head = m_head.load(std::memory_order_acquire);
+    qint64 offset = tail & m_mask, first;
+
+    len = qMin(len, qint64(head - tail));
+    first = qMin(len, size() - offset);
+    memcpy(data, m_data.constData() + offset, first);
+    memcpy(data + first, m_data.constData(), len - first);
+
+    m_tail.store(tail + len, std::memory_order_release);
+    return len;
+}
+
+void LibWMPcmRing::dropTo(quint64 position)
+{
+    if(position > m_tail.load(std::memory_order_relaxed))
+        m_tail.store(position, std::memory_order_release);
+}
+
+LibWMPcmPlayer::LibWMPcmPlayer(int latency) :
+    AbstractMediaStream(nullptr),
+    m_media(nullptr),
+    m_output(nullptr),
+    m_ring(4 * chunkFrames[latency] * 4),
+    m_chunkSize(chunkFrames[latency] * 4),
+    m_wanted(false),
+    m_feedQueued(false),
+    m_started(false),
+    m_stopSeq(0),
+    m_volume(100)
+{
+    m_chunk.resize(m_chunkSize);
+
+    m_output = new Phonon::AudioOutput(Phonon::MusicCategory, this);
     m_media = new Phonon::MediaObject(this);
-    m_media->addAudioPath(m_path);
-    m_media->setCurrentSource(this);
+    Phonon::createPath(m_media, m_output);
+    m_media->setCurrentSource(Phonon::MediaSource(this));
     setStreamSeekable(false);
     setStreamSize(0xffffffff);
 
-    connect(this, &LibWMPcmPlayer::cmdChanged, this, &LibWMPcmPlayer::executeCmd);
-    connect(this, &LibWMPcmPlayer::nextBuffer, this, &LibWMPcmPlayer::playBuffer);
-    connect(m_media, &Phonon::MediaObject::stateChanged,
-        this, &LibWMPcmPlayer::stateChanged);
-
     DEBUGLOG("writeHeader\n");
-    writeData( wavHeader() );
+    writeData(wavHeader());
     DEBUGLOG("writeHeader end\n");
 }
 
 LibWMPcmPlayer::~LibWMPcmPlayer()
 {
-    stop();
+    m_stopSeq++;
+    m_space.wakeAll();
+    m_media->stop();
 }
 
-QByteArray LibWMPcmPlayer::wavHeader() const
+/*
+ * Same header as the stream server and the recorder, of endless length.
+ */
+QByteArray LibWMPcmPlayer::wavHeader()
 {
-    QByteArray data;
-    QDataStream stream( &data, QIODevice::WriteOnly );
-    stream.setByteOrder( QDataStream::LittleEndian );
-    stream
-        << 0x46464952 //"RIFF"
-        << static_cast<quint32>( 0x7FFFFFFF )
-        << 0x45564157 //"WAVE"
-        << 0x20746D66 //"fmt "           //Subchunk1ID
-        << static_cast<quint32>( 16 )    //Subchunk1Size
-        << static_cast<quint16>( 1 )     //AudioFormat
-        << static_cast<quint16>( 2 )     //NumChannels
-        << static_cast<quint32>( 44100 ) //SampleRate
-        << static_cast<quint32>( 2*2*44100 )//ByteRate
-        << static_cast<quint16>( 2*2 )   //BlockAlign
-        << static_cast<quint16>( 16 )    //BitsPerSample
-        << 0x61746164 //"data"                   //Subchunk2ID
-        << static_cast<quint32>( 0x7FFFFFFF-36 )//Subchunk2Size
-        ;
-
-    return data;
+    unsigned char header[WM_WAV_HEADER_SIZE];
+
+    wm_wav_header(header, 0x7FFFFFFF - 36);
+
+    return QByteArray(reinterpret_cast<const char *>(header), sizeof(header));
 }
 
 void LibWMPcmPlayer::reset()
@@ -91,128 +151,215 @@ void LibWMPcmPlayer::reset()
 
 void LibWMPcmPlayer::needData()
 {
-    DEBUGLOG("needData\n");
-    m_mutex.lock();
-    m_readyToPlay.wakeAll();
-    m_mutex.unlock();
-
+    m_wanted = true;
+    feed();
 }
 
-void LibWMPcmPlayer::setNextBuffer(struct cdda_block *blk)
+void LibWMPcmPlayer::enoughData()
 {
-    Q_EMIT nextBuffer(blk);
-    m_mutex.lock();
-    m_readyToPlay.wait(&m_mutex);
-    m_mutex.unlock();
+    m_wanted = false;
 }
 
-void LibWMPcmPlayer::playBuffer(struct cdda_block *blk)
+/*
+ * In the thread of the player. Hands over what the ring has in chunks
+ * until Phonon has enough. The chunk is only reallocated if the backend
+ * still holds the previous one.
+ */
+void LibWMPcmPlayer::feed()
 {
-    if(m_cmd != WM_CDM_PLAYING) {
-        Q_EMIT cmdChanged(WM_CDM_PLAYING);
-        m_cmd = WM_CDM_PLAYING;
+    qint64 len;
+
+    m_feedQueued = false;
+    while(m_wanted && (len = m_ring.read(m_chunk.data(), m_chunkSize)) > 0) {
+        m_space.wakeAll();
+        m_chunk.resize(len);
+        writeData(m_chunk);
+        m_chunk.resize(m_chunkSize);
     }
-    writeData(QByteArray(blk->buf, blk->buflen));
-
 }
 
-void LibWMPcmPlayer::pause(void)
+int LibWMPcmPlayer::play(struct wm_cdda_block *blk)
 {
-    if(m_cmd != WM_CDM_PAUSED) {
-        Q_EMIT cmdChanged(WM_CDM_PAUSED);
-        m_cmd = WM_CDM_PAUSED;
-
-        m_readyToPlay.wakeAll();
+    const unsigned int seq = m_stopSeq;
+    const char *data = blk->buf;
+    qint64 len = blk->buflen, n;
+
+    while(len > 0 && seq == m_stopSeq) {
+        n = m_ring.write(data, len);
+        data += n;
+        len -= n;
+
+        if(!m_started.exchange(true))
+            QMetaObject::invokeMethod(this, [this]() { m_media->play(); });
+
+        // Phonon asked while the ring was empty.
+        if(n && m_wanted && !m_feedQueued.exchange(true))
+            QMetaObject::invokeMethod(this, [this]() { feed(); });
+
+        if(len > 0) {
+            QMutexLocker locker(&m_mutex);
+            if(m_ring.available() == m_ring.size() && seq == m_stopSeq)
+                m_space.wait(&m_mutex, 100);
+        }
     }
+
+    return 0;
 }
 
-void LibWMPcmPlayer::stop(void)
+void LibWMPcmPlayer::pause()
 {
-    if(m_cmd != WM_CDM_STOPPED) {
-        Q_EMIT cmdChanged(WM_CDM_STOPPED);
-        m_cmd = WM_CDM_STOPPED;
+    QMetaObject::invokeMethod(this, [this]() { m_media->pause(); });
+}
 
-        m_readyToPlay.wakeAll();
-    }
+void LibWMPcmPlayer::resume()
+{
+    QMetaObject::invokeMethod(this, [this]() { m_media->play(); });
 }
 
-void LibWMPcmPlayer::executeCmd(int cmd)
+/*
+ * Drops everything written so far, not what a next play() writes.
+ */
+void LibWMPcmPlayer::stop()
 {
-    switch(cmd) {
-    case WM_CDM_PLAYING:
-DEBUGLOG("set play\n");
-        m_media->play();
-        break;
-    case WM_CDM_PAUSED:
-DEBUGLOG("set pause\n");
-        m_media->pause();
-        break;
-    case WM_CDM_STOPPED:
-DEBUGLOG("set stop\n");
+    const quint64 position = m_ring.head();
+
+    m_stopSeq++;
+    m_started = false;
+    m_space.wakeAll();
+    QMetaObject::invokeMethod(this, [this, position]() {
         m_media->stop();
-        break;
-    default:
-        cmd = WM_CDM_STOPPED;
-        break;
-    }
+        m_ring.dropTo(position);
+        m_space.wakeAll();
+    });
 }
 
-void LibWMPcmPlayer::stateChanged( Phonon::State newstate, Phonon::State oldstate )
+void LibWMPcmPlayer::setVolume(int left, int right)
 {
-    DEBUGLOG("stateChanged from %i to %i\n", oldstate, newstate);
+    m_volume = (left + right) / 2;
+    QMetaObject::invokeMethod(this, [this]() { m_output->setVolume(m_volume / 100.0); });
 }
 
+/*
+ * Phonon is only used from the thread of the application, the drive
+ * thread may be one of the shared I/O threads. The player is created
+ * there and the play thread waits for it a little on the first block.
+ */
 static LibWMPcmPlayer *PhononObject = NULL;
+static bool phononPending = false;
+static unsigned int phononGeneration = 0;
+static QMutex phononMutex;
+static QWaitCondition phononCreated;
+static int phononLatency = WM_LATENCY_DEFAULT;
+
+static void phonon_create(unsigned int generation)
+{
+    LibWMPcmPlayer *player = nullptr;
+
+    {
+        QMutexLocker locker(&phononMutex);
+        if(generation != phononGeneration)
+            return;
+    }
+    player = new LibWMPcmPlayer(phononLatency);
+
+    QMutexLocker locker(&phononMutex);
+    if(generation != phononGeneration) {
+        delete player;
+        return;
+    }
+    PhononObject = player;
+    phononPending = false;
+    phononCreated.wakeAll();
+}
 
 int phonon_open(void)
 {
+    QCoreApplication *app = QCoreApplication::instance();
+    unsigned int generation;
+
     DEBUGLOG("phonon_open\n");
 
-    if(PhononObject) {
-        ERRORLOG("Already initialized!\n");
+    if(!app) {
+        ERRORLOG("Phonon needs an application\n");
         return -1;
     }
 
-    PhononObject = new LibWMPcmPlayer();
+    {
+        QMutexLocker locker(&phononMutex);
+        if(PhononObject || phononPending) {
+            ERRORLOG("Already initialized!\n");
+            return -1;
+        }
+        phononPending = true;
+        generation = ++phononGeneration;
+    }
+
+    if(QThread::currentThread() == app->thread())
+        phonon_create(generation);
+    else
+        QMetaObject::invokeMethod(app, [generation]() { phonon_create(generation); });
 
     return 0;
 }
 
 int phonon_close(void)
 {
+    LibWMPcmPlayer *player;
+
     DEBUGLOG("phonon_close\n");
 
-    if(!PhononObject) {
-        ERRORLOG("Unable to close\n");
-        return -1;
+    {
+        QMutexLocker locker(&phononMutex);
+        if(!PhononObject && !phononPending) {
+            ERRORLOG("Unable to close\n");
+            return -1;
+        }
+        player = PhononObject;
+        PhononObject = NULL;
+        phononPending = false;
+        ++phononGeneration;
+        phononCreated.wakeAll();
     }
 
-    delete PhononObject;
-
-    PhononObject = NULL;
+    if(player) {
+        if(QThread::currentThread() == player->thread())
+            delete player;
+        else
+            player->deleteLater();
+    }
 
     return 0;
 }
 
+static LibWMPcmPlayer *phonon_player(int waitMs)
+{
+    QMutexLocker locker(&phononMutex);
+
+    if(phononPending && waitMs > 0)
+        phononCreated.wait(&phononMutex, waitMs);
+
+    return PhononObject;
+}
+
 /*
  * Play some audio and pass a status message upstream, if applicable.
  * Returns 0 on success.
  */
 int
-phonon_play(struct cdda_block *blk)
+phonon_play(struct wm_cdda_block *blk)
 {
+    LibWMPcmPlayer *player = phonon_player(1000);
+
     DEBUGLOG("phonon_play %ld samples, frame %i\n",
         blk->buflen / (2 * 2), blk->frame);
 
-    if(!PhononObject) {
+    if(!player) {
         ERRORLOG("Unable to play\n");
         blk->status = WM_CDM_CDDAERROR;
         return -1;
     }
 
-    PhononObject->setNextBuffer(blk);
-
-    return 0;
+    return player->play(blk);
 }
 
 /*
@@ -221,14 +368,33 @@ phonon_play(struct cdda_block *blk)
 int
 phonon_pause(void)
 {
+    LibWMPcmPlayer *player = phonon_player(0);
+
     DEBUGLOG("phonon_pause\n");
 
-    if(!PhononObject) {
+    if(!player) {
         ERRORLOG("Unable to pause\n");
         return -1;
     }
 
-    PhononObject->pause();
+    player->pause();
+
+    return 0;
+}
+
+int
+phonon_resume(void)
+{
+    LibWMPcmPlayer *player = phonon_player(0);
+
+    DEBUGLOG("phonon_resume\n");
+
+    if(!player) {
+        ERRORLOG("Unable to resume\n");
+        return -1;
+    }
+
+    player->resume();
 
     return 0;
 }
@@ -239,27 +405,56 @@ phonon_pause(void)
 int
 phonon_stop(void)
 {
+    LibWMPcmPlayer *player = phonon_player(0);
+
     DEBUGLOG("phonon_stop\n");
 
-    if(!PhononObject) {
+    if(!player) {
         ERRORLOG("Unable to stop\n");
         return -1;
     }
 
-    PhononObject->stop();
+    player->stop();
 
     return 0;
 }
 
 /*
- * Get the current audio state.
+ * Phonon has no balance, both channels get the mean.
  */
 int
-phonon_state(struct cdda_block *blk)
+phonon_balvol(int setit, int *left, int *right)
 {
-    DEBUGLOG("phonon_state\n");
+    LibWMPcmPlayer *player = phonon_player(0);
 
-    return -1; /* not implemented yet for PHONON */
+    if(!player)
+        return -1;
+
+    if(setit)
+        player->setVolume(*left, *right);
+    else
+        *left = *right = player->volume();
+
+    return 0;
+}
+
+int
+phonon_stats(struct wm_audio_stats *stats)
+{
+    LibWMPcmPlayer *player = phonon_player(0);
+
+    if(!player)
+        return -1;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->profile = phononLatency;
+    stats->rate = 44100;
+    stats->channels = 2;
+    stats->buffer_frames = player->bufferBytes() / 4;
+    stats->period_frames = player->chunkBytes() / 4;
+    stats->device_latency_us = player->queuedBytes() * 1000000 / (44100 * 4);
+
+    return 0;
 }
 
 static struct audio_oops phonon_oops = {
@@ -268,20 +463,37 @@ static struct audio_oops phonon_oops = {
     phonon_play,
     phonon_pause,
     phonon_stop,
-    phonon_state,
     NULL,
-    NULL
+    phonon_balvol,
+    phonon_resume,
+    phonon_stats
 };
 
+/*
+ * Called in the thread of the drive, the player itself lives in the
+ * thread of the application.
+ */
 extern "C" struct audio_oops*
-setup_phonon(const char *dev, const char *ctl)
+setup_phonon(const char *dev, const char *ctl, int latency)
 {
+    bool opened;
+
     DEBUGLOG("setup_phonon\n");
 
-    phonon_open();
+    {
+        QMutexLocker locker(&phononMutex);
+        opened = PhononObject || phononPending;
+    }
+    if(opened)
+        phonon_close();
+
+    if(latency >= WM_LATENCY_LOW && latency <= WM_LATENCY_POWERSAVE)
+        phononLatency = latency;
+
+    if(phonon_open())
+        return NULL;
 
     return &phonon_oops;
 }
 
-#include "audio_phonon.moc"
 #include "moc_audio_phonon.cpp"
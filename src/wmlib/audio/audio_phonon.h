@@ -22,45 +22,89 @@
 #define __AUDIO_PHONON_H__
 
 #include <QByteArray>
-#include <QTimer>
-#include <QWaitCondition>
 #include <QMutex>
+#include <QWaitCondition>
+
+#include <phonon/AbstractMediaStream>
+
+#include <atomic>
+
+namespace Phonon { class MediaObject; class AudioOutput; }
+struct wm_cdda_block;
+
+/*
+ * Single producer, single consumer byte ring. The positions only grow,
+ * the producer owns m_head and the consumer m_tail.
+ */
+class LibWMPcmRing {
+public:
+    explicit LibWMPcmRing(qint64 size);
 
-#include <Phonon/AbstractMediaStream>
+    qint64 size() const { return m_mask + 1; }
+    qint64 available() const;
+    quint64 head() const { return m_head.load(std::memory_order_acquire); }
 
-namespace Phonon { class MediaObject; }
+    /* producer */
+    qint64 write(const char *data, qint64 len);
+    /* consumer */
+    qint64 read(char *data, qint64 len);
+    void dropTo(quint64 position);
 
+private:
+    QByteArray m_data;
+    qint64 m_mask;
+    std::atomic<quint64> m_head;
+    std::atomic<quint64> m_tail;
+};
+
+/*
+ * Pull model PCM source. The CDDA play thread only fills the ring and
+ * waits when it is full, Phonon takes the data on needData() in the
+ * thread of the player, in chunks of one reused buffer.
+ */
 class LibWMPcmPlayer : public Phonon::AbstractMediaStream {
     Q_OBJECT
 
 public:
-    LibWMPcmPlayer();
-    ~LibWMPcmPlayer();
+    explicit LibWMPcmPlayer(int latency);
+    ~LibWMPcmPlayer() override;
+
+    static QByteArray wavHeader();
+
+    /* called from the play thread */
+    int play(struct wm_cdda_block *blk);
+    /* called from any thread */
+    void pause();
+    void resume();
+    void stop();
+    void setVolume(int left, int right);
+    int volume() const { return m_volume; }
+    qint64 queuedBytes() const { return m_ring.available(); }
+    qint64 bufferBytes() const { return m_ring.size(); }
+    qint64 chunkBytes() const { return m_chunkSize; }
 
-    QByteArray wavHeader() const;
-    void setNextBuffer(struct cdda_block *blk);
+protected:
+    void reset() override;
+    void needData() override;
+    void enoughData() override;
 
-public Q_SLOTS:
-    void playBuffer(struct cdda_block *blk);
-    void pause(void);
-    void stop(void);
-    void executeCmd(int cmd);
-    void stateChanged( Phonon::State newstate, Phonon::State oldstate );
+private:
+    void feed();
 
-protected:
-    void reset();
-    void needData();
+    Phonon::MediaObject *m_media;
+    Phonon::AudioOutput *m_output;
+    LibWMPcmRing m_ring;
+    QByteArray m_chunk;
+    qint64 m_chunkSize;
 
-Q_SIGNALS:
-    void cmdChanged(int cmd);
-    void nextBuffer(struct cdda_block *blk);
+    std::atomic<bool> m_wanted;
+    std::atomic<bool> m_feedQueued;
+    std::atomic<bool> m_started;
+    std::atomic<unsigned int> m_stopSeq;
+    int m_volume;
 
-private:
-    Phonon::MediaObject* m_media;
-    unsigned char m_cmd;
-    struct cdda_block *m_blk;
-    QWaitCondition m_readyToPlay;
     QMutex m_mutex;
+    QWaitCondition m_space;
 };
 
 #endif /* __AUDIO_PHONON_H__ */
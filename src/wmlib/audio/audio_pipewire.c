@@ -0,0 +1,381 @@
+/*  This file is part of the KDE project
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License version 2 as published by the Free Software Foundation.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public License
+    along with this library; see the file COPYING.LIB.  If not, write to
+    the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+    Boston, MA 02110-1301, USA.
+*/
+
+#include "audio.h"
+#include "../include/wm_struct.h"
+#include "../include/wm_config.h"
+#include "../include/wm_cdrom.h"
+
+#include <config-pipewire.h>
+
+#ifdef HAVE_PIPEWIRE
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/param/props.h>
+
+#include <string.h>
+
+#define CDDA_RATE 44100
+#define CDDA_STRIDE 4   /* S16LE, 2 channels */
+
+static char *device = NULL;
+static int profile = WM_LATENCY_DEFAULT;
+
+/*
+ * The play thread dequeues buffers under the thread loop lock and sleeps
+ * in pw_thread_loop_wait() until the process callback hands one back, or
+ * until stop, pause, resume or an error wake it up.
+ */
+static struct pw_thread_loop *loop = NULL;
+static struct pw_stream *stream = NULL;
+static unsigned int stop_seq = 0;
+static int paused = 0;
+static int failed = 0;
+
+/* quantum asked for by the latency profiles, in frames at 44.1 kHz */
+static const unsigned int quanta[] = {
+  [WM_LATENCY_LOW]        = 441,
+  [WM_LATENCY_DEFAULT]    = 4410,
+  [WM_LATENCY_POWERSAVE]  = 22050
+};
+
+/* under the thread loop lock */
+static struct wm_audio_stats stats;
+
+int pipewire_open(void);
+int pipewire_close(void);
+int pipewire_play(struct wm_cdda_block *blk);
+int pipewire_pause(void);
+int pipewire_resume(void);
+int pipewire_stop(void);
+int pipewire_balvol(int setit, int *left, int *right);
+int pipewire_stats(struct wm_audio_stats *out);
+struct audio_oops* setup_pipewire(const char *dev, const char *ctl, int latency);
+
+static void on_process(void *data)
+{
+  pw_thread_loop_signal(loop, false);
+}
+
+static void on_state_changed(void *data, enum pw_stream_state old,
+  enum pw_stream_state state, const char *error)
+{
+  if(state == PW_STREAM_STATE_ERROR) {
+    ERRORLOG("pipewire stream failed: %s\n", error ? error : "unknown error");
+    failed = 1;
+  }
+  pw_thread_loop_signal(loop, false);
+}
+
+static const struct pw_stream_events stream_events = {
+  PW_VERSION_STREAM_EVENTS,
+  .state_changed = on_state_changed,
+  .process = on_process
+};
+
+int pipewire_open(void)
+{
+  uint8_t buffer[1024];
+  struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+  const struct spa_pod *params[1];
+  struct pw_properties *props;
+  char latency[32];
+  int err;
+
+  DEBUGLOG("pipewire_open\n");
+
+  loop = pw_thread_loop_new("kcompactdisc-cdda", NULL);
+  if(!loop) {
+    ERRORLOG("Unable to create the pipewire loop\n");
+    return -1;
+  }
+
+  snprintf(latency, sizeof(latency), "%u/%u", quanta[profile], CDDA_RATE);
+  props = pw_properties_new(
+    PW_KEY_MEDIA_TYPE, "Audio",
+    PW_KEY_MEDIA_CATEGORY, "Playback",
+    PW_KEY_MEDIA_ROLE, "Music",
+    PW_KEY_NODE_LATENCY, latency,
+    NULL);
+#ifdef PW_KEY_NODE_RATE
+  /* ask the graph to run at the rate of the disc, if it may switch */
+  pw_properties_set(props, PW_KEY_NODE_RATE, "1/44100");
+#endif
+#ifdef PW_KEY_TARGET_OBJECT
+  if(device && *device)
+    pw_properties_set(props, PW_KEY_TARGET_OBJECT, device);
+#endif
+
+  stream = pw_stream_new_simple(pw_thread_loop_get_loop(loop), "CD Audio",
+    props, &stream_events, NULL);
+  if(!stream) {
+    ERRORLOG("Unable to create the pipewire stream\n");
+    pw_thread_loop_destroy(loop);
+    loop = NULL;
+    return -1;
+  }
+
+  /* exactly the format of the disc, nothing to convert on our side */
+  params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+    &SPA_AUDIO_INFO_RAW_INIT(
+      .format = SPA_AUDIO_FORMAT_S16_LE,
+      .rate = CDDA_RATE,
+      .channels = 2,
+      .position = { SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR }));
+
+  stop_seq = 0;
+  paused = 0;
+  failed = 0;
+  memset(&stats, 0, sizeof(stats));
+  stats.profile = profile;
+  stats.rate = CDDA_RATE;
+  stats.channels = 2;
+  stats.period_frames = quanta[profile];
+  stats.buffer_frames = quanta[profile];
+
+  err = pw_stream_connect(stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, params, 1);
+  if(err < 0 || pw_thread_loop_start(loop) < 0) {
+    ERRORLOG("Unable to connect the pipewire stream: %s\n", spa_strerror(err));
+    pw_stream_destroy(stream);
+    pw_thread_loop_destroy(loop);
+    stream = NULL;
+    loop = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+int pipewire_close(void)
+{
+  DEBUGLOG("pipewire_close\n");
+
+  if(!loop)
+    return 0;
+
+  pipewire_stop();
+
+  pw_thread_loop_stop(loop);
+  pw_stream_destroy(stream);
+  pw_thread_loop_destroy(loop);
+  stream = NULL;
+  loop = NULL;
+
+  return 0;
+}
+
+/*
+ * Copy the block into as many stream buffers as it takes.
+ * Returns 0 on success.
+ */
+int
+pipewire_play(struct wm_cdda_block *blk)
+{
+  const char *src = blk->buf;
+  long left = blk->buflen;
+  struct pw_buffer *buf;
+  struct spa_data *data;
+  struct pw_time time;
+  unsigned int seq;
+  uint32_t size;
+
+  pw_thread_loop_lock(loop);
+  seq = stop_seq;
+
+  while(left > 0 && stop_seq == seq && !failed) {
+    if(paused || !(buf = pw_stream_dequeue_buffer(stream))) {
+      pw_thread_loop_wait(loop);
+      continue;
+    }
+
+    data = &buf->buffer->datas[0];
+    size = data->data ? data->maxsize : 0;
+#if PW_CHECK_VERSION(0, 3, 49)
+    if(buf->requested && buf->requested * CDDA_STRIDE < size)
+      size = buf->requested * CDDA_STRIDE;
+#endif
+    if(size > left)
+      size = left;
+    size -= size % CDDA_STRIDE;
+
+    if(!size) {
+      /* nothing to write into, hand it back and wait for the next cycle */
+      data->chunk->size = 0;
+      pw_stream_queue_buffer(stream, buf);
+      pw_thread_loop_wait(loop);
+      continue;
+    }
+
+    memcpy(data->data, src, size);
+    data->chunk->offset = 0;
+    data->chunk->stride = CDDA_STRIDE;
+    data->chunk->size = size;
+    pw_stream_queue_buffer(stream, buf);
+
+    src += size;
+    left -= size;
+  }
+
+  if(failed) {
+    pw_thread_loop_unlock(loop);
+    blk->status = WM_CDM_CDDAERROR;
+    return -1;
+  }
+
+#if PW_CHECK_VERSION(0, 3, 50)
+  if(!pw_stream_get_time_n(stream, &time, sizeof(time)) && time.rate.denom) {
+#else
+  if(!pw_stream_get_time(stream, &time) && time.rate.denom) {
+#endif
+    stats.device_latency_us = time.delay * 1000000 * time.rate.num / time.rate.denom +
+      time.queued * 1000000 / (CDDA_RATE * CDDA_STRIDE);
+  }
+
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+/*
+ * Pause the audio immediately.
+ */
+int
+pipewire_pause(void)
+{
+  DEBUGLOG("pipewire_pause\n");
+
+  pw_thread_loop_lock(loop);
+  paused = 1;
+  pw_stream_set_active(stream, false);
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+int
+pipewire_resume(void)
+{
+  DEBUGLOG("pipewire_resume\n");
+
+  pw_thread_loop_lock(loop);
+  paused = 0;
+  pw_stream_set_active(stream, true);
+  pw_thread_loop_signal(loop, false);
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+/*
+ * Stop the audio immediately.
+ */
+int
+pipewire_stop(void)
+{
+  DEBUGLOG("pipewire_stop\n");
+
+  pw_thread_loop_lock(loop);
+  stop_seq++;
+  if(paused) {
+    paused = 0;
+    pw_stream_set_active(stream, true);
+  }
+  pw_stream_flush(stream, false);
+  pw_thread_loop_signal(loop, false);
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+/*
+ * Volume of the stream, left and right in percent.
+ */
+int
+pipewire_balvol(int setit, int *left, int *right)
+{
+  static int volume[2] = { 100, 100 };
+  float values[2];
+
+  if(!setit) {
+    *left = volume[0];
+    *right = volume[1];
+    return 0;
+  }
+
+  volume[0] = *left < 0 ? 0 : (*left > 100 ? 100 : *left);
+  volume[1] = *right < 0 ? 0 : (*right > 100 ? 100 : *right);
+  values[0] = volume[0] / 100.0f;
+  values[1] = volume[1] / 100.0f;
+
+  pw_thread_loop_lock(loop);
+  pw_stream_set_control(stream, SPA_PROP_channelVolumes, 2, values, 0);
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+int
+pipewire_stats(struct wm_audio_stats *out)
+{
+  pw_thread_loop_lock(loop);
+  *out = stats;
+  pw_thread_loop_unlock(loop);
+
+  return 0;
+}
+
+static struct audio_oops pipewire_oops = {
+  .wmaudio_open    = pipewire_open,
+  .wmaudio_close   = pipewire_close,
+  .wmaudio_play    = pipewire_play,
+  .wmaudio_pause   = pipewire_pause,
+  .wmaudio_resume  = pipewire_resume,
+  .wmaudio_stop    = pipewire_stop,
+  .wmaudio_state   = NULL,
+  .wmaudio_balvol  = pipewire_balvol,
+  .wmaudio_stats   = pipewire_stats
+};
+
+struct audio_oops*
+setup_pipewire(const char *dev, const char *ctl, int latency)
+{
+  static int init_complete = 0;
+
+  DEBUGLOG("setup_pipewire\n");
+
+  if(!init_complete) {
+    pw_init(NULL, NULL);
+    init_complete = 1;
+  }
+
+  pipewire_close();
+
+  /* kept over close, a later open goes to the same node */
+  free(device);
+  device = (dev && strlen(dev) > 0) ? strdup(dev) : NULL;
+  if(latency >= WM_LATENCY_LOW && latency <= WM_LATENCY_POWERSAVE)
+    profile = latency;
+
+  if(pipewire_open())
+    return NULL;
+
+  return &pipewire_oops;
+}
+
+#endif /* HAVE_PIPEWIRE */
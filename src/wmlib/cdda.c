@@ -20,7 +20,6 @@
 #include <string.h>
 #include <sys/poll.h>
 #include <sys/wait.h>
-#include <arpa/inet.h> /* For htonl(3) */
 #include <stdio.h>
 #include <unistd.h>
 #include "include/wm_config.h"
@@ -31,10 +30,13 @@
 #include "include/wm_scsi.h"
 #include "audio/audio.h"
 
+#include <math.h>
 #include <pthread.h>
+#include <stdlib.h>
 
-static pthread_t thread_read;
-static pthread_t thread_play;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* CDDABLKSIZE give us the 588 samples 4 bytes each(16 bit x 2 channel)
    by rate 44100 HZ, 588 samples are 1/75 sec
@@ -48,34 +50,79 @@ static pthread_t thread_play;
 #define COUNT_CDDA_BLOCKS 10
 #endif
 
-static struct wm_cdda_block blks[COUNT_CDDA_BLOCKS];
-static pthread_mutex_t blks_mutex[COUNT_CDDA_BLOCKS];
-static pthread_cond_t wakeup_audio;
-
-/*
- * This is non-null if we're saving audio to a file.
- */
-static FILE *output = NULL;
+/* the sink, the recorder, the level meter and whoever subscribes */
+#define COUNT_CDDA_CONSUMERS 8
+
+struct cdda_consumer {
+    int used;
+    int policy;
+    wm_cdda_consume_t consume;
+    void *arg;
+    struct cdda_ring *ring;
+    unsigned long cursor;    /* next block this consumer takes */
+    unsigned long dropped;   /* blocks lost with WM_CDDA_DROP */
+    unsigned long busy;      /* block in use while reading is set */
+    int reading;
+    int quit;
+    pthread_t thread;
+};
 
 /*
- * These are driverdependent oops
- *
+ * State of the crossfade into the queued track, see xfade_arm().
  */
-static struct audio_oops *oops = NULL;
+struct cdda_xfade {
+    /* under ring_mutex */
+    int ms, trim;                     /* settings */
+    int next_start, next_end;
+    unsigned int queue_seq;
+
+    /* the reader's own */
+    int state;
+    unsigned int seq;                 /* queue_seq the side buffers belong to */
+    int fade_ms, fade_trim;
+    int start, end;                   /* of the next track */
+    int tail_start, tail_frames, tail_done;
+    int head_frames, head_done;
+    char *tail, *head;
+    size_t size;                      /* of each side buffer */
+    float *gain;
+    long out_len, out_pos;            /* bytes of tail to emit */
+    int resume;                       /* frame to go on with in the next track */
+};
 
 /*
- * Audio file header format.
+ * The ring of one drive, d->cddax points to it while CDDA is set up.
  */
-typedef unsigned long u_32;
-struct auheader {
-	u_32 magic;
-	u_32 hdr_size;
-	u_32 data_size;
-	u_32 encoding;
-	u_32 sample_rate;
-	u_32 channels;
+struct cdda_ring {
+    struct wm_drive *drive;
+    struct audio_oops *oops;  /* the driverdependent oops */
+    struct wm_cdda_block blks[COUNT_CDDA_BLOCKS];
+    pthread_t thread_read;
+    int quit;                 /* the reader ends */
+
+    /* write_seq counts the blocks the reader published, cursors follow it */
+    pthread_mutex_t ring_mutex;
+    pthread_cond_t ring_data;
+    pthread_cond_t ring_space;
+    unsigned long write_seq;
+    struct cdda_consumer consumers[COUNT_CDDA_CONSUMERS];
+    int sink_id, record_id, meter_id;
+
+    /* bytes handed from the reader to the ring and from the ring to the sink */
+    volatile unsigned long bytes_read;
+    volatile unsigned long bytes_played;
+
+    /* peaks of the last block the meter saw, 0..32768 */
+    volatile int level_left, level_right;
+
+    struct cdda_xfade xf;
 };
 
+#define CDDA_RING(d) ((struct cdda_ring *)(d)->cddax)
+
+static void cdda_flush(struct cdda_ring *r);
+static void cdda_command(struct wm_drive *d, int command);
+
 static int cdda_status(struct wm_drive *d, int oldmode,
   int *mode, int *frame, int *track, int *ind)
 {
@@ -106,12 +153,14 @@ static int cdda_status(struct wm_drive *d, int oldmode,
 static int cdda_play(struct wm_drive *d, int start, int end)
 {
     if (d->cddax) {
-        d->command = WM_CDM_STOPPED;
-        oops->wmaudio_stop();
+        cdda_command(d, WM_CDM_STOPPED);
+        CDDA_RING(d)->oops->wmaudio_stop();
 
         /* wait before reader, stops */
         while(d->status != d->command)
             wm_susleep(1000);
+        cdda_flush(CDDA_RING(d));
+        wm_cdda_queue(d, 0, 0);
 
 		d->current_position = start;
 		d->ending_position = end;
@@ -119,7 +168,8 @@ static int cdda_play(struct wm_drive *d, int start, int end)
         d->track =  -1;
         d->index =  0;
         d->frame = start;
-        d->status = d->command = WM_CDM_PLAYING;
+        d->status = WM_CDM_PLAYING;
+        cdda_command(d, WM_CDM_PLAYING);
 
         return 0;
     }
@@ -130,12 +180,16 @@ static int cdda_play(struct wm_drive *d, int start, int end)
 static int cdda_pause(struct wm_drive *d)
 {
     if (d->cddax) {
+        struct audio_oops *oops = CDDA_RING(d)->oops;
+
         if(WM_CDM_PLAYING == d->command) {
-            d->command = WM_CDM_PAUSED;
+            cdda_command(d, WM_CDM_PAUSED);
             if(oops->wmaudio_pause)
                 oops->wmaudio_pause();
         } else {
-            d->command = WM_CDM_PLAYING;
+            if(oops->wmaudio_resume)
+                oops->wmaudio_resume();
+            cdda_command(d, WM_CDM_PLAYING);
         }
 
         return 0;
@@ -147,8 +201,9 @@ static int cdda_pause(struct wm_drive *d)
 static int cdda_stop(struct wm_drive *d)
 {
     if (d->cddax) {
-        d->command = WM_CDM_STOPPED;
-        oops->wmaudio_stop();
+        cdda_command(d, WM_CDM_STOPPED);
+        CDDA_RING(d)->oops->wmaudio_stop();
+        cdda_flush(CDDA_RING(d));
         return 0;
     }
 
@@ -158,6 +213,8 @@ static int cdda_stop(struct wm_drive *d)
 static int cdda_set_volume(struct wm_drive *d, int left, int right)
 {
     if (d->cddax) {
+         struct audio_oops *oops = CDDA_RING(d)->oops;
+
          if(oops->wmaudio_balvol && !oops->wmaudio_balvol(1, &left, &right))
             return 0;
     }
@@ -168,6 +225,8 @@ static int cdda_set_volume(struct wm_drive *d, int left, int right)
 static int cdda_get_volume(struct wm_drive *d, int *left, int *right)
 {
     if (d->cddax) {
+        struct audio_oops *oops = CDDA_RING(d)->oops;
+
         if(oops->wmaudio_balvol && !oops->wmaudio_balvol(0, left, right))
             return 0;
     }
@@ -175,198 +234,755 @@ static int cdda_get_volume(struct wm_drive *d, int *left, int *right)
     return -1;
 }
 
-  #if 0
 /*
- * Tell the CDDA slave to start (or stop) saving to a file.
+ * Tag a block with its track and index once the index map is known.
  */
-void
-cdda_save(struct wm_drive *, char *)
-{
-
-  int len;
-
-  if (filename == NULL || filename[0] == '\0')
-    len = 0;
-  else
-    len = strlen(filename);
-  write(d->cdda_slave, "F", 1);
-  write(d->cdda_slave, &len, sizeof(len));
-  if (len)
-    write(d->cdda_slave, filename, len);
-
-
-    		read(0, &namelen, sizeof(namelen));
-		if (output != NULL) {
-			fclose(output);
-			output = NULL;
-		}
-		if (namelen) {
-			filename = malloc(namelen + 1);
-			if (filename == NULL) {
-				perror("cddas");
-				wmcdda_close(cdda_device);
-				oops->wmaudio_close();
-				exit(1);
-			}
-
-			read(0, filename, namelen);
-			filename[namelen] = '\0';
-			output = fopen(filename, "w");
-			if (output == NULL) {
-				perror(filename);
-			} else {
-				/* Write an .au file header. */
-				hdr.magic = htonl(0x2e736e64);
-				hdr.hdr_size = htonl(sizeof(hdr) + 28);
-				hdr.data_size = htonl(~0);
-				hdr.encoding = htonl(3); /* linear-16 */
-				hdr.sample_rate = htonl(44100);
-				hdr.channels = htonl(2);
-
-				fwrite(&hdr, sizeof(hdr), 1, output);
-				fwrite("Recorded from CD by WorkMan", 28, 1, output);
-			}
-			free(filename);
+static void cdda_locate(struct wm_drive *d, struct wm_cdda_block *block)
+{
+    int track, index;
 
+    if (!wm_cd_locate(d, block->frame, &track, &index)) {
+        block->track = track;
+        block->index = index;
+    }
 }
+
+/*
+ * The reader fills the ring once, every consumer follows it with its own
+ * cursor in its own thread. Blocks are handed out in place, a slot is only
+ * refilled when no consumer with WM_CDDA_BACKPRESSURE still needs it and
+ * no consumer reads it at that moment. A consumer with WM_CDDA_DROP that
+ * falls behind loses the oldest blocks instead of holding the reader.
+ */
+static void *cdda_fct_consume(void *arg)
+{
+    struct cdda_consumer *c = (struct cdda_consumer *)arg;
+    struct cdda_ring *r = c->ring;
+    unsigned long seq;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    while (!c->quit) {
+        if (c->cursor == r->write_seq) {
+            pthread_cond_wait(&r->ring_data, &r->ring_mutex);
+            continue;
+        }
+
+        seq = c->busy = c->cursor;
+        c->reading = 1;
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+
+        c->consume(r->drive, &r->blks[seq % COUNT_CDDA_BLOCKS], c->arg);
+
+        (void) pthread_mutex_lock(&r->ring_mutex);
+        c->reading = 0;
+        /* a flush may have moved the cursor meanwhile */
+        if (c->cursor == seq)
+            c->cursor = seq + 1;
+        pthread_cond_broadcast(&r->ring_space);
+    }
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    return 0;
+}
+
+/*
+ * Under ring_mutex. Returns 1 when the slot of write_seq may be refilled.
+ */
+static int cdda_slot_free(struct cdda_ring *r)
+{
+    const unsigned long write_seq = r->write_seq;
+    struct cdda_consumer *c;
+    int i;
+
+    for (i = 0; i < COUNT_CDDA_CONSUMERS; i++) {
+        c = &r->consumers[i];
+        if (!c->used)
+            continue;
+        if (c->reading && (write_seq - c->busy) % COUNT_CDDA_BLOCKS == 0)
+            return 0;
+        if (write_seq - c->cursor < COUNT_CDDA_BLOCKS)
+            continue;
+        if (c->policy == WM_CDDA_BACKPRESSURE)
+            return 0;
+        c->dropped += write_seq - c->cursor - COUNT_CDDA_BLOCKS + 1;
+        c->cursor = write_seq - COUNT_CDDA_BLOCKS + 1;
+    }
+
+    return 1;
+}
+
+/*
+ * Commands from outside go through here, a paused sink waits for them.
+ */
+static void cdda_command(struct wm_drive *d, int command)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    d->command = command;
+    pthread_cond_broadcast(&r->ring_data);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+}
+
+/*
+ * Drop whatever the consumers did not take yet.
+ */
+static void cdda_flush(struct cdda_ring *r)
+{
+    int i;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    for (i = 0; i < COUNT_CDDA_CONSUMERS; i++)
+        r->consumers[i].cursor = r->write_seq;
+    pthread_cond_broadcast(&r->ring_space);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+}
+
+/*
+ * Crossfade into the queued track. Once the play range and the next track
+ * are known, the reader fetches the tail of the current track and the head
+ * of the next one into side buffers, only while the ring is full. The tail
+ * is then played from the side buffer with the head mixed into its end and
+ * the reader goes on right behind the head. If the side buffers are not
+ * complete in time, the track ends as before.
+ */
+#define XFADE_MAX_MS 10000
+#define XFADE_TRIM_FRAMES 225     /* 3 s searched for silence at both ends */
+#define XFADE_SILENCE 32          /* about -60 dBFS */
+#define SAMPLES_PER_FRAME 588
+#define FRAME_BYTES (SAMPLES_PER_FRAME * 4)
+
+enum { XF_IDLE, XF_FETCH, XF_READY, XF_SKIP };
+
+/*
+ * Equal power fade of a into b, in place in a. gain holds the fade in
+ * curve, the fade out is the same curve backwards.
+ */
+static void mix_equal_power(signed short *a, const signed short *b, const float *gain, long frames)
+{
+    long i = 0;
+    float v;
+    int j;
+
+#ifdef __SSE2__
+    __m128i va, vb;
+    __m128 gin, gout, glo, ghi, hlo, hhi, alo, ahi, blo, bhi;
+
+    for (; i + 4 <= frames; i += 4) {
+        gin = _mm_loadu_ps(gain + i);
+        gout = _mm_loadu_ps(gain + frames - 4 - i);
+        gout = _mm_shuffle_ps(gout, gout, _MM_SHUFFLE(0, 1, 2, 3));
+        /* one gain per frame, both channels */
+        glo = _mm_unpacklo_ps(gout, gout);
+        ghi = _mm_unpackhi_ps(gout, gout);
+        hlo = _mm_unpacklo_ps(gin, gin);
+        hhi = _mm_unpackhi_ps(gin, gin);
+
+        va = _mm_loadu_si128((const __m128i *)(a + 2 * i));
+        vb = _mm_loadu_si128((const __m128i *)(b + 2 * i));
+        alo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(va, va), 16));
+        ahi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(va, va), 16));
+        blo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(vb, vb), 16));
+        bhi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(vb, vb), 16));
+
+        alo = _mm_add_ps(_mm_mul_ps(alo, glo), _mm_mul_ps(blo, hlo));
+        ahi = _mm_add_ps(_mm_mul_ps(ahi, ghi), _mm_mul_ps(bhi, hhi));
+        _mm_storeu_si128((__m128i *)(a + 2 * i),
+            _mm_packs_epi32(_mm_cvtps_epi32(alo), _mm_cvtps_epi32(ahi)));
+    }
 #endif
 
-static int get_next_block(int x)
+    for (; i < frames; i++) {
+        for (j = 0; j < 2; j++) {
+            v = a[2 * i + j] * gain[frames - 1 - i] + b[2 * i + j] * gain[i];
+            v += v < 0 ? -0.5f : 0.5f;
+            a[2 * i + j] = v > 32767 ? 32767 : (v < -32768 ? -32768 : (signed short)v);
+        }
+    }
+}
+
+static int is_silent(const signed short *s)
+{
+    return s[0] <= XFADE_SILENCE && s[0] >= -XFADE_SILENCE &&
+        s[1] <= XFADE_SILENCE && s[1] >= -XFADE_SILENCE;
+}
+
+/*
+ * Read frames at pos into buf without disturbing the play position.
+ * Returns the number of frames read, -1 on failure.
+ */
+static int xfade_read(struct wm_drive *d, char *buf, int pos, int end)
+{
+    struct wm_cdda_block side;
+    int cur = d->current_position, last = d->ending_position;
+    long n;
+
+    memset(&side, 0, sizeof(side));
+    side.buf = buf;
+    d->current_position = pos;
+    d->ending_position = end;
+    n = gen_cdda_read(d, &side);
+    d->current_position = cur;
+    d->ending_position = last;
+
+    return (n > 0 && side.status == WM_CDM_PLAYING) ? n / FRAME_BYTES : -1;
+}
+
+/*
+ * Called by the reader before each block, sets the side buffers up for
+ * the track queued last.
+ */
+static void xfade_arm(struct wm_drive *d)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    struct cdda_xfade *xf = &r->xf;
+    int fade, extra, ms, trim;
+    size_t size;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    if (xf->state != XF_IDLE && xf->seq == xf->queue_seq) {
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+        return;
+    }
+    xf->state = XF_SKIP;
+    xf->seq = xf->queue_seq;
+    xf->start = xf->next_start;
+    xf->end = xf->next_end;
+    xf->fade_ms = ms = xf->ms;
+    xf->fade_trim = trim = xf->trim;
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    if ((!ms && !trim) || !xf->start || !d->ending_position)
+        return;
+
+    fade = ms * 75 / 1000;
+    extra = trim ? XFADE_TRIM_FRAMES : 0;
+    xf->tail_frames = xf->head_frames = fade + extra;
+    xf->tail_start = d->ending_position - xf->tail_frames;
+    if (xf->tail_start < d->current_position || xf->end - xf->start < xf->head_frames)
+        return;
+
+    size = (size_t)xf->tail_frames * FRAME_BYTES;
+    if (size > xf->size) {
+        free(xf->tail);
+        free(xf->head);
+        free(xf->gain);
+        xf->tail = malloc(size);
+        xf->head = malloc(size);
+        xf->gain = malloc(size / 4 * sizeof(float));
+        xf->size = (xf->tail && xf->head && xf->gain) ? size : 0;
+        if (!xf->size)
+            return;
+    }
+
+    xf->tail_done = xf->head_done = 0;
+    xf->state = XF_FETCH;
+}
+
+/*
+ * Both ends are in memory: find the edges of the silence, mix, and work
+ * out where the next track goes on. The overlap is cut so that the head
+ * ends on a frame boundary, the drive cannot resume in the middle of one.
+ */
+static void xfade_prepare(struct cdda_xfade *xf)
+{
+    signed short *tail = (signed short *)xf->tail, *head = (signed short *)xf->head;
+    long tail_len = (long)xf->tail_frames * SAMPLES_PER_FRAME;
+    long head_len = (long)xf->head_frames * SAMPLES_PER_FRAME;
+    long e = tail_len, h = 0, n, i;
+
+    if (xf->fade_trim) {
+        while (e > tail_len - XFADE_TRIM_FRAMES * SAMPLES_PER_FRAME && is_silent(tail + 2 * (e - 1)))
+            e--;
+        while (h < XFADE_TRIM_FRAMES * SAMPLES_PER_FRAME && is_silent(head + 2 * h))
+            h++;
+    }
+
+    n = (long)xf->fade_ms * 44100 / 1000;
+    if (n > e)
+        n = e;
+    if (n > head_len - h)
+        n = head_len - h;
+    n -= (h + n) % SAMPLES_PER_FRAME;
+    if (n < 0)
+        n = 0;
+
+    for (i = 0; i < n; i++)
+        xf->gain[i] = sinf(1.5707963f * (i + 0.5f) / n);
+    mix_equal_power(tail + 2 * (e - n), head + 2 * h, xf->gain, n);
+
+    xf->out_len = e * 4;
+    xf->out_pos = 0;
+    xf->resume = xf->start + (h + n) / SAMPLES_PER_FRAME;
+    xf->state = XF_READY;
+}
+
+/*
+ * One step of the side reads, done instead of waiting for the ring.
+ */
+static void xfade_fetch(struct wm_drive *d)
+{
+    struct cdda_xfade *xf = &CDDA_RING(d)->xf;
+    int n;
+
+    if (xf->tail_done < xf->tail_frames) {
+        n = xfade_read(d, xf->tail + (size_t)xf->tail_done * FRAME_BYTES,
+            xf->tail_start + xf->tail_done, d->ending_position);
+        xf->tail_done += n;
+    } else {
+        n = xfade_read(d, xf->head + (size_t)xf->head_done * FRAME_BYTES,
+            xf->start + xf->head_done, xf->start + xf->head_frames);
+        xf->head_done += n;
+    }
+
+    if (n < 0)
+        xf->state = XF_SKIP;
+    else if (xf->head_done == xf->head_frames)
+        xfade_prepare(xf);
+}
+
+/*
+ * Fill blk from the mixed tail. When it is used up, the play range moves
+ * on to the queued track.
+ */
+static long xfade_emit(struct wm_drive *d, struct wm_cdda_block *blk)
 {
-    int y = ++x;
-    return (y < COUNT_CDDA_BLOCKS)?y:0;
+    struct cdda_ring *r = CDDA_RING(d);
+    struct cdda_xfade *xf = &r->xf;
+    long len = xf->out_len - xf->out_pos;
+
+    if (len > d->frames_at_once * FRAME_BYTES)
+        len = d->frames_at_once * FRAME_BYTES;
+
+    memcpy(blk->buf, xf->tail + xf->out_pos, len);
+    blk->frame = xf->tail_start + xf->out_pos / FRAME_BYTES;
+    blk->track = -1;
+    blk->index = 0;
+    blk->status = WM_CDM_PLAYING;
+    blk->buflen = len;
+    xf->out_pos += len;
+
+    if (xf->out_pos >= xf->out_len) {
+        d->current_position = xf->resume;
+        d->ending_position = xf->end;
+        xf->state = XF_IDLE;
+        (void) pthread_mutex_lock(&r->ring_mutex);
+        if (xf->seq == xf->queue_seq)
+            xf->next_start = 0;
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+    }
+
+    return len;
 }
 
 static void *cdda_fct_read(void* arg)
 {
-    struct wm_drive *d = (struct wm_drive *)arg;
-    int i, j, wakeup;
+    struct cdda_ring *r = (struct cdda_ring *)arg;
+    struct cdda_xfade *xf = &r->xf;
+    struct wm_drive *d = r->drive;
+    struct wm_cdda_block *blk;
     long result;
+    int last;
 
-    while (d->blocks) {
-        while(d->command != WM_CDM_PLAYING) {
+    while (!__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE)) {
+        while(!__atomic_load_n(&r->quit, __ATOMIC_ACQUIRE) && d->command != WM_CDM_PLAYING) {
             d->status = d->command;
             wm_susleep(1000);
         }
 
-        i = 0;
-        (void) pthread_mutex_lock(&blks_mutex[i]);
-        wakeup = 1;
-
         while(d->command == WM_CDM_PLAYING) {
-            result = gen_cdda_read(d, &blks[i]);
-            if (result <= 0 && blks[i].status != WM_CDM_TRACK_DONE) {
+            xfade_arm(d);
+
+            (void) pthread_mutex_lock(&r->ring_mutex);
+            while (d->command == WM_CDM_PLAYING && !cdda_slot_free(r)) {
+                if (xf->state == XF_FETCH) {
+                    (void) pthread_mutex_unlock(&r->ring_mutex);
+                    xfade_fetch(d);
+                    (void) pthread_mutex_lock(&r->ring_mutex);
+                    continue;
+                }
+                pthread_cond_wait(&r->ring_space, &r->ring_mutex);
+            }
+            (void) pthread_mutex_unlock(&r->ring_mutex);
+            if (d->command != WM_CDM_PLAYING)
+                break;
+
+            blk = &r->blks[r->write_seq % COUNT_CDDA_BLOCKS];
+            if (xf->state == XF_FETCH && d->current_position >= xf->tail_start)
+                xf->state = XF_SKIP;
+            if (xf->state == XF_READY && d->current_position >= xf->tail_start) {
+                result = xfade_emit(d, blk);
+            } else {
+                /* stop exactly where the tail from the side buffer begins */
+                last = d->ending_position;
+                if (xf->state == XF_FETCH || xf->state == XF_READY)
+                    d->ending_position = xf->tail_start;
+                result = gen_cdda_read(d, blk);
+                d->ending_position = last;
+            }
+            if (result <= 0 && blk->status != WM_CDM_TRACK_DONE) {
                 ERRORLOG("cdda: wmcdda_read failed, stop playing\n");
                 d->command = WM_CDM_STOPPED;
                 break;
-            } else {
-                if (output)
-                    fwrite(blks[i].buf, blks[i].buflen, 1, output);
             }
+            if (blk->status == WM_CDM_PLAYING)
+                cdda_locate(d, blk);
+
+            (void) pthread_mutex_lock(&r->ring_mutex);
+            /* stopped while reading, the block belongs to the old position */
+            if (d->command == WM_CDM_PLAYING) {
+                r->bytes_read += blk->buflen;
+                r->write_seq++;
+                pthread_cond_broadcast(&r->ring_data);
+            }
+            (void) pthread_mutex_unlock(&r->ring_mutex);
+        }
+    }
 
-            j = get_next_block(i);
-            (void) pthread_mutex_lock(&blks_mutex[j]);
+    return 0;
+}
 
-            if(wakeup) {
-                wakeup = 0;
-                pthread_cond_signal(&wakeup_audio);
-            }
+/*
+ * The sound system is the consumer that drives the state of the drive.
+ * It works on a copy of the block header, the samples stay in the ring.
+ */
+static void cdda_sink(struct wm_drive *d, const struct wm_cdda_block *shared, void *arg)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    struct wm_cdda_block blk = *shared;
 
-            (void) pthread_mutex_unlock(&blks_mutex[i]);
-            /* audio can start here */
+    (void) arg;
 
-            i = j;
-        }
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    while (d->command == WM_CDM_PAUSED)
+        pthread_cond_wait(&r->ring_data, &r->ring_mutex);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+    if (d->command != WM_CDM_PLAYING)
+        return;
 
-        (void) pthread_mutex_unlock(&blks_mutex[i]);
+    if (r->oops->wmaudio_play(&blk)) {
+        r->oops->wmaudio_stop();
+        ERRORLOG("cdda: wmaudio_play failed\n");
+        d->command = WM_CDM_STOPPED;
     }
+    if (r->oops->wmaudio_state)
+        r->oops->wmaudio_state(&blk);
+    r->bytes_played += blk.buflen;
+
+    d->frame = blk.frame;
+    d->track = blk.track;
+    d->index = blk.index;
+    if ((d->status = blk.status) == WM_CDM_TRACK_DONE)
+        d->command = WM_CDM_STOPPED;
+}
+
+/*
+ * The samples go into the file as the drive delivers them.
+ */
+static void cdda_record(struct wm_drive *d, const struct wm_cdda_block *blk, void *arg)
+{
+    (void) d;
+
+    if (blk->status == WM_CDM_PLAYING && blk->buflen > 0)
+        fwrite(blk->buf, blk->buflen, 1, (FILE *)arg);
+}
+
+static void cdda_meter(struct wm_drive *d, const struct wm_cdda_block *blk, void *arg)
+{
+    const signed short *s = (const signed short *)blk->buf;
+    long i, n = blk->buflen / 2;
+    int left = 0, right = 0, l, r;
+
+    (void) arg;
+
+    if (blk->status != WM_CDM_PLAYING)
+        return;
+
+    for (i = 0; i + 1 < n; i += 2) {
+        l = s[i] < 0 ? -s[i] : s[i];
+        r = s[i + 1] < 0 ? -s[i + 1] : s[i + 1];
+        if (l > left)
+            left = l;
+        if (r > right)
+            right = r;
+    }
+    CDDA_RING(d)->level_left = left;
+    CDDA_RING(d)->level_right = right;
+}
+
+/*
+ * Length of the crossfade into a queued track in ms, 0 for none. trim
+ * also cuts the silence at the end and the start of both tracks.
+ */
+int wm_cdda_crossfade(struct wm_drive *d, int ms, int trim)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+
+    if (!r)
+        return -1;
+    if (ms < 0)
+        ms = 0;
+    if (ms > XFADE_MAX_MS)
+        ms = XFADE_MAX_MS;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    r->xf.ms = ms;
+    r->xf.trim = trim;
+    r->xf.queue_seq++;
+    (void) pthread_mutex_unlock(&r->ring_mutex);
 
     return 0;
 }
 
-static void *cdda_fct_play(void* arg)
+/*
+ * The frames to go on with after the current play range, start 0 for
+ * none. With a crossfade set the reader blends into them.
+ */
+int wm_cdda_queue(struct wm_drive *d, int start, int end)
 {
-    struct wm_drive *d = (struct wm_drive *)arg;
-    int i = 0;
+    struct cdda_ring *r = CDDA_RING(d);
 
-    while (d->blocks) {
-        if(d->command != WM_CDM_PLAYING) {
-            i = 0;
-            (void) pthread_mutex_lock(&blks_mutex[i]);
-            pthread_cond_wait(&wakeup_audio, &blks_mutex[i]);
-        } else {
-            i = get_next_block(i);
-            (void) pthread_mutex_lock(&blks_mutex[i]);
+    if (!r)
+        return -1;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    r->xf.next_start = start;
+    r->xf.next_end = end;
+    r->xf.queue_seq++;
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    return 0;
+}
+
+int wm_cdda_subscribe(struct wm_drive *d, wm_cdda_consume_t consume, void *arg, int policy)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    struct cdda_consumer *c = NULL;
+    int i;
+
+    if (!r)
+        return -1;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    for (i = 0; i < COUNT_CDDA_CONSUMERS; i++) {
+        if (!r->consumers[i].used) {
+            c = &r->consumers[i];
+            break;
         }
+    }
+    if (!c) {
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+        ERRORLOG("cdda: no free consumer slot\n");
+        return -1;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->used = 1;
+    c->ring = r;
+    c->consume = consume;
+    c->arg = arg;
+    c->policy = policy;
+    c->cursor = r->write_seq;
+    if (pthread_create(&c->thread, NULL, cdda_fct_consume, c)) {
+        c->used = 0;
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+        ERRORLOG("error by create pthread");
+        return -1;
+    }
+    (void) pthread_mutex_unlock(&r->ring_mutex);
 
-        if (oops->wmaudio_play(&blks[i])) {
-            oops->wmaudio_stop();
-            ERRORLOG("cdda: wmaudio_play failed\n");
-            d->command = WM_CDM_STOPPED;
+    return i;
+}
+
+int wm_cdda_unsubscribe(struct wm_drive *d, int id)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    struct cdda_consumer *c;
+
+    if (!r || id < 0 || id >= COUNT_CDDA_CONSUMERS)
+        return -1;
+    c = &r->consumers[id];
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    if (!c->used || c->quit) {
+        (void) pthread_mutex_unlock(&r->ring_mutex);
+        return -1;
+    }
+    c->quit = 1;
+    pthread_cond_broadcast(&r->ring_data);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    pthread_join(c->thread, NULL);
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    c->used = 0;
+    pthread_cond_broadcast(&r->ring_space);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    return 0;
+}
+
+unsigned long wm_cdda_dropped(struct wm_drive *d, int id)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    unsigned long dropped = 0;
+
+    if (!r || id < 0 || id >= COUNT_CDDA_CONSUMERS)
+        return 0;
+
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    if (r->consumers[id].used)
+        dropped = r->consumers[id].dropped;
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    return dropped;
+}
+
+/*
+ * Start saving the samples to filename as WAV, or stop with NULL.
+ */
+int wm_cdda_record(struct wm_drive *d, const char *filename)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+    unsigned char header[WM_WAV_HEADER_SIZE];
+    long size;
+    FILE *f;
+
+    if (!r)
+        return -1;
+
+    if (r->record_id >= 0) {
+        f = (FILE *)r->consumers[r->record_id].arg;
+        wm_cdda_unsubscribe(d, r->record_id);
+        r->record_id = -1;
+
+        /* now the length is known */
+        if ((size = ftell(f)) >= WM_WAV_HEADER_SIZE && !fseek(f, 0, SEEK_SET)) {
+            wm_wav_header(header, size - WM_WAV_HEADER_SIZE);
+            fwrite(header, sizeof(header), 1, f);
         }
-        if (oops->wmaudio_state)
-            oops->wmaudio_state(&blks[i]);
+        fclose(f);
+    }
 
-        d->frame = blks[i].frame;
-        d->track = blks[i].track;
-        d->index = blks[i].index;
-        if ((d->status = blks[i].status) == WM_CDM_TRACK_DONE)
-            d->command = WM_CDM_STOPPED;
+    if (!filename || !*filename)
+        return 0;
 
-        (void) pthread_mutex_unlock(&blks_mutex[i]);
+    if (!(f = fopen(filename, "wb"))) {
+        ERRORLOG("cdda: unable to open %s\n", filename);
+        return -1;
+    }
+    wm_wav_header(header, 0x7FFFFFFF - 36);
+    fwrite(header, sizeof(header), 1, f);
+    if ((r->record_id = wm_cdda_subscribe(d, cdda_record, f, WM_CDDA_BACKPRESSURE)) < 0) {
+        fclose(f);
+        return -1;
     }
 
     return 0;
 }
 
+/*
+ * Peak levels of the playing audio in percent, the meter is attached
+ * on the first call.
+ */
+int wm_cdda_levels(struct wm_drive *d, int *left, int *right)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+
+    if (!r)
+        return -1;
+
+    if (r->meter_id < 0 &&
+        (r->meter_id = wm_cdda_subscribe(d, cdda_meter, NULL, WM_CDDA_DROP)) < 0)
+        return -1;
+
+    *left = r->level_left * 100 / 32768;
+    *right = r->level_right * 100 / 32768;
+
+    return 0;
+}
+
+/*
+ * Let the reader run out and wait for it.
+ */
+static void cdda_stop_reader(struct cdda_ring *r)
+{
+    (void) pthread_mutex_lock(&r->ring_mutex);
+    __atomic_store_n(&r->quit, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&r->ring_space);
+    (void) pthread_mutex_unlock(&r->ring_mutex);
+
+    pthread_join(r->thread_read, NULL);
+}
+
+static void cdda_free_ring(struct wm_drive *d)
+{
+    struct cdda_ring *r = CDDA_RING(d);
+
+    d->numblocks = 0;
+    d->blocks = NULL;
+    d->cddax = NULL;
+
+    pthread_cond_destroy(&r->ring_space);
+    pthread_cond_destroy(&r->ring_data);
+    pthread_mutex_destroy(&r->ring_mutex);
+    free(r);
+}
+
 /*
  * Try to initialize the CDDA slave.  Returns 0 on success.
  */
 int wm_cdda_init(struct wm_drive *d)
 {
+	struct cdda_ring *r;
 	int ret = 0;
 
-	if (d->cddax) {
+	if (d->cddax)
 		wm_cdda_destroy(d);
 
-		wm_susleep(1000);
-		d->blocks = 0;
-		wm_susleep(1000);
-	}
-
-	memset(blks, 0, sizeof(blks));
-
-	d->blocks = blks;
+	if (!(r = calloc(1, sizeof(*r))))
+		return -1;
+	r->drive = d;
+	r->sink_id = r->record_id = r->meter_id = -1;
+	pthread_mutex_init(&r->ring_mutex, NULL);
+	pthread_cond_init(&r->ring_data, NULL);
+	pthread_cond_init(&r->ring_space, NULL);
+
+	d->cddax = r;
+	d->blocks = r->blks;
 	d->frames_at_once = COUNT_CDDA_FRAMES_PER_BLOCK;
 	d->numblocks = COUNT_CDDA_BLOCKS;
 	d->status = WM_CDM_UNKNOWN;
 
-	if ((ret = gen_cdda_init(d)))
-		return ret;
-
-	if ((ret = gen_cdda_open(d)))
+	if ((ret = gen_cdda_init(d)) || (ret = gen_cdda_open(d))) {
+		cdda_free_ring(d);
 		return ret;
+	}
 
 	wm_scsi_set_speed(d, 4);
 
-	oops = setup_soundsystem(d->soundsystem, d->sounddevice, d->ctldevice);
-	if (!oops) {
+	r->oops = setup_soundsystem(d->soundsystem, d->sounddevice, d->ctldevice,
+		d->latency_profile);
+	if (!r->oops) {
 		ERRORLOG("cdda: setup_soundsystem failed\n");
 		gen_cdda_close(d);
+		cdda_free_ring(d);
 		return -1;
 	}
 
-	if(pthread_create(&thread_read, NULL, cdda_fct_read, d)) {
+	if(pthread_create(&r->thread_read, NULL, cdda_fct_read, r)) {
 		ERRORLOG("error by create pthread");
-		oops->wmaudio_close();
+		r->oops->wmaudio_close();
 		gen_cdda_close(d);
+		cdda_free_ring(d);
 		return -1;
 	}
 
-	if(pthread_create(&thread_play, NULL, cdda_fct_play, d)) {
-		ERRORLOG("error by create pthread");
-		oops->wmaudio_close();
+	if((r->sink_id = wm_cdda_subscribe(d, cdda_sink, NULL, WM_CDDA_BACKPRESSURE)) < 0) {
+		cdda_stop_reader(r);
+		r->oops->wmaudio_close();
 		gen_cdda_close(d);
+		cdda_free_ring(d);
 		return -1;
 	}
 
@@ -380,26 +996,54 @@ int wm_cdda_init(struct wm_drive *d)
 	d->proto.scale_volume = NULL;
 	d->proto.unscale_volume = NULL;
 
-	d->cddax = (void *)1;
+	return 0;
+}
+
+/*
+ * Add the blocks waiting for the sink to the latency the sink measured.
+ */
+int wm_cdda_get_stats(struct wm_drive *d, struct wm_audio_stats *stats)
+{
+	struct cdda_ring *r = CDDA_RING(d);
+	unsigned long queued;
+
+	if (!r || !r->oops->wmaudio_stats || r->oops->wmaudio_stats(stats))
+		return -1;
+
+	queued = r->bytes_read - r->bytes_played;
+	if (queued > COUNT_CDDA_BLOCKS * COUNT_CDDA_FRAMES_PER_BLOCK * 2352)
+		queued = 0; /* between a stop and the next play */
+	stats->queue_latency_us = (unsigned long long)queued * 1000000 / (44100 * 4);
+	stats->latency_us = stats->queue_latency_us + stats->device_latency_us;
 
 	return 0;
 }
 
 int wm_cdda_destroy(struct wm_drive *d)
 {
-    if (d->cddax) {
+    struct cdda_ring *r = CDDA_RING(d);
+
+    if (r) {
 		wm_scsi_set_speed(d, -1);
 
-		d->command = WM_CDM_STOPPED;
-		oops->wmaudio_stop();
-		wm_susleep(2000);
+		cdda_command(d, WM_CDM_STOPPED);
+		r->oops->wmaudio_stop();
+		cdda_flush(r);
+		wm_cdda_export(d, NULL);
+		wm_cdda_stream(d, NULL);
+		wm_cdda_record(d, NULL);
+		if (r->meter_id >= 0)
+			wm_cdda_unsubscribe(d, r->meter_id);
+		wm_cdda_unsubscribe(d, r->sink_id);
+		cdda_stop_reader(r);
 		gen_cdda_close(d);
-		oops->wmaudio_close();
+		r->oops->wmaudio_close();
 
-		d->numblocks = 0;
-        d->blocks = NULL;
         wait(NULL);
-        d->cddax = NULL;
+        free(r->xf.tail);
+        free(r->xf.head);
+        free(r->xf.gain);
+        cdda_free_ring(d);
     }
     return 0;
 }
@@ -0,0 +1,387 @@
+/*
+ * This file is part of WorkMan, the civilized CD player library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Export of the CDDA block ring to other processes.
+ */
+
+#define _GNU_SOURCE /* memfd_create, accept4, strdup */
+
+#include "include/wm_config.h"
+#include "include/wm_struct.h"
+#include "include/wm_cdda_shm.h"
+#include "include/wm_helpers.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010  /* Linux 5.1 */
+#endif
+
+#define SHM_SLOTS 32          /* ~6 s of audio for readers that lag */
+#define SHM_CLIENTS 16
+
+/*
+ * The layout lives here, the header in the segment is only a copy for the
+ * readers. Nothing is ever read back from the segment. One per drive in
+ * d->cdda_export while the export runs.
+ */
+struct cdda_shm {
+	int consumer;             /* id with wm_cdda_subscribe() */
+	int memfd;
+	int reader_fd;            /* what the clients get, read only */
+	size_t size;
+	struct wm_cdda_shm_header *hdr;
+	size_t data;              /* offset of the first slot's samples */
+	size_t slot_bytes;
+	uint64_t write_seq;
+
+	char *path;
+	int listen_fd;
+	int wake_fd;
+	pthread_t thread;
+
+	pthread_mutex_t lock;     /* clients */
+	int client_fd[SHM_CLIENTS];
+	int event_fd[SHM_CLIENTS];
+};
+
+static int shm_create(size_t size)
+{
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("kcompactdisc-cdda", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		if (ftruncate(fd, size) < 0) {
+			close(fd);
+			return -1;
+		}
+		/* readers may rely on the size */
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW);
+		return fd;
+	}
+#endif
+	{
+		char name[64];
+
+		snprintf(name, sizeof(name), "/kcompactdisc-cdda-%d", (int)getpid());
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return -1;
+		shm_unlink(name);
+		if (ftruncate(fd, size) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/*
+ * Runs in the consumer thread of the export. A slot is marked busy before
+ * it is rewritten, readers check the mark again after they used the data.
+ */
+static void shm_publish(struct wm_drive *d, const struct wm_cdda_block *blk, void *arg)
+{
+	struct cdda_shm *shm = (struct cdda_shm *)arg;
+	const uint64_t seq = shm->write_seq;
+	const unsigned int n = seq % SHM_SLOTS;
+	struct wm_cdda_shm_slot *slot = &shm->hdr->slot[n];
+	uint64_t one = 1;
+	long len = blk->buflen;
+	int i;
+
+	(void) d;
+
+	if (len < 0)
+		len = 0;
+	if ((size_t)len > shm->slot_bytes)
+		len = shm->slot_bytes;
+
+	__atomic_store_n(&slot->seq, WM_CDDA_SHM_BUSY, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((char *)shm->hdr + shm->data + n * shm->slot_bytes, blk->buf, len);
+	slot->frame = blk->frame;
+	slot->status = blk->status;
+	slot->track = blk->track;
+	slot->index = blk->index;
+	slot->buflen = len;
+	slot->offset = shm->data + n * shm->slot_bytes;
+
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	shm->write_seq = seq + 1;
+	__atomic_store_n(&shm->hdr->write_seq, shm->write_seq, __ATOMIC_RELEASE);
+
+	(void) pthread_mutex_lock(&shm->lock);
+	for (i = 0; i < SHM_CLIENTS; i++)
+		if (shm->event_fd[i] >= 0 && write(shm->event_fd[i], &one, sizeof(one)) < 0 && errno != EAGAIN)
+			DEBUGLOG("cdda export: notify failed\n");
+	(void) pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * Hand the segment and a fresh eventfd to a new client.
+ */
+static void shm_accept(struct cdda_shm *shm)
+{
+	char cmsgbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char version = WM_CDDA_SHM_VERSION;
+	int fd, efd, fds[2], i;
+
+	if ((fd = accept4(shm->listen_fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return;
+	if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		close(fd);
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cmsgbuf, 0, sizeof(cmsgbuf));
+	iov.iov_base = &version;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = shm->reader_fd;
+	fds[1] = efd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	(void) pthread_mutex_lock(&shm->lock);
+	for (i = 0; i < SHM_CLIENTS && shm->client_fd[i] >= 0; i++)
+		;
+	if (i == SHM_CLIENTS || sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+		(void) pthread_mutex_unlock(&shm->lock);
+		ERRORLOG("cdda export: unable to take another client\n");
+		close(efd);
+		close(fd);
+		return;
+	}
+	shm->client_fd[i] = fd;
+	shm->event_fd[i] = efd;
+	(void) pthread_mutex_unlock(&shm->lock);
+}
+
+static void shm_drop_client(struct cdda_shm *shm, int i)
+{
+	(void) pthread_mutex_lock(&shm->lock);
+	close(shm->client_fd[i]);
+	close(shm->event_fd[i]);
+	shm->client_fd[i] = shm->event_fd[i] = -1;
+	(void) pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * Accepts clients and notices when they hang up. Clients never send
+ * anything, the socket only tells us they are alive.
+ */
+static void *shm_fct_listen(void *arg)
+{
+	struct cdda_shm *shm = (struct cdda_shm *)arg;
+	struct pollfd pfds[2 + SHM_CLIENTS];
+	int slot[SHM_CLIENTS];
+	int i, n;
+	char c;
+
+	for (;;) {
+		pfds[0].fd = shm->wake_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = shm->listen_fd;
+		pfds[1].events = POLLIN;
+		for (i = 0, n = 2; i < SHM_CLIENTS; i++) {
+			if (shm->client_fd[i] < 0)
+				continue;
+			slot[n - 2] = i;
+			pfds[n].fd = shm->client_fd[i];
+			pfds[n].events = POLLIN;
+			n++;
+		}
+
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[0].revents)
+			break;
+		for (i = 2; i < n; i++)
+			if (pfds[i].revents && recv(pfds[i].fd, &c, 1, MSG_DONTWAIT) <= 0)
+				shm_drop_client(shm, slot[i - 2]);
+		if (pfds[1].revents & POLLIN)
+			shm_accept(shm);
+	}
+
+	return 0;
+}
+
+static void shm_close(struct wm_drive *d)
+{
+	struct cdda_shm *shm = (struct cdda_shm *)d->cdda_export;
+	uint64_t one = 1;
+	int i;
+
+	if (!shm)
+		return;
+	d->cdda_export = NULL;
+
+	if (shm->consumer >= 0)
+		wm_cdda_unsubscribe(d, shm->consumer);
+
+	if (shm->hdr) {
+		__atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < SHM_CLIENTS; i++)
+			if (shm->event_fd[i] >= 0 && write(shm->event_fd[i], &one, sizeof(one)) < 0)
+				DEBUGLOG("cdda export: notify failed\n");
+	}
+
+	if (shm->thread) {
+		if (write(shm->wake_fd, &one, sizeof(one)) < 0)
+			ERRORLOG("cdda export: unable to wake the listener\n");
+		pthread_join(shm->thread, NULL);
+		shm->thread = 0;
+	}
+
+	for (i = 0; i < SHM_CLIENTS; i++)
+		if (shm->client_fd[i] >= 0)
+			shm_drop_client(shm, i);
+	if (shm->listen_fd >= 0) {
+		close(shm->listen_fd);
+		wm_unix_unlink(shm->path);
+	}
+	if (shm->wake_fd >= 0)
+		close(shm->wake_fd);
+	if (shm->hdr)
+		munmap(shm->hdr, shm->size);
+	if (shm->reader_fd >= 0)
+		close(shm->reader_fd);
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+	free(shm->path);
+	pthread_mutex_destroy(&shm->lock);
+	free(shm);
+}
+
+/*
+ * Publish the blocks on the socket path, or stop with NULL. The export
+ * drops blocks instead of holding the drive, readers see the gaps in seq.
+ */
+int wm_cdda_export(struct wm_drive *d, const char *path)
+{
+	struct cdda_shm *shm;
+	char fdpath[32];
+	unsigned int i;
+
+	shm_close(d);
+	if (!path || !*path)
+		return 0;
+
+	if (!(shm = calloc(1, sizeof(*shm))))
+		return -1;
+	shm->consumer = shm->memfd = shm->reader_fd = shm->listen_fd = shm->wake_fd = -1;
+	pthread_mutex_init(&shm->lock, NULL);
+	for (i = 0; i < SHM_CLIENTS; i++)
+		shm->client_fd[i] = shm->event_fd[i] = -1;
+	d->cdda_export = shm;
+
+	shm->slot_bytes = d->frames_at_once * 2352;
+	shm->data = sizeof(struct wm_cdda_shm_header) + SHM_SLOTS * sizeof(struct wm_cdda_shm_slot);
+	shm->data = (shm->data + 4095) & ~(size_t)4095;
+	shm->size = shm->data + SHM_SLOTS * shm->slot_bytes;
+	shm->write_seq = 0;
+
+	if ((shm->memfd = shm_create(shm->size)) < 0) {
+		ERRORLOG("cdda export: unable to create the segment\n");
+		goto fail;
+	}
+	shm->hdr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		goto fail;
+	}
+
+	shm->hdr->magic = WM_CDDA_SHM_MAGIC;
+	shm->hdr->version = WM_CDDA_SHM_VERSION;
+	shm->hdr->rate = 44100;
+	shm->hdr->channels = 2;
+	shm->hdr->slots = SHM_SLOTS;
+	shm->hdr->slot_bytes = shm->slot_bytes;
+	for (i = 0; i < SHM_SLOTS; i++) {
+		shm->hdr->slot[i].seq = WM_CDDA_SHM_BUSY;
+		shm->hdr->slot[i].offset = shm->data + i * shm->slot_bytes;
+	}
+
+	/*
+	 * Our mapping stays writable, no new one can be. The clients get a
+	 * read only descriptor on top, for kernels without the seal.
+	 */
+	if (fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0)
+		DEBUGLOG("cdda export: segment not sealed against writes\n");
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", shm->memfd);
+	if ((shm->reader_fd = open(fdpath, O_RDONLY | O_CLOEXEC)) < 0 &&
+		(shm->reader_fd = fcntl(shm->memfd, F_DUPFD_CLOEXEC, 0)) < 0)
+		goto fail;
+
+	shm->path = strdup(path);
+	if ((shm->listen_fd = wm_unix_listen(path, SHM_CLIENTS)) < 0) {
+		ERRORLOG("cdda export: unable to listen on %s\n", path);
+		goto fail;
+	}
+
+	if ((shm->wake_fd = eventfd(0, EFD_CLOEXEC)) < 0 ||
+		pthread_create(&shm->thread, NULL, shm_fct_listen, shm)) {
+		shm->thread = 0;
+		goto fail;
+	}
+
+	if ((shm->consumer = wm_cdda_subscribe(d, shm_publish, shm, WM_CDDA_DROP)) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	shm_close(d);
+	return -1;
+}
+
+#else
+
+int wm_cdda_export(struct wm_drive *d, const char *path)
+{
+	return (path && *path) ? -1 : 0;
+}
+
+#endif /* __linux__ */
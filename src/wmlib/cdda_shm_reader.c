@@ -0,0 +1,224 @@
+/*
+ * This file is part of WorkMan, the civilized CD player library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Reference reader for the shared memory export of the CDDA engine. It
+ * does not depend on the rest of wmlib, a client links only this file.
+ */
+
+#define _GNU_SOURCE /* MSG_CMSG_CLOEXEC */
+
+#include "include/wm_cdda_shm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+struct wm_cdda_shm_reader
+{
+	int sock;
+	int event_fd;
+	size_t size;
+	const struct wm_cdda_shm_header *hdr;
+	uint64_t next;      /* block to read next */
+	uint64_t lost;      /* blocks overwritten before they were read */
+};
+
+static int recv_fds(int sock, int *fds)
+{
+	char cmsgbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char version;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &version;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return -1;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+	if (version != WM_CDDA_SHM_VERSION) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Connect to the export listening on path. Reading starts with the next
+ * block published. Returns NULL on failure.
+ */
+struct wm_cdda_shm_reader *wm_cdda_shm_connect(const char *path)
+{
+	struct wm_cdda_shm_reader *r;
+	struct sockaddr_un addr;
+	struct stat st;
+	int fds[2];
+	void *map;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+	if (!(r = calloc(1, sizeof(*r))))
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	r->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (r->sock < 0 || connect(r->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		recv_fds(r->sock, fds) < 0)
+		goto fail;
+
+	r->event_fd = fds[1];
+	if (fstat(fds[0], &st) < 0 || st.st_size < (off_t)sizeof(struct wm_cdda_shm_header)) {
+		close(fds[0]);
+		goto fail_event;
+	}
+	r->size = st.st_size;
+	map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (map == MAP_FAILED)
+		goto fail_event;
+	r->hdr = map;
+
+	if (r->hdr->magic != WM_CDDA_SHM_MAGIC || r->hdr->version != WM_CDDA_SHM_VERSION ||
+		!r->hdr->slots || sizeof(struct wm_cdda_shm_header) +
+		r->hdr->slots * (sizeof(struct wm_cdda_shm_slot) + (size_t)r->hdr->slot_bytes) > r->size) {
+		munmap(map, r->size);
+		goto fail_event;
+	}
+	r->next = __atomic_load_n(&r->hdr->write_seq, __ATOMIC_ACQUIRE);
+
+	return r;
+
+fail_event:
+	close(r->event_fd);
+fail:
+	if (r->sock >= 0)
+		close(r->sock);
+	free(r);
+	return NULL;
+}
+
+void wm_cdda_shm_disconnect(struct wm_cdda_shm_reader *r)
+{
+	if (!r)
+		return;
+	munmap((void *)r->hdr, r->size);
+	close(r->event_fd);
+	close(r->sock);
+	free(r);
+}
+
+/*
+ * Readable when blocks were published, for callers with their own loop.
+ */
+int wm_cdda_shm_fd(struct wm_cdda_shm_reader *r)
+{
+	return r->event_fd;
+}
+
+/*
+ * Take the next block, waiting up to timeout ms (-1 forever). Returns 1
+ * with v filled in, 0 on timeout and -1 when the export is gone.
+ */
+int wm_cdda_shm_next(struct wm_cdda_shm_reader *r, struct wm_cdda_shm_view *v, int timeout)
+{
+	const struct wm_cdda_shm_header *hdr = r->hdr;
+	const struct wm_cdda_shm_slot *slot;
+	struct pollfd pfd;
+	uint64_t w, count;
+	int n;
+
+	for (;;) {
+		w = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+
+		/* the oldest slot may be rewritten right now, leave it */
+		if (w - r->next >= hdr->slots) {
+			r->lost += w - r->next - hdr->slots + 1;
+			r->next = w - hdr->slots + 1;
+		}
+
+		if (r->next < w) {
+			slot = &hdr->slot[r->next % hdr->slots];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != r->next ||
+				slot->offset + (size_t)slot->buflen > r->size) {
+				r->lost++;
+				r->next++;
+				continue;
+			}
+			v->seq = r->next;
+			v->frame = slot->frame;
+			v->status = slot->status;
+			v->track = slot->track;
+			v->index = slot->index;
+			v->buf = (const char *)hdr + slot->offset;
+			v->buflen = slot->buflen;
+			r->next++;
+			return 1;
+		}
+
+		if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+			return -1;
+
+		pfd.fd = r->event_fd;
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1, timeout);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n == 0)
+			return 0;
+		if (n > 0 && read(r->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			return -1;
+	}
+}
+
+/*
+ * Whether the samples of v were not overwritten up to now. Call it after
+ * they were used or copied, a torn block has to be thrown away.
+ */
+int wm_cdda_shm_valid(struct wm_cdda_shm_reader *r, const struct wm_cdda_shm_view *v)
+{
+	const struct wm_cdda_shm_slot *slot = &r->hdr->slot[v->seq % r->hdr->slots];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == v->seq)
+		return 1;
+	r->lost++;
+	return 0;
+}
+
+uint64_t wm_cdda_shm_lost(struct wm_cdda_shm_reader *r)
+{
+	return r->lost;
+}
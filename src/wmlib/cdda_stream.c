@@ -0,0 +1,409 @@
+/*
+ * This file is part of WorkMan, the civilized CD player library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Streams the playing CD as WAV to the clients of a UNIX socket.
+ */
+
+#define _GNU_SOURCE /* splice, tee, accept4, F_SETPIPE_SZ */
+
+#include "include/wm_config.h"
+#include "include/wm_struct.h"
+#include "include/wm_helpers.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#define STREAM_CLIENTS 64
+#define STREAM_PIPE_SIZE (1024 * 1024)  /* ~6 s queued per client */
+#define STREAM_QUEUE 64                  /* blocks at most in a client pipe */
+#define STREAM_MAX_DROPS 50              /* blocks, ~10 s, then the client goes */
+
+/*
+ * Every block is written once into the source pipe and tee()d from there
+ * into one pipe per client, the pages are shared, not copied. The server
+ * thread splices each client pipe into its socket.
+ *
+ * A pipe holds a number of buffers, not of bytes, and tee() does not merge
+ * them. So each client takes whole blocks up to what its buffers hold, a
+ * block that does not fit is lost as a whole. A client that loses too many
+ * in a row is dropped.
+ */
+struct stream_client {
+	int sock;
+	int pipe[2];
+	int max_blocks;         /* that fit into the buffers of the pipe */
+	unsigned long long sent;        /* bytes put into the pipe */
+	unsigned long long end[STREAM_QUEUE];  /* of the blocks still in it */
+	int head, queued;
+	int drops;              /* in a row */
+	unsigned long dropped;  /* all of them */
+};
+
+/*
+ * One per drive in d->cdda_stream while the server runs.
+ */
+struct cdda_stream {
+	int consumer;
+	char *path;
+	int listen_fd;
+	int wake_fd;
+	int source[2];
+	int null_fd;
+	long block_bytes;
+	pthread_t thread;
+	volatile int quit;
+
+	pthread_mutex_t lock;   /* clients */
+	struct stream_client client[STREAM_CLIENTS];
+};
+
+static void stream_drop_client(struct stream_client *c)
+{
+	DEBUGLOG("cdda stream: client gone, %lu blocks dropped\n", c->dropped);
+	close(c->sock);
+	close(c->pipe[0]);
+	close(c->pipe[1]);
+	c->sock = c->pipe[0] = c->pipe[1] = -1;
+}
+
+/*
+ * Forget the blocks the server moved into the socket, returns how many
+ * are left in the pipe.
+ */
+static int stream_pending(struct stream_client *c)
+{
+	unsigned long long drained;
+	int queued;
+
+	if (ioctl(c->pipe[1], FIONREAD, &queued) < 0)
+		return -1;
+	drained = c->sent - queued;
+	while (c->queued && c->end[c->head] <= drained) {
+		c->head = (c->head + 1) % STREAM_QUEUE;
+		c->queued--;
+	}
+
+	return c->queued;
+}
+
+static void stream_push(struct stream_client *c, long len)
+{
+	c->sent += len;
+	c->end[(c->head + c->queued) % STREAM_QUEUE] = c->sent;
+	c->queued++;
+}
+
+/*
+ * Runs in the consumer thread of the server.
+ */
+static void stream_publish(struct wm_drive *d, const struct wm_cdda_block *blk, void *arg)
+{
+	struct cdda_stream *srv = (struct cdda_stream *)arg;
+	struct stream_client *c;
+	uint64_t one = 1;
+	long left, n;
+	int i, pending;
+
+	(void) d;
+
+	if (blk->status != WM_CDM_PLAYING || blk->buflen <= 0)
+		return;
+
+	/* the source pipe holds more than a block, this does not block */
+	for (left = blk->buflen; left > 0; left -= n)
+		if ((n = write(srv->source[1], blk->buf + (blk->buflen - left), left)) < 0)
+			return;
+
+	(void) pthread_mutex_lock(&srv->lock);
+	for (i = 0; i < STREAM_CLIENTS; i++) {
+		c = &srv->client[i];
+		if (c->sock < 0)
+			continue;
+
+		if ((pending = stream_pending(c)) < 0) {
+			stream_drop_client(c);
+			continue;
+		}
+		if (pending >= c->max_blocks) {
+			c->dropped++;
+			if (++c->drops >= STREAM_MAX_DROPS)
+				stream_drop_client(c);
+			continue;
+		}
+
+		/* there was room, part of a block would be noise */
+		if (tee(srv->source[0], c->pipe[1], blk->buflen, SPLICE_F_NONBLOCK) != blk->buflen) {
+			stream_drop_client(c);
+			continue;
+		}
+		stream_push(c, blk->buflen);
+		c->drops = 0;
+	}
+	(void) pthread_mutex_unlock(&srv->lock);
+
+	/* empty the source again */
+	for (left = blk->buflen; left > 0; left -= n)
+		if ((n = splice(srv->source[0], NULL, srv->null_fd, NULL, left, SPLICE_F_MOVE)) <= 0)
+			break;
+
+	if (write(srv->wake_fd, &one, sizeof(one)) < 0)
+		DEBUGLOG("cdda stream: unable to wake the server\n");
+}
+
+static void stream_accept(struct cdda_stream *srv)
+{
+	unsigned char header[WM_WAV_HEADER_SIZE];
+	struct stream_client *c = NULL;
+	long page = sysconf(_SC_PAGESIZE);
+	int fd, i, size;
+
+	if ((fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+		return;
+
+	(void) pthread_mutex_lock(&srv->lock);
+	for (i = 0; i < STREAM_CLIENTS && !c; i++)
+		if (srv->client[i].sock < 0)
+			c = &srv->client[i];
+	if (!c || pipe2(c->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		(void) pthread_mutex_unlock(&srv->lock);
+		ERRORLOG("cdda stream: unable to take another client\n");
+		close(fd);
+		return;
+	}
+
+	if ((size = fcntl(c->pipe[1], F_SETPIPE_SZ, STREAM_PIPE_SIZE)) < 0)
+		size = fcntl(c->pipe[1], F_GETPIPE_SZ);
+	c->sock = fd;
+	c->sent = 0;
+	c->head = c->queued = 0;
+	c->drops = 0;
+	c->dropped = 0;
+
+	/* one buffer goes to the header */
+	c->max_blocks = (size / page - 1) / ((srv->block_bytes + page - 1) / page);
+	if (c->max_blocks > STREAM_QUEUE - 1)
+		c->max_blocks = STREAM_QUEUE - 1;
+
+	/* the stream has no end, the header says so */
+	wm_wav_header(header, 0x7FFFFFFF - 36);
+	if (c->max_blocks < 1 || write(c->pipe[1], header, sizeof(header)) != sizeof(header))
+		stream_drop_client(c);
+	else
+		stream_push(c, sizeof(header));
+	(void) pthread_mutex_unlock(&srv->lock);
+}
+
+/*
+ * Moves what the client pipes hold into the sockets, waits for sockets
+ * that are full and accepts new clients.
+ */
+static void *stream_fct_serve(void *arg)
+{
+	struct cdda_stream *srv = (struct cdda_stream *)arg;
+	struct pollfd pfds[2 + STREAM_CLIENTS];
+	struct stream_client *c;
+	int slot[STREAM_CLIENTS];
+	int i, n, queued;
+	uint64_t count;
+	ssize_t moved;
+	char discard[256];
+
+	for (;;) {
+		pfds[0].fd = srv->wake_fd;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = srv->listen_fd;
+		pfds[1].events = POLLIN;
+		n = 2;
+
+		(void) pthread_mutex_lock(&srv->lock);
+		for (i = 0; i < STREAM_CLIENTS; i++) {
+			c = &srv->client[i];
+			if (c->sock < 0)
+				continue;
+
+			queued = 0;
+			while (ioctl(c->pipe[0], FIONREAD, &queued) == 0 && queued > 0) {
+				moved = splice(c->pipe[0], NULL, c->sock, NULL, queued,
+					SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+				if (moved > 0)
+					continue;
+				if (moved < 0 && errno == EAGAIN)
+					break;
+				stream_drop_client(c);
+				break;
+			}
+			if (c->sock < 0)
+				continue;
+
+			/* wait for room only while there is something to send */
+			slot[n - 2] = i;
+			pfds[n].fd = c->sock;
+			pfds[n].events = queued > 0 ? POLLIN | POLLOUT : POLLIN;
+			n++;
+		}
+		(void) pthread_mutex_unlock(&srv->lock);
+
+		if (poll(pfds, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			if (read(srv->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				break;
+			if (srv->quit)
+				break;
+		}
+
+		(void) pthread_mutex_lock(&srv->lock);
+		for (i = 2; i < n; i++) {
+			c = &srv->client[slot[i - 2]];
+			if (c->sock < 0)
+				continue;
+			if (pfds[i].revents & (POLLHUP | POLLERR)) {
+				stream_drop_client(c);
+				continue;
+			}
+			/* a request or a handshake gets no answer but the stream */
+			if (pfds[i].revents & POLLIN) {
+				while ((moved = recv(c->sock, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+					;
+				if (moved == 0 || errno != EAGAIN)
+					stream_drop_client(c);
+			}
+		}
+		(void) pthread_mutex_unlock(&srv->lock);
+
+		if (pfds[1].revents & POLLIN)
+			stream_accept(srv);
+	}
+
+	return 0;
+}
+
+static void stream_close(struct wm_drive *d)
+{
+	struct cdda_stream *srv = (struct cdda_stream *)d->cdda_stream;
+	uint64_t one = 1;
+	int i;
+
+	if (!srv)
+		return;
+	d->cdda_stream = NULL;
+
+	if (srv->consumer >= 0)
+		wm_cdda_unsubscribe(d, srv->consumer);
+
+	if (srv->thread) {
+		srv->quit = 1;
+		if (write(srv->wake_fd, &one, sizeof(one)) < 0)
+			ERRORLOG("cdda stream: unable to wake the server\n");
+		pthread_join(srv->thread, NULL);
+		srv->thread = 0;
+	}
+
+	for (i = 0; i < STREAM_CLIENTS; i++)
+		if (srv->client[i].sock >= 0)
+			stream_drop_client(&srv->client[i]);
+	if (srv->listen_fd >= 0) {
+		close(srv->listen_fd);
+		wm_unix_unlink(srv->path);
+	}
+	if (srv->wake_fd >= 0)
+		close(srv->wake_fd);
+	if (srv->null_fd >= 0)
+		close(srv->null_fd);
+	if (srv->source[0] >= 0) {
+		close(srv->source[0]);
+		close(srv->source[1]);
+	}
+	free(srv->path);
+	pthread_mutex_destroy(&srv->lock);
+	free(srv);
+}
+
+/*
+ * Serve the playing audio on the socket path, or stop with NULL. The
+ * drive never waits for the clients.
+ */
+int wm_cdda_stream(struct wm_drive *d, const char *path)
+{
+	struct cdda_stream *srv;
+	int i;
+
+	stream_close(d);
+	if (!path || !*path)
+		return 0;
+
+	if (!(srv = calloc(1, sizeof(*srv))))
+		return -1;
+	srv->consumer = srv->listen_fd = srv->wake_fd = srv->null_fd = -1;
+	pthread_mutex_init(&srv->lock, NULL);
+	for (i = 0; i < STREAM_CLIENTS; i++)
+		srv->client[i].sock = srv->client[i].pipe[0] = srv->client[i].pipe[1] = -1;
+	d->cdda_stream = srv;
+
+	if (pipe2(srv->source, O_CLOEXEC) < 0) {
+		srv->source[0] = srv->source[1] = -1;
+		goto fail;
+	}
+	srv->block_bytes = d->frames_at_once * 2352;
+	if (fcntl(srv->source[1], F_SETPIPE_SZ, srv->block_bytes * 2) < 0 ||
+		(srv->null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0)
+		goto fail;
+
+	srv->path = strdup(path);
+	if ((srv->listen_fd = wm_unix_listen(path, STREAM_CLIENTS)) < 0) {
+		ERRORLOG("cdda stream: unable to listen on %s\n", path);
+		goto fail;
+	}
+
+	if ((srv->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+		pthread_create(&srv->thread, NULL, stream_fct_serve, srv)) {
+		srv->thread = 0;
+		goto fail;
+	}
+
+	if ((srv->consumer = wm_cdda_subscribe(d, stream_publish, srv, WM_CDDA_DROP)) < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	stream_close(d);
+	return -1;
+}
+
+#else
+
+int wm_cdda_stream(struct wm_drive *d, const char *path)
+{
+	return (path && *path) ? -1 : 0;
+}
+
+#endif /* __linux__ */
@@ -47,40 +47,34 @@
 #include "include/wm_cdrom.h"
 
 /*
- * Subroutine from cddb_discid
+ * Subroutine from cddb_discid, sum of the decimal digits
  */
 static int cddb_sum(int n)
 {
-	char	buf[12],
-		*p;
 	int	ret = 0;
 
 	/* For backward compatibility this algorithm must not change */
-	sprintf(buf, "%lu", (unsigned long)n);
-	for (p = buf; *p != '\0'; p++)
-	  ret += (*p - '0');
+	for (; n > 0; n /= 10)
+	  ret += n % 10;
 
 	return (ret);
 } /* cddb_sum() */
 
 
 /*
- * Calculate the discid of a CD according to cddb
+ * Calculate the discid of a CD according to cddb, start holds the first
+ * frame of every track and of the lead-out
  */
-unsigned long cddb_discid(struct wm_drive *pdrive)
+unsigned long cddb_discid_toc(const unsigned int *start, int tracks)
 {
 	int	i,
 		t,
-		n = 0, tracks;
-
-    tracks = wm_cd_getcountoftracks(pdrive);
-	if(!tracks)
-		return (unsigned)-1;
+		n = 0;
 
 	/* For backward compatibility this algorithm must not change */
 	for (i = 0; i < tracks; i++) {
 
-		n += cddb_sum(wm_cd_gettrackstart(pdrive, i + 1));
+		n += cddb_sum(start[i] / 75);
 	/*
 	 * Just for demonstration (See below)
 	 *
@@ -100,7 +94,25 @@ unsigned long cddb_discid(struct wm_drive *pdrive)
          * fields.
          */
 
-        t = (wm_cd_gettrackstart(pdrive, tracks + 1)) - (wm_cd_gettrackstart(pdrive, 1));
+        t = (start[tracks] / 75) - (start[0] / 75);
 	return ((n % 0xff) << 24 | t << 8 | tracks);
+} /* cddb_discid_toc() */
+
+/*
+ * Calculate the discid of the CD in the drive
+ */
+unsigned long cddb_discid(struct wm_drive *pdrive)
+{
+	unsigned int start[100];
+	int	i, tracks;
+
+    tracks = wm_cd_getcountoftracks(pdrive);
+	if(!tracks || tracks > 99)
+		return (unsigned)-1;
+
+	for (i = 0; i <= tracks; i++)
+		start[i] = wm_cd_gettrackstart(pdrive, i + 1);
+
+	return cddb_discid_toc(start, tracks);
 } /* cddb_discid() */
 
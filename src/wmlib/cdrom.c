@@ -37,6 +37,7 @@
 #include "include/wm_scsi.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -51,10 +52,17 @@
 /* local prototypes */
 static int fixup_drive_struct(struct wm_drive *);
 static int read_toc(struct wm_drive *);
+static void free_indexmap(struct wm_drive *);
 static const char* gen_status(int);
 
 #define WM_MSG_CLASS WM_MSG_CLASS_CDROM
 
+/* The CDDA reader looks up the index map while it may be replaced. */
+static pthread_mutex_t indexmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Guards wm_drive.cancel, set from another thread than the reading one. */
+static pthread_mutex_t cancel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /* extern struct wm_drive generic_proto, toshiba_proto, sony_proto; */
 /*	toshiba33_proto; <=== Somehow, this got lost */
 
@@ -116,7 +124,7 @@ int wm_get_cur_pos_abs(void *p)
  * init the workmanlib
  */
 int wm_cd_init(const char *cd_device, const char *soundsystem,
-  const char *sounddevice, const char *ctldevice, void **ppdrive)
+  const char *sounddevice, const char *ctldevice, int latency_profile, void **ppdrive)
 {
 	int err;
 	struct wm_drive *pdrive;
@@ -135,6 +143,8 @@ int wm_cd_init(const char *cd_device, const char *soundsystem,
 	pdrive->soundsystem = soundsystem ? strdup(soundsystem): NULL;
 	pdrive->sounddevice = sounddevice ? strdup(sounddevice) : NULL;
 	pdrive->ctldevice = ctldevice ? strdup(ctldevice) : NULL;
+	pdrive->latency_profile = (latency_profile >= WM_LATENCY_LOW &&
+		latency_profile <= WM_LATENCY_POWERSAVE) ? latency_profile : WM_LATENCY_DEFAULT;
 	if(!pdrive->cd_device) {
 		err = -ENOMEM;
 		goto init_failed;
@@ -166,6 +176,10 @@ int wm_cd_init(const char *cd_device, const char *soundsystem,
 	if ((err = pdrive->proto.open(pdrive)) < 0)
 		goto open_failed;
 
+	/* a changer comes up with whatever slot it had loaded */
+	if (!pdrive->proto.get_slot || pdrive->proto.get_slot(pdrive, &pdrive->slot) < 0)
+		pdrive->slot = 0;
+
 	/* Can we figure out the drive type? */
 	if (wm_scsi_get_drive_type(pdrive)) {
 		wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "plat_open(): inquiry failed\n");
@@ -195,7 +209,10 @@ init_failed:
 int wm_cd_destroy(void *p)
 {
 	struct wm_drive *pdrive = (struct wm_drive *)p;
-	free_cdtext();
+	free_cdtext(pdrive);
+	free(pdrive->cdtext_cache_dir);
+	pdrive->cdtext_cache_dir = NULL;
+	free_indexmap(pdrive);
 
 	if(pdrive->cdda)
 		wm_cdda_destroy(pdrive);
@@ -283,11 +300,13 @@ static int read_toc(struct wm_drive *pdrive)
 	pdrive->thiscd.length = 0;
 	pdrive->thiscd.cur_cdmode = WM_CDM_UNKNOWN;
 	pdrive->thiscd.cd_cur_balance = WM_BALANCE_SYMMETRED;
+	pdrive->thiscd.mcn[0] = 0;
+	pdrive->thiscd.codes_read = 0;
 
 	if (pdrive->thiscd.trk != NULL)
 		free(pdrive->thiscd.trk);
 
-	pdrive->thiscd.trk = malloc((pdrive->thiscd.ntracks + 1) * sizeof(struct wm_trackinfo));
+	pdrive->thiscd.trk = calloc(pdrive->thiscd.ntracks + 1, sizeof(struct wm_trackinfo));
 	if (pdrive->thiscd.trk == NULL) {
 		perror("malloc");
 		return -1;
@@ -361,8 +380,11 @@ int wm_cd_status(void *p)
 		if(read_toc(pdrive) || 0 == pdrive->thiscd.ntracks) {
 
 			mode = WM_CDM_NO_DISC;
-		} else /* refresh cdtext info */
-			get_glob_cdtext(pdrive, 1);
+		}
+
+		/* cdtext of the old disc is gone, the new one is read on demand */
+		free_cdtext(pdrive);
+		free_indexmap(pdrive);
 
 		wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS,
 			"device status changed() from %s to %s\n",
@@ -490,6 +512,412 @@ int wm_cd_gettrackdata(void *p, int track)
   return pdrive->thiscd.trk[CARRAY(track)].data;
 }
 
+void wm_cd_cancel(void *p, int cancel)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	pthread_mutex_lock(&cancel_mutex);
+	pdrive->cancel = cancel;
+	pthread_mutex_unlock(&cancel_mutex);
+}
+
+static int cancelled(struct wm_drive *pdrive)
+{
+	int ret;
+
+	pthread_mutex_lock(&cancel_mutex);
+	ret = pdrive->cancel;
+	pthread_mutex_unlock(&cancel_mutex);
+
+	return ret;
+}
+
+/*
+ * wm_cd_read_codes()
+ *
+ * Read the media catalogue number and the ISRC of every audio track.
+ * The commands are sent back to back while the disc is spinning; if the
+ * drive refuses the first one, the track loop is not attempted at all.
+ */
+int wm_cd_read_codes(void *p)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	int i;
+
+	if(WM_CDS_NO_DISC(wm_cd_status(pdrive)) || pdrive->thiscd.trk == NULL)
+		return -1;
+
+	if(pdrive->thiscd.codes_read)
+		return 0;
+
+	if(!wm_scsi_get_mcn(pdrive, pdrive->thiscd.mcn)) {
+		for(i = 0; i < pdrive->thiscd.ntracks; i++) {
+			if(cancelled(pdrive))
+				return -1;
+			if(pdrive->thiscd.trk[i].data)
+				continue;
+			if(wm_scsi_get_isrc(pdrive, pdrive->thiscd.trk[i].track, pdrive->thiscd.trk[i].isrc) < 0)
+				break;
+		}
+	}
+	pdrive->thiscd.codes_read = 1;
+
+	wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "disc MCN '%s'\n", pdrive->thiscd.mcn);
+
+	return 0;
+}
+
+const char *wm_cd_getmcn(void *p)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	return pdrive->thiscd.codes_read ? pdrive->thiscd.mcn : "";
+}
+
+const char *wm_cd_gettrackisrc(void *p, int track)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	if (track < 1 ||
+		track > pdrive->thiscd.ntracks ||
+		pdrive->thiscd.trk == NULL ||
+		!pdrive->thiscd.codes_read)
+		return "";
+
+	return pdrive->thiscd.trk[CARRAY(track)].isrc;
+}
+
+static void free_indexmap(struct wm_drive *pdrive)
+{
+	struct wm_indexmap *map;
+	int i;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	map = pdrive->indexmap;
+	pdrive->indexmap = NULL;
+	pthread_mutex_unlock(&indexmap_mutex);
+
+	if(!map)
+		return;
+
+	for(i = 0; i < map->ntracks; i++)
+		free(map->trk[i].index);
+	free(map->trk);
+	free(map);
+}
+
+/*
+ * Probe frames from "frame" on in direction "step" for one whose Q
+ * sub-channel carries a position, skipping up to a second of frames
+ * without one. Returns the frame probed, "limit" if it was reached
+ * first and -1 on read errors, a longer gap or if cancelled.
+ */
+static int read_position(struct wm_drive *pdrive, int frame, int step, int limit,
+	int *track, int *index)
+{
+	int i, ret;
+
+	for(i = 0; frame != limit; i++, frame += step) {
+		if(i == 75 || cancelled(pdrive))
+			return -1;
+		ret = wm_scsi_read_subq(pdrive, frame - 150, track, index);
+		if(ret < 0)
+			return -1;
+		if(!ret)
+			return frame;
+	}
+
+	return limit;
+}
+
+/*
+ * First frame in [lo, hi) at or behind position (track, index), hi if
+ * there is none. Takes O(log(hi - lo)) reads. A stretch without position
+ * up to hi counts as behind it. Returns -1 on read errors.
+ */
+static int find_boundary(struct wm_drive *pdrive, int lo, int hi, int track, int index)
+{
+	int mid, probe, t, x;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		probe = read_position(pdrive, mid, 1, hi, &t, &x);
+		if(probe < 0)
+			return -1;
+
+		if(probe == hi)
+			hi = mid;
+		else if(t > track || (t == track && x >= index))
+			hi = probe;
+		else
+			lo = probe + 1;
+	}
+
+	return hi;
+}
+
+/*
+ * wm_cd_scan_indexes()
+ *
+ * Build the index map of all audio tracks. For every track the pregap
+ * of the next one and the index points behind index 1 are searched for.
+ * Where that fails, the track keeps what was found so far, at least its
+ * start from the TOC. wm_cd_cancel() stops it without a map.
+ */
+int wm_cd_scan_indexes(void *p)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	struct wm_indexmap *map;
+	struct wm_trackinfo *trk;
+	struct wm_trackindex *ti;
+	int i, k, end, probe, t, x, ret = -1;
+
+	if(WM_CDS_NO_DISC(wm_cd_status(pdrive)) || pdrive->thiscd.trk == NULL)
+		return -1;
+
+	if(pdrive->indexmap)
+		return 0;
+
+	map = calloc(1, sizeof(*map));
+	if(!map)
+		return -1;
+	map->ntracks = pdrive->thiscd.ntracks;
+	map->trk = calloc(map->ntracks, sizeof(*map->trk));
+	if(!map->trk)
+		goto out;
+
+	for(i = 0; i < map->ntracks; i++)
+		map->trk[i].pregap = pdrive->thiscd.trk[i].start;
+
+	/* Audio before the start of track 1 is its index 0. */
+	trk = &pdrive->thiscd.trk[0];
+	if(!trk->data && trk->start > 150) {
+		probe = read_position(pdrive, 150, 1, trk->start, &t, &x);
+		if(probe >= 0 && probe < trk->start && t == 1 && x == 0)
+			map->trk[0].pregap = 150;
+	}
+
+	for(i = 0; i < map->ntracks; i++) {
+		if(cancelled(pdrive))
+			goto out;
+
+		trk = &pdrive->thiscd.trk[i];
+		ti = &map->trk[i];
+
+		ti->count = 1;
+		ti->index = malloc(sizeof(int));
+		if(!ti->index)
+			goto out;
+		ti->index[0] = trk->start;
+		if(trk->data)
+			continue;
+
+		end = trk[1].start;
+		if(i + 1 < map->ntracks && trk[1].data) {
+			/* the session gap in front of the data track of an enhanced CD */
+			if(end - 11400 > trk->start)
+				end -= 11400;
+		} else if(i + 1 < map->ntracks) {
+			/* unknown, the next track keeps its TOC start as pregap */
+			probe = find_boundary(pdrive, trk->start, end, i + 2, 0);
+			if(probe < 0)
+				continue;
+			end = map->trk[i + 1].pregap = probe;
+		}
+
+		/* The last index of the track is the one right in front of "end". */
+		probe = read_position(pdrive, end - 1, -1, trk->start - 1, &t, &x);
+		if(probe < trk->start || t != i + 1 || x <= 1)
+			continue;
+
+		free(ti->index);
+		ti->index = malloc(x * sizeof(int));
+		if(!ti->index)
+			goto out;
+		ti->index[0] = trk->start;
+		for(k = 1; k < x; k++) {
+			ti->index[k] = find_boundary(pdrive, ti->index[k - 1], end, i + 1, k + 1);
+			if(ti->index[k] < 0)
+				break;
+		}
+		ti->count = k;
+	}
+
+	if(cancelled(pdrive))
+		goto out;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	if(!pdrive->indexmap) {
+		pdrive->indexmap = map;
+		map = NULL;
+	}
+	pthread_mutex_unlock(&indexmap_mutex);
+	ret = 0;
+
+	wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "index map of %i tracks built\n",
+		pdrive->thiscd.ntracks);
+
+out:
+	if(map) {
+		if(map->trk) {
+			for(i = 0; i < map->ntracks; i++)
+				free(map->trk[i].index);
+			free(map->trk);
+		}
+		free(map);
+	}
+	if(ret)
+		wm_lib_message(WM_MSG_LEVEL_INFO|WM_MSG_CLASS, "scanning the index points failed\n");
+
+	return ret;
+}
+
+int wm_cd_gettrackpregap(void *p, int track)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	int ret;
+
+	if (track < 1 ||
+		track > pdrive->thiscd.ntracks ||
+		pdrive->thiscd.trk == NULL)
+		return 0;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	ret = pdrive->indexmap ? pdrive->indexmap->trk[CARRAY(track)].pregap :
+		pdrive->thiscd.trk[CARRAY(track)].start;
+	pthread_mutex_unlock(&indexmap_mutex);
+
+	return ret;
+}
+
+int wm_cd_gettrackindexcount(void *p, int track)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	int ret;
+
+	if (track < 1 ||
+		track > pdrive->thiscd.ntracks ||
+		pdrive->thiscd.trk == NULL)
+		return 0;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	ret = pdrive->indexmap ? pdrive->indexmap->trk[CARRAY(track)].count : 1;
+	pthread_mutex_unlock(&indexmap_mutex);
+
+	return ret;
+}
+
+/*
+ * Start frame of index point "index" (1 on) of the track, 0 if none.
+ */
+int wm_cd_gettrackindex(void *p, int track, int index)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	struct wm_trackindex *ti;
+	int ret = 0;
+
+	if (track < 1 ||
+		track > pdrive->thiscd.ntracks ||
+		pdrive->thiscd.trk == NULL ||
+		index < 1)
+		return 0;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	if(pdrive->indexmap) {
+		ti = &pdrive->indexmap->trk[CARRAY(track)];
+		if(index <= ti->count)
+			ret = ti->index[index - 1];
+	} else if(index == 1) {
+		ret = pdrive->thiscd.trk[CARRAY(track)].start;
+	}
+	pthread_mutex_unlock(&indexmap_mutex);
+
+	return ret;
+}
+
+/*
+ * Track and index of an absolute frame, by binary search in the index
+ * map. Returns -1 if there is no map yet or the frame is in no track.
+ */
+int wm_cd_locate(void *p, int frame, int *track, int *index)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	struct wm_indexmap *map;
+	struct wm_trackindex *ti;
+	int lo, hi, mid, ret = -1;
+
+	pthread_mutex_lock(&indexmap_mutex);
+	map = pdrive->indexmap;
+	if(!map || !map->ntracks || frame < map->trk[0].pregap)
+		goto out;
+
+	/* last track whose pregap starts at or before the frame */
+	for(lo = 0, hi = map->ntracks; hi - lo > 1;) {
+		mid = lo + (hi - lo) / 2;
+		if(map->trk[mid].pregap <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	ti = &map->trk[lo];
+	*track = lo + 1;
+
+	if(frame < ti->index[0]) {
+		*index = 0;
+	} else {
+		for(lo = 0, hi = ti->count; hi - lo > 1;) {
+			mid = lo + (hi - lo) / 2;
+			if(ti->index[mid] <= frame)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		*index = lo + 1;
+	}
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&indexmap_mutex);
+	return ret;
+}
+
+int wm_cd_getcountofslots(void *p)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	int slots;
+
+	if(!pdrive->proto.get_slots || pdrive->proto.get_slots(pdrive, &slots) < 0 || slots < 1)
+		return 1;
+
+	return slots;
+}
+
+int wm_cd_getslot(void *p)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	return pdrive->slot;
+}
+
+int wm_cd_selectslot(void *p, int slot)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(slot == pdrive->slot)
+		return 0;
+
+	if(slot < 0 || slot >= wm_cd_getcountofslots(pdrive) ||
+		!pdrive->proto.select_slot || pdrive->proto.select_slot(pdrive, slot) < 0)
+		return -1;
+
+	pdrive->slot = slot;
+	/* the TOC and everything kept with it is reread for the new disc */
+	pdrive->oldmode = WM_CDM_NO_DISC;
+
+	wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "changer slot %i selected\n", slot);
+
+	return 0;
+}
+
 /*
  * wm_cd_play(starttrack, pos, endtrack)
  *
@@ -680,6 +1108,16 @@ struct cdtext_info* wm_cd_get_cdtext(void *p)
 	return get_glob_cdtext(pdrive, 0);
 }
 
+int wm_cd_set_cdtext_cache(void *p, const char *dir)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	free(pdrive->cdtext_cache_dir);
+	pdrive->cdtext_cache_dir = dir ? strdup(dir) : NULL;
+
+	return 0;
+}
+
 int wm_cd_set_verbosity(int level)
 {
 	wm_lib_set_verbosity(level);
@@ -758,6 +1196,98 @@ int wm_cd_getvolume(void *p)
 	}
 }
 
+int wm_cd_get_audio_stats(void *p, struct wm_audio_stats *stats)
+{
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	memset(stats, 0, sizeof(*stats));
+#ifdef WMLIB_CDDA_BUILD
+	if(pdrive->cdda)
+		return wm_cdda_get_stats(pdrive, stats);
+#endif
+	return -1;
+}
+
+int wm_cd_cdda_record(void *p, const char *filename)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(pdrive->cdda)
+		return wm_cdda_record(pdrive, filename);
+#endif
+	return -1;
+}
+
+int wm_cd_cdda_export(void *p, const char *path)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(pdrive->cdda)
+		return wm_cdda_export(pdrive, path);
+#endif
+	return -1;
+}
+
+int wm_cd_cdda_stream(void *p, const char *path)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(pdrive->cdda)
+		return wm_cdda_stream(pdrive, path);
+#endif
+	return -1;
+}
+
+int wm_cd_set_crossfade(void *p, int ms, int trim)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(pdrive->cdda)
+		return wm_cdda_crossfade(pdrive, ms, trim);
+#endif
+	return -1;
+}
+
+int wm_cd_queue(void *p, int track)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+	int start, end;
+
+	if(!pdrive->cdda)
+		return -1;
+
+	if(track < 1 || track > pdrive->thiscd.ntracks ||
+		pdrive->thiscd.trk[CARRAY(track)].data == DATATRACK)
+		return wm_cdda_queue(pdrive, 0, 0);
+
+	/* the same range wm_cd_play() gives a single track */
+	start = pdrive->thiscd.trk[CARRAY(track)].start;
+	end = (track == pdrive->thiscd.ntracks) ? pdrive->thiscd.length * 75 :
+		pdrive->thiscd.trk[CARRAY(track + 1)].start - 1;
+
+	return wm_cdda_queue(pdrive, start, end - 1);
+#else
+	return -1;
+#endif
+}
+
+int wm_cd_cdda_levels(void *p, int *left, int *right)
+{
+#ifdef WMLIB_CDDA_BUILD
+	struct wm_drive *pdrive = (struct wm_drive *)p;
+
+	if(pdrive->cdda)
+		return wm_cdda_levels(pdrive, left, right);
+#endif
+	*left = *right = 0;
+	return -1;
+}
+
 int wm_cd_getbalance(void *p)
 {
 	struct wm_drive *pdrive = (struct wm_drive *)p;
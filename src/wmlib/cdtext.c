@@ -16,13 +16,16 @@
  ***************************************************************************/
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
-#ifdef libunicode
-  #include <unicode.h>
+
+#include <config-iconv.h>
+#ifdef HAVE_ICONV
+  #include <iconv.h>
 #endif
 
 #include "include/wm_config.h"
@@ -32,182 +35,733 @@
 #include "include/wm_helpers.h"
 #include "include/wm_cdtext.h"
 #include "include/wm_scsi.h"
+#include "include/wm_cddb.h"
 
 #define WM_MSG_CLASS WM_MSG_CLASS_MISC
 
+/* equal entries are stored once, looked up by a hash of their text */
+#define CDTEXT_INTERN_SLOTS 1024
+
+/* text fields per block: name, performer, songwriter, composer,
+   arranger, message, UPC/EAN/ISRC */
+#define CDTEXT_TEXT_FIELDS 7
+
+/* the stream is read again while more than one pack in
+   CDTEXT_BAD_CRC_RATIO fails the CRC check, at most CDTEXT_READ_RETRIES times */
+#define CDTEXT_BAD_CRC_RATIO 10
+#define CDTEXT_READ_RETRIES 2
+
 /* local prototypes */
-int free_cdtext_info_block(struct cdtext_info_block* cdtextinfoblock);
 int free_cdtext_info(struct cdtext_info* cdtextinfo);
-struct cdtext_info_block* malloc_cdtext_info_block(int count_of_tracks);
-void get_data_from_cdtext_pack(
-  const struct cdtext_pack_data_header *pack,
-  cdtext_string *p_componente);
 
-struct cdtext_info wm_cdtext_info;
+/*
+ * State of the single pass over the pack stream. Only one entry is
+ * assembled at a time, always at the tail of the arena, so appending a
+ * character is a plain store.
+ */
+struct cdtext_parser {
+  unsigned char *text;   /* start of the text part of the arena */
+  cdtext_string *field;  /* field the open entry belongs to */
+  int entry;             /* index of the open entry in field */
+  int width;             /* 1 for singlebyte, 2 for doublebyte characters */
+  unsigned char *start;  /* first byte of the open entry */
+  unsigned char *tail;   /* next free byte of the arena */
+  unsigned char *end;
+  cdtext_string intern[CDTEXT_INTERN_SLOTS];
+};
 
-int free_cdtext_info_block(struct cdtext_info_block* cdtextinfoblock)
+/*
+ * CRC-16/CCITT (x^16 + x^12 + x^5 + 1, MSB first) of the first 16 bytes
+ * of a pack, stored inverted in the last two. Slicing-by-8: eight input
+ * bytes are folded per step through eight 256 entry tables.
+ */
+static unsigned short cdtext_crc_table[8][256];
+static pthread_once_t cdtext_crc_once = PTHREAD_ONCE_INIT;
+
+static void cdtext_crc_init(void)
 {
-  if(cdtextinfoblock)
+  unsigned short crc;
+  int i, j;
+
+  for(i = 0; i < 256; i++)
   {
-    if(cdtextinfoblock->name)
-      free(cdtextinfoblock->name);
-    if(cdtextinfoblock->performer)
-      free(cdtextinfoblock->performer);
-    if(cdtextinfoblock->songwriter)
-      free(cdtextinfoblock->songwriter);
-    if(cdtextinfoblock->composer)
-      free(cdtextinfoblock->composer);
-    if(cdtextinfoblock->arranger)
-      free(cdtextinfoblock->arranger);
-    if(cdtextinfoblock->message)
-      free(cdtextinfoblock->message);
-    if(cdtextinfoblock->UPC_EAN_ISRC_code)
-      free(cdtextinfoblock->UPC_EAN_ISRC_code);
-
-    if(cdtextinfoblock->block_encoding_text)
-      free(cdtextinfoblock->block_encoding_text);
+    crc = i << 8;
+    for(j = 0; j < 8; j++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    cdtext_crc_table[0][i] = crc;
   }
 
-  return 0;
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      cdtext_crc_table[j][i] = (cdtext_crc_table[j - 1][i] << 8) ^
+        cdtext_crc_table[0][cdtext_crc_table[j - 1][i] >> 8];
 }
 
-int free_cdtext_info(struct cdtext_info* cdtextinfo)
+static int cdtext_check_crc(const struct cdtext_pack_data_header *pack)
+{
+  const unsigned char *p = (const unsigned char*)pack;
+  unsigned short crc = 0;
+  int i;
+
+  /* many drives do not pass the CRC on, nothing to check then */
+  if(!pack->crc_byte1 && !pack->crc_byte2)
+    return 1;
+
+  for(i = 0; i < 16; i += 8, p += 8)
+  {
+    crc = cdtext_crc_table[7][(crc >> 8) ^ p[0]] ^ cdtext_crc_table[6][(crc & 0xFF) ^ p[1]] ^
+      cdtext_crc_table[5][p[2]] ^ cdtext_crc_table[4][p[3]] ^
+      cdtext_crc_table[3][p[4]] ^ cdtext_crc_table[2][p[5]] ^
+      cdtext_crc_table[1][p[6]] ^ cdtext_crc_table[0][p[7]];
+  }
+  crc = ~crc;
+
+  return pack->crc_byte1 == (crc >> 8) && pack->crc_byte2 == (crc & 0xFF);
+}
+
+int wm_cdtext_verify_packs(unsigned char *buffer, int count_of_packs)
 {
+  struct cdtext_pack_data_header *pack;
+  int bad = 0;
   int i;
+
+  pthread_once(&cdtext_crc_once, cdtext_crc_init);
+
+  for(i = 0; i < count_of_packs; i++)
+  {
+    pack = (struct cdtext_pack_data_header*)buffer + i;
+    if(!cdtext_check_crc(pack))
+    {
+      wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+        "CDTEXT DEBUG: CRC error in pack %i\n", i);
+      pack->header_field_id1_typ_of_pack = 0;
+      bad++;
+    }
+  }
+
+  return bad;
+}
+
+int wm_cdtext_merge_packs(unsigned char *buffer, unsigned char *again,
+  int count_of_packs, int bad)
+{
+  struct cdtext_pack_data_header *pack, *good;
+  int i;
+
+  wm_cdtext_verify_packs(again, count_of_packs);
+  for(i = 0; i < count_of_packs; i++)
+  {
+    pack = (struct cdtext_pack_data_header*)buffer + i;
+    good = (struct cdtext_pack_data_header*)again + i;
+    if(!pack->header_field_id1_typ_of_pack && good->header_field_id1_typ_of_pack &&
+      pack->header_field_id3_sequence == good->header_field_id3_sequence)
+    {
+      *pack = *good;
+      bad--;
+    }
+  }
+
+  return bad;
+}
+
+/*
+ * Read the stream again and take over the packs that are good there but
+ * bad in the first read. Returns the number of packs still bad.
+ */
+static int cdtext_recover_packs(struct wm_drive *d, unsigned char *buffer,
+  int count_of_packs, int bad)
+{
+  unsigned char *buffer2;
+  int buffer2_length;
+
+  buffer2 = 0;
+  buffer2_length = 0;
+  if(wm_scsi_get_cdtext(d, &buffer2, &buffer2_length) || !buffer2)
+    return bad;
+
+  if(buffer2_length / (int)sizeof(struct cdtext_pack_data_header) == count_of_packs)
+    bad = wm_cdtext_merge_packs(buffer, buffer2, count_of_packs, bad);
+
+  free(buffer2);
+
+  return bad;
+}
+
+int free_cdtext_info(struct cdtext_info* cdtextinfo)
+{
   wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
     "CDTEXT INFO: free_cdtext_info() called\n");
 
   if(cdtextinfo)
   {
-    for(i = 0; i < 8; i++)
-    {
-      if(cdtextinfo->blocks[i])
-      {
-        free_cdtext_info_block(cdtextinfo->blocks[i]);
-      }
-    }
+    free(cdtextinfo->arena);
     memset(cdtextinfo, 0, sizeof(struct cdtext_info));
   }
 
   return 0;
 }
 
-struct cdtext_info_block* malloc_cdtext_info_block(int count_of_tracks)
+/*
+ * Size of the blocks marked in blocks_present and their entry tables.
+ */
+static int cdtext_layout_size(int count_of_entries, unsigned int blocks_present)
 {
-  int memamount;
-  struct cdtext_info_block* lp_block;
+  int count_of_blocks;
+  int i;
+
+  count_of_blocks = 0;
+  for(i = 0; i < MAX_LANGUAGE_BLOCKS; i++)
+    if(blocks_present & (1 << i))
+      count_of_blocks++;
+
+  return count_of_blocks * (sizeof(struct cdtext_info_block) +
+    count_of_entries * CDTEXT_TEXT_FIELDS * sizeof(cdtext_string));
+}
 
-  lp_block = malloc(sizeof(struct cdtext_info_block));
-  if(!lp_block)
+/*
+ * Place the blocks marked in blocks_present and their entry tables at the
+ * start of the arena, the text follows them. Nothing in the arena points
+ * into it, so the arena can be moved and laid out again.
+ */
+static void cdtext_layout(struct cdtext_info *info, unsigned int blocks_present)
+{
+  struct cdtext_info_block *lp_block;
+  cdtext_string *table;
+  int i;
+
+  lp_block = (struct cdtext_info_block*)info->arena;
+  table = (cdtext_string*)(info->arena + cdtext_layout_size(0, blocks_present));
+  for(i = 0; i < MAX_LANGUAGE_BLOCKS; i++)
   {
-    return (struct cdtext_info_block*)0;
+    info->blocks[i] = 0;
+    if(!(blocks_present & (1 << i)))
+      continue;
+
+    lp_block->block_code = i;
+    lp_block->name = table;
+    lp_block->performer = table + info->count_of_entries;
+    lp_block->songwriter = table + 2 * info->count_of_entries;
+    lp_block->composer = table + 3 * info->count_of_entries;
+    lp_block->arranger = table + 4 * info->count_of_entries;
+    lp_block->message = table + 5 * info->count_of_entries;
+    lp_block->UPC_EAN_ISRC_code = table + 6 * info->count_of_entries;
+
+    info->blocks[i] = lp_block;
+    lp_block++;
+    table += info->count_of_entries * CDTEXT_TEXT_FIELDS;
   }
-  memset(lp_block, 0, sizeof(struct cdtext_info_block));
-
-  memamount = count_of_tracks * sizeof(cdtext_string);
-
-  lp_block->name = malloc(memamount);
-  if(!lp_block->name)
-    goto bail_out;
-  memset(lp_block->name, 0, memamount);
-
-  lp_block->performer = malloc(memamount);
-  if(!lp_block->performer)
-    goto bail_out;
-  memset(lp_block->performer, 0, memamount);
-
-  lp_block->songwriter = malloc(memamount);
-  if(!lp_block->songwriter)
-    goto bail_out;
-  memset(lp_block->songwriter, 0, memamount);
-
-  lp_block->composer = malloc(memamount);
-  if(!lp_block->composer)
-    goto bail_out;
-  memset(lp_block->composer, 0, memamount);
-
-  lp_block->arranger = malloc(memamount);
-  if(!lp_block->arranger)
-    goto bail_out;
-  memset(lp_block->arranger, 0, memamount);
-
-  lp_block->message = malloc(memamount);
-  if(!lp_block->message)
-    goto bail_out;
-  memset(lp_block->message, 0, memamount);
-
-  lp_block->UPC_EAN_ISRC_code = malloc(memamount);
-  if(!lp_block->UPC_EAN_ISRC_code)
-    goto bail_out;
-  memset(lp_block->UPC_EAN_ISRC_code, 0, memamount);
-
-  return lp_block;
-
-bail_out:
-  free_cdtext_info_block(lp_block);
-  free(lp_block);
-  return 0;
+  info->text = (const unsigned char*)table;
 }
 
-void get_data_from_cdtext_pack(
-  const struct cdtext_pack_data_header *pack,
-  cdtext_string *p_componente)
+static unsigned int cdtext_blocks_present(const struct cdtext_info *info)
+{
+  unsigned int blocks_present = 0;
+  int i;
+
+  for(i = 0; i < MAX_LANGUAGE_BLOCKS; i++)
+    if(info->blocks[i])
+      blocks_present |= 1 << i;
+
+  return blocks_present;
+}
+
+/*
+ * Allocate the blocks present in the pack stream, their entry tables and
+ * room for the text in one piece. Returns the room for the text.
+ */
+static int cdtext_alloc_arena(struct cdtext_info *info,
+  const unsigned char *buffer, int count_of_packs)
 {
+  const struct cdtext_pack_data_header *pack;
+  unsigned int blocks_present;
+  int text_length;
+  int i;
+
+  blocks_present = 0;
+  for(i = 0; i < count_of_packs; i++)
+  {
+    pack = (const struct cdtext_pack_data_header*)buffer + i;
+    if(pack->header_field_id1_typ_of_pack >= 0x80 && pack->header_field_id1_typ_of_pack < 0x90)
+      blocks_present |= 1 << ((pack->header_field_id4_block_no >> 4) & 0x07);
+  }
+
+  /* every byte of a text field takes at most one byte in the arena, plus
+     the terminator of an entry that may be open at a pack end. two zero
+     bytes in front are the empty string */
+  text_length = 2 + (count_of_packs + 1) * (DATAFIELD_LENGHT_IN_PACK + 2);
+  if(text_length > 0xFFFF)
+    text_length = 0xFFFF;
+
+  info->arena_length = cdtext_layout_size(info->count_of_entries, blocks_present) + text_length;
+  info->arena = calloc(1, info->arena_length);
+  if(!info->arena)
+    return -1;
+
+  cdtext_layout(info, blocks_present);
+
+  return text_length;
+}
+
+/*
+ * Give the unused end of the arena back once the text is complete.
+ */
+static void cdtext_shrink_arena(struct cdtext_info *info, int text_used)
+{
+  unsigned int blocks_present = cdtext_blocks_present(info);
+  unsigned char *arena;
+  int length;
+
+  length = (info->text - info->arena) + text_used;
+  arena = realloc(info->arena, length);
+  if(!arena)
+    return;
+
+  info->arena = arena;
+  info->arena_length = length;
+  cdtext_layout(info, blocks_present);
+}
 
-  int arr = pack->header_field_id2_tracknumber;
+/*
+ * On-disk cache, one file per disc named after the disc id and a hash of
+ * the TOC. The file is a cdtext_cache_header followed by the arena, the
+ * pointers in the arena are set up again by cdtext_layout() on load. Only
+ * complete reads are stored, a disc without CD-Text or with bad packs is
+ * asked again next time.
+ */
+#define CDTEXT_CACHE_MAGIC 0x54434D57 /* "WMCT" */
+#define CDTEXT_CACHE_VERSION 2
+
+struct cdtext_cache_header {
+  unsigned int magic;
+  unsigned int version;
+  int count_of_entries;
+  int count_of_valid_packs;
+  int count_of_invalid_packs;
+  int valid;
+  int arena_length;
+  unsigned int blocks_present;
+};
+
+static char *cdtext_cache_file(struct wm_drive *d)
+{
+  unsigned int hash = 2166136261u; /* FNV-1a over the TOC */
+  char *path;
   int i;
-  int language_block;
-  int unicode;
 
-  language_block = (pack->header_field_id4_block_no >> 4) & 0x07;
-  unicode = pack->header_field_id4_block_no & 0x80;
+  if(!d->cdtext_cache_dir || !d->thiscd.trk || d->thiscd.ntracks < 1)
+    return NULL;
+
+  for(i = 0; i <= d->thiscd.ntracks; i++)
+    hash = (hash ^ (unsigned int)d->thiscd.trk[i].start) * 16777619u;
+
+  path = malloc(strlen(d->cdtext_cache_dir) + 32);
+  if(path)
+    sprintf(path, "%s/%08lx-%08x.cdtext", d->cdtext_cache_dir, cddb_discid(d), hash);
+
+  return path;
+}
+
+static int cdtext_cache_check(const struct cdtext_info *info)
+{
+  const cdtext_string *entry;
+  int text_length = info->arena_length - (info->text - info->arena);
+  int i, j, width;
+
+  if(text_length < 2)
+    return 0;
 
-  if(!unicode)
+  for(i = 0; i < MAX_LANGUAGE_BLOCKS; i++)
   {
-    for(i = 0; i < DATAFIELD_LENGHT_IN_PACK; i++)
+    if(!info->blocks[i])
+      continue;
+    entry = info->blocks[i]->name;
+    /* every entry is followed by its terminator, 2 bytes for doublebytes */
+    width = info->blocks[i]->block_unicode ? 2 : 1;
+    for(j = 0; j < info->count_of_entries * CDTEXT_TEXT_FIELDS; j++)
+      if(entry[j].offset + entry[j].length + width > text_length)
+        return 0;
+  }
+
+  return 1;
+}
+
+static int cdtext_cache_load(struct wm_drive *d, struct cdtext_info *info)
+{
+  struct cdtext_cache_header header;
+  char *path;
+  FILE *f;
+  int ok;
+
+  path = cdtext_cache_file(d);
+  if(!path)
+    return 0;
+
+  f = fopen(path, "rb");
+  free(path);
+  if(!f)
+    return 0;
+
+  ok = fread(&header, sizeof(header), 1, f) == 1 &&
+    header.magic == CDTEXT_CACHE_MAGIC &&
+    header.version == CDTEXT_CACHE_VERSION &&
+    header.count_of_entries == d->thiscd.ntracks + 1 &&
+    header.valid && !header.count_of_invalid_packs &&
+    header.arena_length > 0 && header.arena_length <= 0x100000;
+
+  if(ok)
+  {
+    info->count_of_entries = header.count_of_entries;
+    info->count_of_valid_packs = header.count_of_valid_packs;
+    info->count_of_invalid_packs = header.count_of_invalid_packs;
+    info->arena_length = header.arena_length;
+
+    info->arena = malloc(header.arena_length);
+    ok = info->arena &&
+      fread(info->arena, header.arena_length, 1, f) == 1 &&
+      cdtext_layout_size(info->count_of_entries, header.blocks_present) < header.arena_length;
+    if(ok)
     {
-      if(pack->text_data_field[i] == 0x00) /* end marker */
-      {
-        arr++;
-      }
-      else if(pack->text_data_field[i] == 0x09) /* repeat last marker */
-      {
-        /* ASSERT(arr > 0) */
-        strcat((char*)(p_componente[arr]), (char*)(p_componente[arr-1]));
-        arr++;
-      }
-      else
-      {
-      	strncat((char*)(p_componente[arr]), (char*)(&(pack->text_data_field[i])), 1);
-      }
+      cdtext_layout(info, header.blocks_present);
+      ok = cdtext_cache_check(info);
     }
+    info->valid = ok;
+  }
+  fclose(f);
+
+  if(!ok)
+  {
+    free_cdtext_info(info);
+    return 0;
+  }
+
+  wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS, "CDTEXT DEBUG: read from cache\n");
+
+  return 1;
+}
+
+static void cdtext_cache_store(struct wm_drive *d, const struct cdtext_info *info)
+{
+  struct cdtext_cache_header header;
+  char *path, *temp;
+  FILE *f;
+  int ok;
+
+  path = cdtext_cache_file(d);
+  if(!path)
+    return;
+
+  temp = malloc(strlen(path) + 5);
+  if(!temp)
+  {
+    free(path);
+    return;
   }
-#ifdef libunicode
-  else /* doublebytes ;-) */
+  sprintf(temp, "%s.tmp", path);
+
+  memset(&header, 0, sizeof(header));
+  header.magic = CDTEXT_CACHE_MAGIC;
+  header.version = CDTEXT_CACHE_VERSION;
+  header.count_of_entries = info->count_of_entries;
+  header.count_of_valid_packs = info->count_of_valid_packs;
+  header.count_of_invalid_packs = info->count_of_invalid_packs;
+  header.valid = info->valid;
+  header.arena_length = info->arena_length;
+  header.blocks_present = cdtext_blocks_present(info);
+
+  f = fopen(temp, "wb");
+  if(f)
   {
-    for(i = 0; i < DATAFIELD_LENGHT_IN_PACK; i += 2)
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(info->arena, header.arena_length, 1, f) == 1;
+    ok = !fclose(f) && ok;
+
+    /* readers see either the old file or the complete new one */
+    if(!ok || rename(temp, path))
+      unlink(temp);
+  }
+
+  free(temp);
+  free(path);
+}
+
+/*
+ * Look the open entry up among the stored ones. Returns the stored copy,
+ * or registers the open entry and returns 0.
+ */
+static const cdtext_string *cdtext_intern(struct cdtext_parser *p, unsigned short length)
+{
+  unsigned int hash = 2166136261u; /* FNV-1a */
+  unsigned int slot;
+  unsigned int i;
+  cdtext_string *s;
+
+  for(i = 0; i < length; i++)
+    hash = (hash ^ p->start[i]) * 16777619u;
+
+  for(i = 0; i < CDTEXT_INTERN_SLOTS; i++)
+  {
+    slot = (hash + i) & (CDTEXT_INTERN_SLOTS - 1);
+    s = &p->intern[slot];
+    if(!s->length)
+    {
+      s->offset = p->start - p->text;
+      s->length = length;
+      return 0;
+    }
+    if(s->length == length && !memcmp(p->text + s->offset, p->start, length))
+      return s;
+  }
+
+  return 0; /* table full, keep the copy */
+}
+
+/*
+ * Terminate the open entry and store it in its field. A lone 0x09
+ * (0x09 0x09 by doublebytes) repeats the previous entry. Repeated and
+ * already known text is stored as a reference and its bytes are given
+ * back to the arena.
+ */
+static void cdtext_close_entry(struct cdtext_parser *p, int count_of_entries)
+{
+  const cdtext_string *known;
+  cdtext_string *entry;
+  int width = p->width;
+  unsigned short length;
+
+  if(!p->field)
+    return;
+
+  length = p->tail - p->start;
+  if(p->entry < count_of_entries)
+  {
+    entry = &p->field[p->entry];
+    if(length == width && p->start[0] == 0x09 && p->start[width - 1] == 0x09 && p->entry > 0)
+    {
+      *entry = p->field[p->entry - 1];
+      p->tail = p->start;
+    }
+    else if(!length)
+    {
+      entry->offset = 0;
+      entry->length = 0;
+    }
+    else if((known = cdtext_intern(p, length)))
+    {
+      *entry = *known;
+      p->tail = p->start;
+    }
+    else
     {
-      if((Uchar)(pack->text_data_field[i]) == 0x0000) /* end marker */
-      {
-        arr++;
-      }
-      else if((Uchar)(pack->text_data_field[i]) == 0x0909) /* repeat last marker */
-      {
-        /* ASSERT(arr > 0) */
-        strcat((char*)(p_componente[arr]), (char*)(p_componente[arr-1]));
-        arr++;
-      }
-      else
-      {
-        strncat((char*)(p_componente[arr]), u_uc_to_utf8((Uchar*)(&(pack->text_data_field[i]))), 1);
-      }
+      entry->offset = p->start - p->text;
+      entry->length = length;
+      memset(p->tail, 0, width);
+      p->tail += width;
     }
   }
-#else
-  else {
-     wm_lib_message(WM_MSG_LEVEL_ERROR | WM_MSG_CLASS, "cannot handle unicode");
+  else
+  {
+    /* track number out of range, forget the text */
+    p->tail = p->start;
   }
-#endif
+
+  p->entry++;
+  p->start = p->tail;
+}
+
+static void get_data_from_cdtext_pack(
+  struct cdtext_parser *p,
+  const struct cdtext_pack_data_header *pack,
+  cdtext_string *field,
+  int count_of_entries)
+{
+  const unsigned char *data = pack->text_data_field;
+  int entry = pack->header_field_id2_tracknumber & 0x7F;
+  int width = (pack->header_field_id4_block_no & 0x80) ? 2 : 1;
+  int i;
+
+  /* the text of the open entry continues in this pack only if it names
+     the same field and entry, anything else starts a new one */
+  if(field != p->field || entry != p->entry)
+  {
+    if(p->tail != p->start)
+      cdtext_close_entry(p, count_of_entries);
+    p->field = field;
+    p->entry = entry;
+    p->width = width;
+    p->start = p->tail;
+  }
+
+  for(i = 0; i < DATAFIELD_LENGHT_IN_PACK; i += width)
+  {
+    if(data[i] == 0x00 && data[i + width - 1] == 0x00) /* end marker */
+    {
+      cdtext_close_entry(p, count_of_entries);
+    }
+    else if(p->tail + 2 * width <= p->end)
+    {
+      p->tail[0] = data[i];
+      p->tail[width - 1] = data[i + width - 1];
+      p->tail += width;
+    }
+  }
+}
+
+int wm_cdtext_parse(struct cdtext_info *info, const unsigned char *buffer, int buffer_length)
+{
+  const struct cdtext_pack_data_header *pack;
+  struct cdtext_info_block *lp_block;
+  struct cdtext_parser parser;
+  int count_of_packs;
+  int text_length;
+  int code;
+  int i;
+
+  count_of_packs = buffer_length / sizeof(struct cdtext_pack_data_header);
+
+  text_length = cdtext_alloc_arena(info, buffer, count_of_packs);
+  if(text_length < 0)
+  {
+    wm_lib_message(WM_MSG_LEVEL_ERROR | WM_MSG_CLASS,
+      "CDTEXT ERROR: out of memory, cannot create the text arena\n");
+    free_cdtext_info(info);
+    return -1;
+  }
+
+  memset(&parser, 0, sizeof(parser));
+  parser.text = (unsigned char*)info->text;
+  parser.start = parser.tail = parser.text + 2;
+  parser.end = parser.text + text_length;
+
+  for(i = 0; i + (int)sizeof(struct cdtext_pack_data_header) <= buffer_length;
+    i += sizeof(struct cdtext_pack_data_header))
+  {
+    pack = (const struct cdtext_pack_data_header*)(buffer+i);
+
+    /* only for valid packs, packs with a bad CRC have type 0 now */
+    if(pack->header_field_id1_typ_of_pack < 0x80 || pack->header_field_id1_typ_of_pack >= 0x90)
+    {
+      wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+        "CDTEXT ERROR: invalid packet at 0x%08X: 0x %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n",
+        i,
+        pack->header_field_id1_typ_of_pack,
+        pack->header_field_id2_tracknumber,
+        pack->header_field_id3_sequence,
+        pack->header_field_id4_block_no,
+        pack->text_data_field[0],
+        pack->text_data_field[1],
+        pack->text_data_field[2],
+        pack->text_data_field[3],
+        pack->text_data_field[4],
+        pack->text_data_field[5],
+        pack->text_data_field[6],
+        pack->text_data_field[7],
+        pack->text_data_field[8],
+        pack->text_data_field[9],
+        pack->text_data_field[10],
+        pack->text_data_field[11],
+        pack->crc_byte1,
+        pack->crc_byte2);
+      info->count_of_invalid_packs++;
+      continue;
+    }
+
+    wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+      "CDTEXT DEBUG: valid packet at 0x%08X: 0x %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n",
+      i,
+      pack->header_field_id1_typ_of_pack,
+      pack->header_field_id2_tracknumber,
+      pack->header_field_id3_sequence,
+      pack->header_field_id4_block_no,
+      pack->text_data_field[0],
+      pack->text_data_field[1],
+      pack->text_data_field[2],
+      pack->text_data_field[3],
+      pack->text_data_field[4],
+      pack->text_data_field[5],
+      pack->text_data_field[6],
+      pack->text_data_field[7],
+      pack->text_data_field[8],
+      pack->text_data_field[9],
+      pack->text_data_field[10],
+      pack->text_data_field[11],
+      pack->crc_byte1,
+      pack->crc_byte2);
+    info->count_of_valid_packs++;
+
+    /* the block number is the index, no search needed */
+    code = (pack->header_field_id4_block_no >> 4) & 0x07;
+    lp_block = info->blocks[code];
+    lp_block->block_unicode = pack->header_field_id4_block_no & 0x80;
+
+    switch(pack->header_field_id1_typ_of_pack)
+    {
+      case 0x80:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->name, info->count_of_entries);
+        break;
+      case 0x81:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->performer, info->count_of_entries);
+        break;
+      case 0x82:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->songwriter, info->count_of_entries);
+        break;
+      case 0x83:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->composer, info->count_of_entries);
+        break;
+      case 0x84:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->arranger, info->count_of_entries);
+        break;
+      case 0x85:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->message, info->count_of_entries);
+        break;
+      case 0x86:
+        memcpy((char*)(lp_block->binary_disc_identification_info),
+        (char*)(pack->text_data_field),  DATAFIELD_LENGHT_IN_PACK);
+        break;
+      case 0x87:
+        memcpy((char*)(lp_block->binary_genreidentification_info),
+        (char*)(pack->text_data_field),  DATAFIELD_LENGHT_IN_PACK);
+        break;
+      case 0x88:
+       wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+         "CDTEXT INFO: PACK with code 0x88 (TOC)\n");
+        break;
+      case 0x89:
+       wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+         "CDTEXT INFO: PACK with code 0x89 (second TOC)\n");
+        break;
+      case 0x8A:
+      case 0x8B:
+      case 0x8C:
+        wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+          "CDTEXT INFO: PACK with code 0x%02X (reserved)\n", pack->header_field_id1_typ_of_pack);
+        break;
+      case 0x8D:
+        wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
+          "CDTEXT INFO: PACK with code 0x8D (for content provider only)\n");
+        break;
+      case 0x8E:
+        get_data_from_cdtext_pack(&parser, pack, lp_block->UPC_EAN_ISRC_code, info->count_of_entries);
+        break;
+      case 0x8F:
+        memcpy((char*)(lp_block->binary_size_information),
+        (char*)(pack->text_data_field), DATAFIELD_LENGHT_IN_PACK);
+        /* the first of the three size packs starts with the character code */
+        if(pack->header_field_id2_tracknumber == 0)
+          lp_block->block_encoding = pack->text_data_field[0];
+        break;
+    }
+  } /* for */
+
+  /* a stream cut short may leave the last entry open */
+  if(parser.tail != parser.start)
+    cdtext_close_entry(&parser, info->count_of_entries);
+
+  cdtext_shrink_arena(info, parser.tail - parser.text);
+
+  if(info->count_of_valid_packs > 0)
+    info->valid = 1;
+
+  return 0;
 }
 
 struct cdtext_info *get_glob_cdtext(struct wm_drive *d, int redo)
@@ -217,210 +771,161 @@ struct cdtext_info *get_glob_cdtext(struct wm_drive *d, int redo)
   unsigned char *buffer;
   int buffer_length;
   int ret;
-  int i;
-  struct cdtext_pack_data_header *pack, *pack_previous;
-  cdtext_string *p_componente;
-  struct cdtext_info_block *lp_block;
+  int count_of_packs;
+  int bad, retry;
+  struct cdtext_info *info;
 
-  if(!redo && wm_cdtext_info.valid) {
+  if(!redo && d->cdtext) {
     wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS, "CDTEXT DEBUG: recycle cdtext\n");
-    return &wm_cdtext_info;
-  } else {
-    free_cdtext_info(&wm_cdtext_info);
+    return d->cdtext;
   }
 
-  lp_block = 0;
-  p_componente = 0;
+  if(!d->cdtext)
+  {
+    d->cdtext = calloc(1, sizeof(struct cdtext_info));
+    if(!d->cdtext)
+      return NULL;
+  }
+  info = d->cdtext;
+  free_cdtext_info(info);
+
+  if(!redo && cdtext_cache_load(d, info))
+    return info;
+
   buffer = 0;
   buffer_length = 0;
 
   ret = wm_scsi_get_cdtext(d, &buffer, &buffer_length);
   if(!ret)
   {
-    if(!d->proto.get_trackcount || d->proto.get_trackcount(d, &wm_cdtext_info.count_of_entries) < 0)
-      wm_cdtext_info.count_of_entries = 1;
+    if(!d->proto.get_trackcount || d->proto.get_trackcount(d, &info->count_of_entries) < 0)
+      info->count_of_entries = 1;
     else
-      wm_cdtext_info.count_of_entries++;
+      info->count_of_entries++;
 
-    i = 0;
+    count_of_packs = buffer_length / sizeof(struct cdtext_pack_data_header);
 
-    pack = 0; /* NULL pointer*/
-    while(i < buffer_length)
+    bad = wm_cdtext_verify_packs(buffer, count_of_packs);
+    for(retry = 0; retry < CDTEXT_READ_RETRIES && bad * CDTEXT_BAD_CRC_RATIO > count_of_packs; retry++)
     {
-      pack_previous = pack;
-      pack = (struct cdtext_pack_data_header*)(buffer+i);
-      /* to implement: check_crc(pack); */
-
-      /* only for valid packs */
-      if(pack->header_field_id1_typ_of_pack >= 0x80 && pack->header_field_id1_typ_of_pack < 0x90)
-      {
-        int code, j;
-          wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-            "CDTEXT DEBUG: valid packet at 0x%08X: 0x %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n",
-            i,
-            pack->header_field_id1_typ_of_pack,
-            pack->header_field_id2_tracknumber,
-            pack->header_field_id3_sequence,
-            pack->header_field_id4_block_no,
-            pack->text_data_field[0],
-            pack->text_data_field[1],
-            pack->text_data_field[2],
-            pack->text_data_field[3],
-            pack->text_data_field[4],
-            pack->text_data_field[5],
-            pack->text_data_field[6],
-            pack->text_data_field[7],
-            pack->text_data_field[8],
-            pack->text_data_field[9],
-            pack->text_data_field[10],
-            pack->text_data_field[11],
-            pack->crc_byte1,
-            pack->crc_byte2);
-        wm_cdtext_info.count_of_valid_packs++;
-
-        code = (pack->header_field_id4_block_no >> 4) & 0x07;
-        if(0 == lp_block || lp_block->block_code != code) /* find or create one new block */
-        {
-          lp_block = 0;
-          for(j = 0; j < MAX_LANGUAGE_BLOCKS && wm_cdtext_info.blocks[j] != 0 && 0 == lp_block; j++)
-          {
-            if(wm_cdtext_info.blocks[j]->block_code == code)
-            {
-              lp_block = wm_cdtext_info.blocks[j];
-            }
-          }
-
-          if(MAX_LANGUAGE_BLOCKS <= j)
-          {
-            free_cdtext_info(&wm_cdtext_info);
-            wm_lib_message(WM_MSG_LEVEL_ERROR | WM_MSG_CLASS,
-              "CDTEXT ERROR: more as 8 languageblocks defined\n");
-            return NULL;
-          }
-
-          if(0 == lp_block)
-          {
-            /* make next new block */
-            lp_block = malloc_cdtext_info_block(wm_cdtext_info.count_of_entries);
-            if(0 == lp_block)
-            {
-              wm_lib_message(WM_MSG_LEVEL_ERROR | WM_MSG_CLASS,
-                "CDTEXT ERROR: out of memory, cannot create a new language block\n");
-              free_cdtext_info(&wm_cdtext_info);
-              return NULL /*ENOMEM*/;
-            }
-            else
-            {
-              wm_cdtext_info.blocks[j] = lp_block;
-              wm_cdtext_info.blocks[j]->block_code = code;
-              wm_cdtext_info.blocks[j]->block_unicode = pack->header_field_id4_block_no & 0x80;
-              wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-                "CDTEXT INFO: created a new language block; code %i, %s characters\n", code, lp_block->block_unicode?"doublebyte":"singlebyte");
-/*
-  unsigned char block_encoding; not jet!
-  cdtext_string* block_encoding_text;
-*/
-            }
-          }
-        }
-      }
-
-      switch(pack->header_field_id1_typ_of_pack)
-      {
-        case 0x80:
-          p_componente = (lp_block->name);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x81:
-          p_componente = (lp_block->performer);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x82:
-          p_componente = (lp_block->songwriter);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x83:
-          p_componente = (lp_block->composer);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x84:
-          p_componente = (lp_block->arranger);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x85:
-          p_componente = (lp_block->message);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x86:
-          memcpy((char*)(lp_block->binary_disc_identification_info),
-          (char*)(pack->text_data_field),  DATAFIELD_LENGHT_IN_PACK);
-          break;
-        case 0x87:
-          memcpy((char*)(lp_block->binary_genreidentification_info),
-          (char*)(pack->text_data_field),  DATAFIELD_LENGHT_IN_PACK);
-          break;
-        case 0x88:
-         wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-           "CDTEXT INFO: PACK with code 0x88 (TOC)\n");
-          break;
-        case 0x89:
-         wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-           "CDTEXT INFO: PACK with code 0x89 (second TOC)\n");
-          break;
-        case 0x8A:
-        case 0x8B:
-        case 0x8C:
-          wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-            "CDTEXT INFO: PACK with code 0x%02X (reserved)\n", pack->header_field_id1_typ_of_pack);
-          break;
-        case 0x8D:
-          wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-            "CDTEXT INFO: PACK with code 0x8D (for content provider only)\n");
-          break;
-        case 0x8E:
-          p_componente = (lp_block->UPC_EAN_ISRC_code);
-          get_data_from_cdtext_pack(pack, p_componente);
-          break;
-        case 0x8F:
-          memcpy((char*)(lp_block->binary_size_information),
-          (char*)(pack->text_data_field), DATAFIELD_LENGHT_IN_PACK);
-          break;
-        default:
-          wm_lib_message(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS,
-            "CDTEXT ERROR: invalid packet at 0x%08X: 0x %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X %02X\n",
-            i,
-            pack->header_field_id1_typ_of_pack,
-            pack->header_field_id2_tracknumber,
-            pack->header_field_id3_sequence,
-            pack->header_field_id4_block_no,
-            pack->text_data_field[0],
-            pack->text_data_field[1],
-            pack->text_data_field[2],
-            pack->text_data_field[3],
-            pack->text_data_field[4],
-            pack->text_data_field[5],
-            pack->text_data_field[6],
-            pack->text_data_field[7],
-            pack->text_data_field[8],
-            pack->text_data_field[9],
-            pack->text_data_field[10],
-            pack->text_data_field[11],
-            pack->crc_byte1,
-            pack->crc_byte2);
-          wm_cdtext_info.count_of_invalid_packs++;
-      }
-      i += sizeof(struct cdtext_pack_data_header);
-    } /* while */
+      wm_lib_message(WM_MSG_LEVEL_INFO | WM_MSG_CLASS,
+        "CDTEXT INFO: %i of %i packs with CRC errors, read again\n", bad, count_of_packs);
+      bad = cdtext_recover_packs(d, buffer, count_of_packs, bad);
+    }
+
+    ret = wm_cdtext_parse(info, buffer, buffer_length);
+    free(buffer);
+    if(ret)
+      return NULL /*ENOMEM*/;
+  }
+
+  /* a read with bad packs may come out better next time */
+  if(0 == ret && info->valid && !info->count_of_invalid_packs)
+    cdtext_cache_store(d, info);
+
+  return info;
+}
+
+#ifdef HAVE_ICONV
+static int cdtext_iconv(const char *charset, const unsigned char *text,
+  unsigned int length, unsigned short *utf16)
+{
+  const unsigned short probe = 1;
+  iconv_t cd;
+  char *in, *out;
+  size_t in_left, out_left;
+
+  cd = iconv_open(*(const unsigned char*)&probe ? "UTF-16LE" : "UTF-16BE", charset);
+  if(cd == (iconv_t)-1)
+    return -1;
+
+  /* every character of these charsets takes at least one byte and
+     lies in the BMP, so length units are always enough */
+  in = (char*)text;
+  in_left = length;
+  out = (char*)utf16;
+  out_left = length * sizeof(unsigned short);
+  while(in_left && iconv(cd, &in, &in_left, &out, &out_left) == (size_t)-1)
+  {
+    if(errno != EILSEQ || out_left < sizeof(unsigned short))
+      break;
+    /* replace the broken byte and go on */
+    *(unsigned short*)out = '?';
+    out += sizeof(unsigned short);
+    out_left -= sizeof(unsigned short);
+    in++;
+    in_left--;
   }
 
-  if(0 == ret && wm_cdtext_info.count_of_valid_packs > 0)
-    wm_cdtext_info.valid = 1;
+  iconv_close(cd);
+
+  return (out - (char*)utf16) / sizeof(unsigned short);
+}
+#endif
+
+int wm_cdtext_to_utf16(const struct cdtext_info *info, const struct cdtext_info_block *block,
+  cdtext_string string, unsigned short *utf16)
+{
+  const unsigned char *text = CDTEXT_STRING(info, string);
+  unsigned int i;
 
-  return &wm_cdtext_info;
+  switch(block->block_encoding)
+  {
+    case CDTEXT_CHARCODE_ISO_8859_1:
+      for(i = 0; i < string.length; i++)
+        utf16[i] = text[i];
+      return string.length;
+    case CDTEXT_CHARCODE_ASCII:
+      for(i = 0; i < string.length; i++)
+        utf16[i] = text[i] < 0x80 ? text[i] : '?';
+      return string.length;
+#ifdef HAVE_ICONV
+    case CDTEXT_CHARCODE_MS_JIS:
+      return cdtext_iconv("CP932", text, string.length, utf16);
+    case CDTEXT_CHARCODE_KOREAN:
+      return cdtext_iconv("CP949", text, string.length, utf16);
+#endif
+    default:
+      return -1;
+  }
 }
 
-void free_cdtext(void)
+struct cdtext_info *wm_cdtext_dup(const struct cdtext_info *info)
 {
-  if (wm_cdtext_info.valid)
-    free_cdtext_info(&wm_cdtext_info);
+  struct cdtext_info *copy;
+
+  copy = malloc(sizeof(struct cdtext_info));
+  if(!copy)
+    return NULL;
+
+  *copy = *info;
+  copy->arena = malloc(info->arena_length);
+  if(!copy->arena)
+  {
+    free(copy);
+    return NULL;
+  }
+  memcpy(copy->arena, info->arena, info->arena_length);
+  cdtext_layout(copy, cdtext_blocks_present(info));
+
+  return copy;
+}
+
+void wm_cdtext_free(struct cdtext_info *info)
+{
+  if(info)
+  {
+    free_cdtext_info(info);
+    free(info);
+  }
+}
+
+void free_cdtext(struct wm_drive *d)
+{
+  if(d->cdtext)
+  {
+    free_cdtext_info(d->cdtext);
+    free(d->cdtext);
+    d->cdtext = NULL;
+  }
 }
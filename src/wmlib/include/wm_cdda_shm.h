@@ -0,0 +1,94 @@
+#ifndef WM_CDDA_SHM_H
+#define WM_CDDA_SHM_H
+/*
+ * This file is part of WorkMan, the civilized CD player library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Shared memory export of the CDDA block ring. A process connects to the
+ * UNIX socket of the export and receives the segment and an eventfd by
+ * SCM_RIGHTS, the eventfd counts the blocks published since it was read.
+ * The samples are 16 bit little endian stereo at 44.1 kHz.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WM_CDDA_SHM_MAGIC   0x41444443  /* "CDDA" */
+#define WM_CDDA_SHM_VERSION 1
+#define WM_CDDA_SHM_BUSY    UINT64_MAX
+
+/*
+ * The fields of struct wm_cdda_block for one slot. seq is the number of the
+ * block in the slot, WM_CDDA_SHM_BUSY while the export rewrites it.
+ */
+struct wm_cdda_shm_slot
+{
+	uint64_t seq;
+	int32_t  frame;
+	uint8_t  status;
+	uint8_t  track;
+	uint8_t  index;
+	uint8_t  reserved;
+	uint32_t buflen;
+	uint32_t offset;    /* of the samples, from the start of the segment */
+};
+
+struct wm_cdda_shm_header
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t slots;
+	uint32_t slot_bytes;
+	uint64_t write_seq; /* blocks published so far */
+	uint32_t closed;    /* the export is gone, nothing follows */
+	uint32_t reserved;
+	struct wm_cdda_shm_slot slot[];
+};
+
+/*
+ * Reference reader. A view points into the segment, the samples are valid
+ * as long as wm_cdda_shm_valid() says so after they were used.
+ */
+struct wm_cdda_shm_reader;
+
+struct wm_cdda_shm_view
+{
+	uint64_t    seq;
+	int         frame;
+	int         status;
+	int         track;
+	int         index;
+	const char *buf;
+	long        buflen;
+};
+
+struct wm_cdda_shm_reader *wm_cdda_shm_connect(const char *path);
+void wm_cdda_shm_disconnect(struct wm_cdda_shm_reader *r);
+int wm_cdda_shm_fd(struct wm_cdda_shm_reader *r);
+int wm_cdda_shm_next(struct wm_cdda_shm_reader *r, struct wm_cdda_shm_view *v, int timeout);
+int wm_cdda_shm_valid(struct wm_cdda_shm_reader *r, const struct wm_cdda_shm_view *v);
+uint64_t wm_cdda_shm_lost(struct wm_cdda_shm_reader *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WM_CDDA_SHM_H */
@@ -23,5 +23,6 @@
  */
 
 unsigned long cddb_discid(struct wm_drive *);
+unsigned long cddb_discid_toc(const unsigned int *start, int tracks);
 
 #endif /* WM_CDDB_H */
@@ -39,14 +39,36 @@
 #define WM_VOLUME_MUTE          0
 #define WM_VOLUME_MAXIMAL       100
 
+#define WM_LATENCY_LOW          0
+#define WM_LATENCY_DEFAULT      1
+#define WM_LATENCY_POWERSAVE    2
+
+/*
+ * Digital playback. The geometry is what the device granted for the
+ * profile, the latencies are measured when the last block was queued.
+ */
+struct wm_audio_stats
+{
+	int profile;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned long buffer_frames;
+	unsigned long period_frames;
+	unsigned long queue_latency_us;   /* read, not yet handed to the device */
+	unsigned long device_latency_us;  /* handed to the device, not yet heard */
+	unsigned long latency_us;         /* from the drive to the speaker */
+	unsigned long xruns;
+};
+
 /*
  * for valid values see wm_helpers.h
  */
 int    wm_cd_set_verbosity(int);
 const char *wm_drive_default_device();
 
+/* latency_profile is one of WM_LATENCY_*, for digital playback */
 int    wm_cd_init(const char *cd_device, const char *soundsystem,
-  const char *sounddevice, const char *ctldevice, void **);
+  const char *sounddevice, const char *ctldevice, int latency_profile, void **);
 int    wm_cd_destroy(void *);
 
 int    wm_cd_status(void *);
@@ -60,6 +82,43 @@ int    wm_cd_gettracklen(void *, int track);
 int    wm_cd_gettrackstart(void *, int track);
 int    wm_cd_gettrackdata(void *, int track);
 
+/*
+ * Media catalogue number and ISRCs of the disc. wm_cd_read_codes() reads
+ * all of them in one pass, they are kept with the TOC until the disc
+ * changes. Empty strings if the disc or the drive has none.
+ */
+int    wm_cd_read_codes(void *);
+const char *wm_cd_getmcn(void *);
+const char *wm_cd_gettrackisrc(void *, int track);
+
+/*
+ * Index points and pregaps. wm_cd_scan_indexes() locates every boundary
+ * by a binary search over the Q sub-channel and keeps the map until the
+ * disc changes. Before that, every track has only index 1 at its start.
+ * A pregap of track 1 before its start is hidden audio at frame 150 on.
+ */
+int    wm_cd_scan_indexes(void *);
+int    wm_cd_gettrackpregap(void *, int track);
+int    wm_cd_gettrackindexcount(void *, int track);
+int    wm_cd_gettrackindex(void *, int track, int index);
+int    wm_cd_locate(void *, int frame, int *track, int *index);
+
+/*
+ * Ask a wm_cd_read_codes() or wm_cd_scan_indexes() running in another
+ * thread to stop after the current command. It fails then and can be
+ * called again later. The flag stays set until wm_cd_cancel(p, 0).
+ */
+void   wm_cd_cancel(void *, int cancel);
+
+/*
+ * Disc changers, slots are counted from 0. A drive without changer has
+ * one slot. After selecting a slot the next wm_cd_status() sees the new
+ * disc like a freshly inserted one.
+ */
+int    wm_cd_getcountofslots(void *);
+int    wm_cd_getslot(void *);
+int    wm_cd_selectslot(void *, int slot);
+
 int    wm_cd_play(void *, int start, int pos, int end);
 int    wm_cd_pause(void *);
 int    wm_cd_stop(void *);
@@ -86,4 +145,36 @@ int    wm_cd_volume(void *, int volume, int balance);
 int    wm_cd_getvolume(void *);
 int    wm_cd_getbalance(void *);
 
+/*
+ * -1 if the drive doesn't play digitally or the sound system has no stats.
+ */
+int    wm_cd_get_audio_stats(void *, struct wm_audio_stats *);
+
+/*
+ * Digital playback only. Saves the samples as WAV while playing, NULL
+ * stops. Levels are the peaks in percent.
+ */
+int    wm_cd_cdda_record(void *, const char *filename);
+int    wm_cd_cdda_levels(void *, int *left, int *right);
+
+/*
+ * Digital playback only. Publishes the samples in shared memory for other
+ * processes, see wm_cdda_shm.h. They connect to the socket path, NULL stops.
+ */
+int    wm_cd_cdda_export(void *, const char *path);
+
+/*
+ * Digital playback only. Serves the samples as an endless WAV stream to
+ * every client of the socket path, NULL stops. Slow clients lose audio.
+ */
+int    wm_cd_cdda_stream(void *, const char *path);
+
+/*
+ * Digital playback only. The track queued plays right after the current
+ * one, faded into it over ms if a crossfade is set, 0 clears the queue.
+ * trim cuts the silence between the tracks.
+ */
+int    wm_cd_set_crossfade(void *, int ms, int trim);
+int    wm_cd_queue(void *, int track);
+
 #endif /* WM_CDROM_H */
@@ -23,7 +23,6 @@
  * cdtext base structure and defines
  */
 
-#define MAX_LENGHT_OF_CDTEXT_STRING 162 /* max 160 bytes + 2 * 0x00 by UNICODES */
 #define DATAFIELD_LENGHT_IN_PACK 12
 #define MAX_LANGUAGE_BLOCKS 8
 
@@ -37,7 +36,22 @@ struct cdtext_pack_data_header {
   unsigned char crc_byte2;
 };
 
-typedef unsigned char cdtext_string[MAX_LENGHT_OF_CDTEXT_STRING];
+/* one entry of a text field, an offset into the text of the cdtext_info.
+   the text is terminated by 0x00 (0x00 0x00 by doublebytes), equal
+   entries share one copy of it. offset 0 is the empty string */
+typedef struct {
+  unsigned short offset;
+  unsigned short length; /* in bytes, without terminator */
+} cdtext_string;
+
+#define CDTEXT_STRING(info, string) ((info)->text + (string).offset)
+
+/* character codes of a block, from the size information pack (0x8F) */
+#define CDTEXT_CHARCODE_ISO_8859_1 0x00
+#define CDTEXT_CHARCODE_ASCII      0x01
+#define CDTEXT_CHARCODE_MS_JIS     0x80
+#define CDTEXT_CHARCODE_KOREAN     0x81
+#define CDTEXT_CHARCODE_MANDARIN   0x82
 
 /* meke it more generic
    it can be up to 8 blocks with different encoding */
@@ -46,8 +60,7 @@ struct cdtext_info_block {
   /* management */
   unsigned char block_code;
   unsigned char block_unicode; /* 0 - single chars, 1 - doublebytes */
-  unsigned char block_encoding; /* orange book -? */
-  cdtext_string* block_encoding_text;
+  unsigned char block_encoding; /* CDTEXT_CHARCODE_* */
 
   /* variable part of cdtext */
   cdtext_string* name;
@@ -72,6 +85,13 @@ struct cdtext_info {
   int count_of_invalid_packs;
   int valid;
 
+  /* blocks, their entry tables and the text live in one allocation
+     per disc, sized from the pack stream */
+  unsigned char *arena;
+  int arena_length;
+  const unsigned char *text;
+
+  /* indexed by the block number from the packs */
   struct cdtext_info_block *blocks[MAX_LANGUAGE_BLOCKS];
 };
 
@@ -103,4 +123,32 @@ struct feature_descriptor_cdread {
 
 struct cdtext_info* wm_cd_get_cdtext(void *p);
 
+/* a copy independent of the drive, to be released with wm_cdtext_free() */
+struct cdtext_info* wm_cdtext_dup(const struct cdtext_info *info);
+void wm_cdtext_free(struct cdtext_info *info);
+
+/* directory for the per-disc cdtext cache, NULL to switch it off */
+int wm_cd_set_cdtext_cache(void *p, const char *dir);
+
+/*
+ * Decode one entry of a block to UTF-16 in host byte order. utf16 must
+ * have room for string.length units. Returns the number of units
+ * written, or -1 if the character code of the block is not supported.
+ */
+int wm_cdtext_to_utf16(const struct cdtext_info *info, const struct cdtext_info_block *block,
+  cdtext_string string, unsigned short *utf16);
+
+/*
+ * The steps of reading CD-Text, without the drive. wm_cdtext_verify_packs()
+ * checks the CRC of every pack and sets the pack type of a bad one to 0,
+ * it returns the number of bad packs. wm_cdtext_merge_packs() takes over
+ * the packs of a second read that are good there and bad in buffer, and
+ * returns the number still bad. wm_cdtext_parse() builds info from the
+ * good packs, count_of_entries must be set; 0 on success, -1 if out of memory.
+ */
+int wm_cdtext_verify_packs(unsigned char *buffer, int count_of_packs);
+int wm_cdtext_merge_packs(unsigned char *buffer, unsigned char *again,
+  int count_of_packs, int bad);
+int wm_cdtext_parse(struct cdtext_info *info, const unsigned char *buffer, int buffer_length);
+
 #endif /* WM_CDTEXT_H */
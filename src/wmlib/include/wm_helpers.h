@@ -94,4 +94,12 @@ void 		wm_lib_message( unsigned int level, const char *format, ... )
     ; /* put out a message on stderr */
 int		wm_susleep( int usec );
 
+#define WM_WAV_HEADER_SIZE 44
+/* 16 bit stereo at 44.1 kHz, as it comes from the disc */
+void		wm_wav_header( unsigned char *buf, unsigned long data_size );
+
+/* owner only, for the PCM export and stream */
+int		wm_unix_listen( const char *path, int backlog );
+void		wm_unix_unlink( const char *path );
+
 #endif /* WM_HELPERS_H */
@@ -42,5 +42,8 @@ int	wm_scsi_get_drive_type( struct wm_drive *d);
 int wm_scsi_get_cdtext( struct wm_drive *d,
 	unsigned char **pp_buffer, int *p_buffer_length );
 int wm_scsi_set_speed( struct wm_drive *d, int read_speed );
+int wm_scsi_get_mcn( struct wm_drive *d, char *mcn );
+int wm_scsi_get_isrc( struct wm_drive *d, int track, char *isrc );
+int wm_scsi_read_subq( struct wm_drive *d, int lba, int *track, int *index );
 
 #endif /* WM_SCSI_H */
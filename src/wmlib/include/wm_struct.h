@@ -28,6 +28,7 @@
 #define WM_STR_GENREV    "type"
 
 struct wm_drive;
+struct wm_audio_stats;
 
 /*
  * Structure for a single track.  This is pretty much self-explanatory --
@@ -39,6 +40,7 @@ struct wm_trackinfo
 	int	start;		/* Starting position (f+s*75+m*60*75) */
 	int	track;		/* Physical track number */
 	int	data;		/* Flag: data track */
+	char	isrc[13];	/* ISRC, empty if none */
 };
 
 struct wm_cdinfo
@@ -53,9 +55,27 @@ struct wm_cdinfo
 	int cur_frame;   /* Current frame number */
 	int	length;		/* Total running time in seconds */
 	int cd_cur_balance;
+	char mcn[14];		/* Media catalogue number, empty if none */
+	int codes_read;		/* mcn and trk[].isrc are valid */
 	struct wm_trackinfo *trk;	/* struct wm_trackinfo[ntracks] */
 };
 
+/*
+ * Index points of one track in absolute frames, see wm_cd_scan_indexes().
+ */
+struct wm_trackindex
+{
+	int	pregap;		/* Start of index 0, equal to index[0] if none */
+	int	count;		/* Index points from index 1 on */
+	int	*index;		/* index[0] is the track start (index 1) */
+};
+
+struct wm_indexmap
+{
+	int	ntracks;
+	struct wm_trackindex *trk;	/* struct wm_trackindex[ntracks] */
+};
+
 /*
  * Each platform has to define generic functions, so may as well declare
  * them all here to save space.
@@ -81,6 +101,9 @@ struct wm_drive_proto
 	int (*get_volume)(struct wm_drive *d, int *left, int *right);
 	int (*scale_volume)(int *left, int *right);
 	int (*unscale_volume)(int *left, int *right);
+	int (*get_slots)(struct wm_drive *d, int *slots);	/* NULL if no changer support */
+	int (*select_slot)(struct wm_drive *d, int slot);
+	int (*get_slot)(struct wm_drive *d, int *slot);		/* the one loaded */
 };
 
 /* forward declaration */
@@ -131,6 +154,17 @@ int gen_cdda_close(struct wm_drive* d);
 #endif
 
 
+/*
+ * Drive state the platform layer may keep between two status polls.
+ * It describes the current medium only and is dropped on media change.
+ */
+struct wm_drive_cache
+{
+	int valid;
+	int capability;       /* platform specific capability bits */
+	int door_unlocked;    /* door lock already released for this medium */
+};
+
 /*
  * Drive descriptor structure.  Used for access to low-level routines.
  */
@@ -143,6 +177,7 @@ struct wm_drive
 	char *soundsystem;
 	char *sounddevice;
 	char *ctldevice;
+	int   latency_profile;
 
 	char  vendor[9];      /* Vendor name */
 	char  model[17];      /* Drive model */
@@ -156,6 +191,8 @@ struct wm_drive
 	int    fd;            /* file descriptor */
 	void  *daux;          /* Pointer to optional drive-specific info etc. */
 	struct wm_drive_proto proto;
+	struct wm_drive_cache cache;
+	int    slot;          /* selected slot of a disc changer */
 
 	/* cdda section */
     unsigned char status;
@@ -173,15 +210,47 @@ struct wm_drive
     int numblocks;
   	void  *cddax;         /* Pointer to optional drive-specific info  etc. */
   	int oldmode;
+	void  *cdda_export;   /* wm_cdda_export() while it runs */
+	void  *cdda_stream;   /* wm_cdda_stream() while it runs */
+
+	/* cdtext section */
+	struct cdtext_info *cdtext;   /* read on first use, dropped on disc change */
+	char *cdtext_cache_dir;       /* on-disk cache, NULL if none */
+
+	/* index section */
+	struct wm_indexmap *indexmap; /* scanned on request, dropped on disc change */
+
+	int    cancel;        /* wm_cd_cancel(), stops reading codes and indexes */
 };
 
 int toshiba_fixup(struct wm_drive *d);
 int sony_fixup(struct wm_drive *d);
 
 struct cdtext_info* get_glob_cdtext(struct wm_drive*, int);
-void free_cdtext(void);
+void free_cdtext(struct wm_drive*);
 
 int wm_cdda_init(struct wm_drive *d);
 int wm_cdda_destroy(struct wm_drive *d);
+int wm_cdda_get_stats(struct wm_drive *d, struct wm_audio_stats *stats);
+
+/*
+ * Consumers of the decoded audio. Each one runs in its own thread and gets
+ * every block in place, read only. With WM_CDDA_BACKPRESSURE the drive
+ * waits for the consumer, with WM_CDDA_DROP the consumer misses blocks.
+ */
+#define WM_CDDA_BACKPRESSURE 0
+#define WM_CDDA_DROP         1
+
+typedef void (*wm_cdda_consume_t)(struct wm_drive *d, const struct wm_cdda_block *blk, void *arg);
+
+int wm_cdda_subscribe(struct wm_drive *d, wm_cdda_consume_t consume, void *arg, int policy);
+int wm_cdda_unsubscribe(struct wm_drive *d, int id);
+unsigned long wm_cdda_dropped(struct wm_drive *d, int id);
+int wm_cdda_record(struct wm_drive *d, const char *filename);
+int wm_cdda_levels(struct wm_drive *d, int *left, int *right);
+int wm_cdda_export(struct wm_drive *d, const char *path);
+int wm_cdda_stream(struct wm_drive *d, const char *path);
+int wm_cdda_crossfade(struct wm_drive *d, int ms, int trim);
+int wm_cdda_queue(struct wm_drive *d, int start, int end);
 
 #endif /* WM_STRUCT_H */
@@ -105,8 +105,90 @@ typedef unsigned long long __u64;
  *
  *
  *-------------------------------------------------------*/
+
+/*
+ * The capability bits and the door lock state do not change while the
+ * same medium stays in the drive, so they are queried once per medium.
+ */
+static void linux_cache_invalidate(struct wm_drive *d)
+{
+	d->cache.valid = 0;
+	d->cache.door_unlocked = 0;
+}
+
+static int linux_capability(struct wm_drive *d)
+{
+	if(!d->cache.valid) {
+		d->cache.capability = ioctl(d->fd, CDROM_GET_CAPABILITY);
+		if(d->cache.capability < 0)
+			d->cache.capability = 0;
+		d->cache.valid = 1;
+	}
+
+	return d->cache.capability;
+}
+
+/*
+ * Disc changers: number of slots and selection of the disc to play.
+ */
+static int linux_get_slots(struct wm_drive *d, int *slots)
+{
+	int ret;
+
+	if(d->fd < 0)
+		return -1;
+
+	*slots = 1;
+	if(!(linux_capability(d) & CDC_SELECT_DISC))
+		return 0;
+
+	ret = ioctl(d->fd, CDROM_CHANGER_NSLOTS);
+	if(ret < 0)
+		return -1;
+	if(ret > 1)
+		*slots = ret;
+
+	return 0;
+}
+
+static int linux_select_slot(struct wm_drive *d, int slot)
+{
+	if(d->fd < 0 || ioctl(d->fd, CDROM_SELECT_DISC, slot) < 0)
+		return -1;
+
+	/* another medium */
+	linux_cache_invalidate(d);
+
+	return 0;
+}
+
+static int linux_get_slot(struct wm_drive *d, int *slot)
+{
+	int ret;
+
+	if(d->fd < 0)
+		return -1;
+
+	*slot = 0;
+	if(!(linux_capability(d) & CDC_SELECT_DISC))
+		return 0;
+
+	ret = ioctl(d->fd, CDROM_SELECT_DISC, CDSL_CURRENT);
+	if(ret < 0)
+		return -1;
+	*slot = ret;
+
+	return 0;
+}
+
 int gen_init(struct wm_drive *d)
 {
+	linux_cache_invalidate(d);
+
+	d->proto.get_slots = linux_get_slots;
+	d->proto.select_slot = linux_select_slot;
+	d->proto.get_slot = linux_get_slot;
+
 	return 0;
 }
 
@@ -121,6 +203,7 @@ int gen_open(struct wm_drive *d)
 	d->fd = open(d->cd_device, O_RDONLY | O_NONBLOCK);
 	wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "plat_open(): device=%s fd=%d\n",
 		d->cd_device, d->fd);
+	linux_cache_invalidate(d);
 
 	if(d->fd < 0)
 		return -errno;
@@ -134,6 +217,7 @@ int gen_close(struct wm_drive *d)
 
 	close(d->fd);
 	d->fd = -1;
+	linux_cache_invalidate(d);
 
 	return 0;
 }
@@ -152,8 +236,8 @@ int gen_get_drive_status(struct wm_drive *d, int oldmode, int *mode, int *pos, i
 	static int prevpos = 0;
 #endif
 
-	/* Is the device open? */
-	if (d->fd > -1) {
+	/* The descriptor stays open between polls, reopen only if it was closed. */
+	if (d->fd < 0) {
 		ret = d->proto.open(d);
 		if(ret < 0) /* error */
 			return ret;
@@ -168,7 +252,11 @@ int gen_get_drive_status(struct wm_drive *d, int oldmode, int *mode, int *pos, i
 	/* Try to get rid of the door locking    */
 	/* Don't care about return value. If it  */
 	/* works - fine. If not - ...            */
-	ioctl(d->fd, CDROM_LOCKDOOR, 0);
+	/* Once per medium is enough.            */
+	if(!d->cache.door_unlocked) {
+		ioctl(d->fd, CDROM_LOCKDOOR, 0);
+		d->cache.door_unlocked = 1;
+	}
 
 	*mode = WM_CDM_UNKNOWN;
 
@@ -223,7 +311,7 @@ int gen_get_drive_status(struct wm_drive *d, int oldmode, int *mode, int *pos, i
 
 	if(WM_CDS_NO_DISC(*mode)) {
 		/* verify status of drive */
-		ret = ioctl(d->fd, CDROM_DRIVE_STATUS, 0/* slot */);
+		ret = ioctl(d->fd, CDROM_DRIVE_STATUS, CDSL_CURRENT);
 		if(ret == CDS_DISC_OK)
 			ret = ioctl(d->fd, CDROM_DISC_STATUS, 0);
 
@@ -247,6 +335,10 @@ int gen_get_drive_status(struct wm_drive *d, int oldmode, int *mode, int *pos, i
 		default:
 			*mode = WM_CDM_UNKNOWN;
 		}
+
+		/* the medium is gone or about to change */
+		if(*mode == WM_CDM_NO_DISC || *mode == WM_CDM_EJECTED)
+			linux_cache_invalidate(d);
 	}
 
 	return 0;
@@ -404,6 +496,7 @@ int gen_eject(struct wm_drive *d)
 		wm_lib_message(WM_MSG_LEVEL_ERROR|WM_MSG_CLASS, "eject failed (%s).\n", strerror(errno));
 		return -1;
 	}
+	linux_cache_invalidate(d);
 
 	/*------------------
 	* Things in "foobar_one" are left over from 1.4b3
@@ -429,6 +522,7 @@ int gen_closetray(struct wm_drive *d)
 {
 #ifdef CDROMCLOSETRAY
 	wm_lib_message(WM_MSG_LEVEL_ERROR|WM_MSG_CLASS, "CDROMCLOSETRAY closing tray...\n");
+	linux_cache_invalidate(d);
 	return ioctl(d->fd, CDROMCLOSETRAY);
 #else
 	return -1;
@@ -577,7 +671,7 @@ int gen_scsi(struct wm_drive *d, unsigned char *cdb, int cdblen,
 
 	wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS, "wm_scsi over CDROM_SEND_PACKET entered\n");
 
-	capability = ioctl(d->fd, CDROM_GET_CAPABILITY);
+	capability = linux_capability(d);
 
 	if(!(capability & CDC_GENERIC_PACKET)) {
 		wm_lib_message(WM_MSG_LEVEL_DEBUG|WM_MSG_CLASS,
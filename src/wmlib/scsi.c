@@ -45,6 +45,7 @@
 #define SCMD_PLAY_AUDIO_MSF	0x47
 #define SCMD_PAUSE_RESUME	0x4b
 #define SCMD_SET_CD_SPEED       0xbb
+#define SCMD_READ_CD		0xbe
 
 #define SUBQ_STATUS_INVALID	0x00
 #define SUBQ_STATUS_PLAY	0x11
@@ -643,3 +644,82 @@ wm_scsi_set_speed(struct wm_drive *d, int read_speed)
 		"wm_scsi_set_speed returns %i\n", ret);
 	return ret;
 } /* wm_scsi_set_speed() */
+
+/*
+ * READ SUB-CHANNEL with data format 2 (media catalogue number) or 3
+ * (ISRC of a track). Copies the code to "code" if the drive reports it
+ * valid and it consists of printable characters, else leaves it empty.
+ * Returns -1 if the command failed.
+ */
+static int
+wm_scsi_get_code(struct wm_drive *d, int format, int track, char *code, int len)
+{
+	unsigned char buf[24];
+	int i;
+
+	code[0] = 0;
+
+	memset(buf, 0, sizeof(buf));
+	if (sendscsi(d, buf, sizeof(buf), 1, SCMD_READ_SUBCHANNEL, 0, 64, format,
+		0, 0, track, sizeof(buf) / 256, sizeof(buf) % 256, 0,0,0))
+		return -1;
+
+	if (buf[4] != format || !(buf[8] & 0x80))
+		return 0;
+
+	for (i = 0; i < len; i++) {
+		if (buf[9 + i] < '0' || buf[9 + i] > 'Z' || (buf[9 + i] > '9' && buf[9 + i] < 'A'))
+			return 0;
+		code[i] = buf[9 + i];
+	}
+	code[len] = 0;
+
+	return 0;
+}
+
+int
+wm_scsi_get_mcn(struct wm_drive *d, char *mcn)
+{
+	if (wm_scsi_get_code(d, 2, 0, mcn, 13))
+		return -1;
+
+	/* Some discs carry the valid flag with an all zero number. */
+	if (!strcmp(mcn, "0000000000000"))
+		mcn[0] = 0;
+
+	return 0;
+} /* wm_scsi_get_mcn() */
+
+int
+wm_scsi_get_isrc(struct wm_drive *d, int track, char *isrc)
+{
+	return wm_scsi_get_code(d, 3, track, isrc, 12);
+} /* wm_scsi_get_isrc() */
+
+#define BCD2BIN(x) ((((x) >> 4) & 0x0f) * 10 + ((x) & 0x0f))
+
+/*
+ * Read the formatted Q sub-channel of one sector with READ CD (0xBE).
+ * Returns 0 and the position if the sector carries one, 1 if it carries
+ * MCN or ISRC data instead (ADR 2 or 3), -1 if the command failed.
+ * The lead-out is reported as track 100.
+ */
+int
+wm_scsi_read_subq(struct wm_drive *d, int lba, int *track, int *index)
+{
+	unsigned char buf[2352 + 16];
+	unsigned char *q = buf + 2352;
+
+	if (sendscsi(d, buf, sizeof(buf), 1, SCMD_READ_CD, 0,
+		(lba >> 24) & 0xff, (lba >> 16) & 0xff, (lba >> 8) & 0xff, lba & 0xff,
+		0, 0, 1, 0x10, 0x02, 0))
+		return -1;
+
+	if ((q[0] & 0x0f) != 1)
+		return 1;
+
+	*track = q[1] == 0xaa ? 100 : BCD2BIN(q[1]);
+	*index = BCD2BIN(q[2]);
+
+	return 0;
+} /* wm_scsi_read_subq() */
@@ -30,8 +30,13 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 #include "include/workman_defs.h"
 #include "include/wm_config.h"
 #include "include/wm_helpers.h"
@@ -234,4 +239,92 @@ wm_susleep( int usec )
 	return (select(0, NULL, NULL, NULL, &tv));
 } /* wm_susleep() */
 
+static void
+put_le( unsigned char *p, unsigned long v, int bytes )
+{
+	while (bytes--) {
+		*p++ = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/*
+ * Write the RIFF/WAVE header for data_size bytes of CD audio into buf,
+ * which holds WM_WAV_HEADER_SIZE bytes. Streams of unknown length pass
+ * the largest size the format allows.
+ */
+void
+wm_wav_header( unsigned char *buf, unsigned long data_size )
+{
+	memcpy(buf, "RIFF", 4);
+	put_le(buf + 4, data_size + 36, 4);
+	memcpy(buf + 8, "WAVEfmt ", 8);
+	put_le(buf + 16, 16, 4);		/* fmt chunk size */
+	put_le(buf + 20, 1, 2);			/* PCM */
+	put_le(buf + 22, 2, 2);			/* channels */
+	put_le(buf + 24, 44100, 4);		/* sample rate */
+	put_le(buf + 28, 44100 * 2 * 2, 4);	/* byte rate */
+	put_le(buf + 32, 2 * 2, 2);		/* block align */
+	put_le(buf + 34, 16, 2);		/* bits per sample */
+	memcpy(buf + 36, "data", 4);
+	put_le(buf + 40, data_size, 4);
+} /* wm_wav_header() */
+
+/*
+ * Listen on a UNIX socket at path that only the owner may connect to.
+ * A stale socket there is replaced, anything else is left alone.
+ * Returns the socket or -1.
+ */
+int
+wm_unix_listen( const char *path, int backlog )
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		ERRORLOG("socket path too long: %s\n", path);
+		return -1;
+	}
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			ERRORLOG("%s exists and is no socket\n", path);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	/* bind() creates the node with the mode of the socket */
+	if (fchmod(fd, 0600) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ERRORLOG("unable to bind %s\n", path);
+		close(fd);
+		return -1;
+	}
+	if (chmod(path, 0600) < 0 || listen(fd, backlog) < 0) {
+		ERRORLOG("unable to listen on %s\n", path);
+		wm_unix_unlink(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+} /* wm_unix_listen() */
+
+/*
+ * Remove the socket wm_unix_listen() created, if it is still one.
+ */
+void
+wm_unix_unlink( const char *path )
+{
+	struct stat st;
 
+	if (path && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+} /* wm_unix_unlink() */
@@ -19,6 +19,7 @@
  */
 
 #include "wmlib_interface.h"
+#include "wmlib_manager.h"
 
 #include <QtGlobal>
 
@@ -29,7 +30,6 @@ extern "C"
 	// We don't have libWorkMan installed already, so get everything
 	// from within our own directory
 	#include "wmlib/include/wm_cdrom.h"
-	#include "wmlib/include/wm_cdtext.h"
 	#include "wmlib/include/wm_helpers.h"
 }
 
@@ -38,18 +38,23 @@ extern "C"
 KWMLibCompactDiscPrivate::KWMLibCompactDiscPrivate(KCompactDisc *p,
 	const QString &dev, const QString &audioSystem, const QString &audioDevice) :
 	KCompactDiscPrivate(p, dev),
-	m_handle(nullptr),
+	m_worker(nullptr),
+	m_workerManaged(false),
+	m_driveOpened(false),
 	m_audioSystem(audioSystem),
-	m_audioDevice(audioDevice)
+	m_audioDevice(audioDevice),
+	m_volume(0),
+	m_balance(50)
 {
 	m_interface = m_audioSystem;
 }
 
 KWMLibCompactDiscPrivate::~KWMLibCompactDiscPrivate()
 {
-	if (m_handle) {
-		wm_cd_destroy(m_handle);
-	}
+	if (m_workerManaged)
+		KWMLibDriveManager::instance()->detach(m_worker);
+	else
+		delete m_worker;
 }
 
 bool KWMLibCompactDiscPrivate::createInterface()
@@ -61,41 +66,83 @@ bool KWMLibCompactDiscPrivate::createInterface()
 		wm_cd_set_verbosity(WM_MSG_LEVEL_DEBUG | WM_MSG_CLASS_ALL);
 	}
 
-	int status = wm_cd_init(
-        devicePath.toLatin1().data(),
-        m_audioSystem.toLatin1().data(),
-        m_audioDevice.toLatin1().data(),
-		nullptr,
-		&m_handle);
-
-	if(!WM_CDS_ERROR(status)) {
-		m_deviceVendor = QLatin1String(wm_drive_vendor(m_handle));
-		m_deviceModel = QLatin1String(wm_drive_model(m_handle));
-		m_deviceRevision = QLatin1String(wm_drive_revision(m_handle));
-
-		Q_Q(KCompactDisc);
-		Q_EMIT q->discChanged(0);
-
-		if (m_infoMode == KCompactDisc::Asynchronous) {
-			timerExpired();
-		} else {
-			QTimer::singleShot(1000, this, &KWMLibCompactDiscPrivate::timerExpired);
-		}
+	m_worker = new KWMLibDriveWorker(devicePath, m_audioSystem, m_audioDevice);
+
+	connect(this, &KWMLibCompactDiscPrivate::requestOpen, m_worker, &KWMLibDriveWorker::open);
+	connect(this, &KWMLibCompactDiscPrivate::requestPlay, m_worker, &KWMLibDriveWorker::play);
+	connect(this, &KWMLibCompactDiscPrivate::requestPause, m_worker, &KWMLibDriveWorker::pause);
+	connect(this, &KWMLibCompactDiscPrivate::requestStop, m_worker, &KWMLibDriveWorker::stop);
+	connect(this, &KWMLibCompactDiscPrivate::requestEject, m_worker, &KWMLibDriveWorker::eject);
+	connect(this, &KWMLibCompactDiscPrivate::requestClosetray, m_worker, &KWMLibDriveWorker::closetray);
+	connect(this, &KWMLibCompactDiscPrivate::requestCrossfade, m_worker, &KWMLibDriveWorker::setCrossfade);
+	connect(this, &KWMLibCompactDiscPrivate::requestQueue, m_worker, &KWMLibDriveWorker::queue);
+	connect(this, &KWMLibCompactDiscPrivate::requestVolume, m_worker, &KWMLibDriveWorker::setVolume);
+	connect(this, &KWMLibCompactDiscPrivate::requestBalance, m_worker, &KWMLibDriveWorker::setBalance);
+	connect(this, &KWMLibCompactDiscPrivate::requestCdtext, m_worker, &KWMLibDriveWorker::readCdtext);
+	connect(this, &KWMLibCompactDiscPrivate::requestChangerSlot, m_worker, &KWMLibDriveWorker::selectSlot);
+	connect(this, &KWMLibCompactDiscPrivate::requestChangerScan, m_worker, &KWMLibDriveWorker::scanChanger);
+
+	connect(m_worker, &KWMLibDriveWorker::opened, this, &KWMLibCompactDiscPrivate::driveOpened);
+	connect(m_worker, &KWMLibDriveWorker::tocChanged, this, &KWMLibCompactDiscPrivate::tocChanged);
+	connect(m_worker, &KWMLibDriveWorker::statusChanged, this, &KWMLibCompactDiscPrivate::statusChanged);
+	connect(m_worker, &KWMLibDriveWorker::volumeChanged, this, &KWMLibCompactDiscPrivate::volumeChanged);
+	connect(m_worker, &KWMLibDriveWorker::cdtextRead, this, &KWMLibCompactDiscPrivate::cdtextRead);
+	connect(m_worker, &KWMLibDriveWorker::codesRead, this, &KWMLibCompactDiscPrivate::codesRead);
+	connect(m_worker, &KWMLibDriveWorker::changerInventory, this, &KWMLibCompactDiscPrivate::changerInventory);
+
+	if (m_infoMode == KCompactDisc::Asynchronous) {
+		// The worker owns the drive from now on, nothing below blocks on I/O.
+		KWMLibDriveManager::instance()->attach(m_worker);
+		m_workerManaged = true;
+
+		Q_EMIT requestOpen(0);
+		Q_EMIT requestCrossfade(m_crossfade, m_silenceTrim);
+
+		return !devicePath.isEmpty();
+	}
 
-		return true;
+	Q_EMIT requestOpen(1000);
+	Q_EMIT requestCrossfade(m_crossfade, m_silenceTrim);
+
+	return m_driveOpened;
+}
+
+void KWMLibCompactDiscPrivate::driveOpened(bool ok, const QString &vendor,
+	const QString &model, const QString &revision)
+{
+	Q_Q(KCompactDisc);
+
+	m_driveOpened = ok;
+
+	if(!ok) {
+		if(m_status != KCompactDisc::Error) {
+			m_status = KCompactDisc::Error;
+			Q_EMIT q->discStatusChanged(m_status);
+		}
+		return;
 	}
-	m_handle = nullptr;
-	return false;
+
+	m_deviceVendor = vendor;
+	m_deviceModel = model;
+	m_deviceRevision = revision;
+
+	Q_EMIT q->discChanged(0);
 }
 
 unsigned KWMLibCompactDiscPrivate::trackLength(unsigned track)
 {
-	return (unsigned)wm_cd_gettracklen(m_handle, track);
+	if(!TRACK_VALID(track) || track > (unsigned)m_toc.trackLengths.size())
+		return 0;
+
+	return m_toc.trackLengths[track - 1];
 }
 
 bool KWMLibCompactDiscPrivate::isTrackAudio(unsigned track)
 {
-	return !wm_cd_gettrackdata(m_handle, track);
+	if(!TRACK_VALID(track) || track > (unsigned)m_toc.trackAudio.size())
+		return true;
+
+	return m_toc.trackAudio[track - 1];
 }
 
 void KWMLibCompactDiscPrivate::playTrackPosition(unsigned track, unsigned position)
@@ -109,68 +156,75 @@ void KWMLibCompactDiscPrivate::playTrackPosition(unsigned track, unsigned positi
     qDebug() << "play track " << firstTrack << " position "
                  << position;
 
-    wm_cd_play(m_handle, firstTrack, position, lastTrack);
+	Q_EMIT requestPlay(firstTrack, position, lastTrack);
+
+	// Playing drops the queue, a restart of the same track changes nothing.
+	if(m_crossfade || m_silenceTrim)
+		queueTrack(peekNextTrackInPlaylist(firstTrack));
 }
 
 void KWMLibCompactDiscPrivate::pause()
 {
-	wm_cd_pause(m_handle);
+	Q_EMIT requestPause();
 }
 
 void KWMLibCompactDiscPrivate::stop()
 {
-	wm_cd_stop(m_handle);
+	Q_EMIT requestStop();
 }
 
 void KWMLibCompactDiscPrivate::eject()
 {
-	wm_cd_eject(m_handle);
+	Q_EMIT requestEject();
 }
 
 void KWMLibCompactDiscPrivate::closetray()
 {
-	wm_cd_closetray(m_handle);
+	Q_EMIT requestClosetray();
+}
+
+void KWMLibCompactDiscPrivate::setCrossfade(unsigned ms, bool trim)
+{
+	Q_EMIT requestCrossfade(ms, trim);
+	if(m_status == KCompactDisc::Playing)
+		queueTrack((ms || trim) ? peekNextTrackInPlaylist(m_track) : 0);
+}
+
+void KWMLibCompactDiscPrivate::queueTrack(unsigned track)
+{
+	Q_EMIT requestQueue(track);
 }
 
-/* WM_VOLUME_MUTE ... WM_VOLUME_MAXIMAL */
-/* WM_BALANCE_ALL_LEFTS .WM_BALANCE_SYMMETRED. WM_BALANCE_ALL_RIGHTS */
-#define RANGE2PERCENT(x, min, max) (((x) - (min)) * 100)/ ((max) - (min))
-#define PERCENT2RANGE(x, min, max) ((((x) * ((max) - (min))) / 100 ) + (min))
 void KWMLibCompactDiscPrivate::setVolume(unsigned volume)
 {
-	int vol, bal;
-	vol = PERCENT2RANGE(volume, WM_VOLUME_MUTE, WM_VOLUME_MAXIMAL);
-	bal = wm_cd_getbalance(m_handle);
-	wm_cd_volume(m_handle, vol, bal);
+	Q_EMIT requestVolume(volume);
 }
 
 void KWMLibCompactDiscPrivate::setBalance(unsigned balance)
 {
-	int vol, bal;
-	vol = wm_cd_getvolume(m_handle);
-	bal = PERCENT2RANGE(balance, WM_BALANCE_ALL_LEFTS, WM_BALANCE_ALL_RIGHTS);
-	wm_cd_volume(m_handle, vol, bal);
+	Q_EMIT requestBalance(balance);
 }
 
 unsigned KWMLibCompactDiscPrivate::volume()
 {
-	int vol = wm_cd_getvolume(m_handle);
-	unsigned volume = RANGE2PERCENT(vol, WM_VOLUME_MUTE, WM_VOLUME_MAXIMAL);
-	return volume;
+	return m_volume;
 }
 
 unsigned KWMLibCompactDiscPrivate::balance()
 {
-	int bal = wm_cd_getbalance(m_handle);
-	unsigned balance = RANGE2PERCENT(bal, WM_BALANCE_ALL_LEFTS, WM_BALANCE_ALL_RIGHTS);
+	return m_balance;
+}
 
-	return balance;
+void KWMLibCompactDiscPrivate::volumeChanged(unsigned volume, unsigned balance)
+{
+	m_volume = volume;
+	m_balance = balance;
 }
 
 void KWMLibCompactDiscPrivate::queryMetadata()
 {
-	cdtext();
-	//cddb();
+	lookupLocalMetadata();
+	Q_EMIT requestCdtext();
 }
 
 KCompactDisc::DiscStatus KWMLibCompactDiscPrivate::discStatusTranslate(int status)
@@ -198,17 +252,24 @@ KCompactDisc::DiscStatus KWMLibCompactDiscPrivate::discStatusTranslate(int statu
 	}
 }
 
-void KWMLibCompactDiscPrivate::timerExpired()
+void KWMLibCompactDiscPrivate::tocChanged(const KWMLibDiscToc &toc)
+{
+	m_toc = toc;
+	m_cdtext.reset();
+	m_cdtextStrings.clear();
+}
+
+void KWMLibCompactDiscPrivate::statusChanged(const KWMLibDriveStatus &driveStatus)
 {
 	KCompactDisc::DiscStatus status;
-	unsigned track, i;
+	unsigned i;
 	Q_Q(KCompactDisc);
 
-	status = discStatusTranslate(wm_cd_status(m_handle));
+	status = discStatusTranslate(driveStatus.status);
 
 	if(m_status != status) {
 		if(skipStatusChange(status))
-			goto timerExpiredExit;
+			return;
 
 		m_status = status;
 
@@ -219,15 +280,11 @@ void KWMLibCompactDiscPrivate::timerExpired()
 			break;
 		default:
 			if(m_tracks == 0) {
-				m_tracks = wm_cd_getcountoftracks(m_handle);
+				m_tracks = m_toc.trackLengths.size();
 				if(m_tracks > 0) {
                     qDebug() << "New disc with " << m_tracks << " tracks";
-					m_discId = wm_cddb_discid(m_handle);
-
-					for(i = 1; i <= m_tracks; ++i) {
-						m_trackStartFrames.append(wm_cd_gettrackstart(m_handle, i));
-					}
-					m_trackStartFrames.append(wm_cd_gettrackstart(m_handle, i));
+					m_trackStartFrames = m_toc.trackStartFrames;
+					calculateDiscIds();
 
 					m_discLength = FRAMES2SEC(m_trackStartFrames[m_tracks] -
 						m_trackStartFrames[0]);
@@ -258,8 +315,8 @@ qDebug() << "m_trackTitles " << m_trackTitles;
 
 	switch(m_status) {
 	case KCompactDisc::Playing:
-		m_trackPosition = wm_get_cur_pos_rel(m_handle);
-		m_discPosition = wm_get_cur_pos_abs(m_handle) - FRAMES2SEC(m_trackStartFrames[0]);
+		m_trackPosition = driveStatus.trackPosition;
+		m_discPosition = driveStatus.discPosition - FRAMES2SEC(m_trackStartFrames.value(0));
 		// Update the current playing position.
 		if(m_seek) {
             qDebug() << "seek: " << m_seek << " trackPosition " << m_trackPosition;
@@ -275,11 +332,13 @@ qDebug() << "m_trackTitles " << m_trackTitles;
 		}
 
 		// Per-event processing.
-		track = wm_cd_getcurtrack(m_handle);
-
-		if(m_track != track) {
-			m_track = track;
+		if(m_track != driveStatus.track) {
+			m_track = driveStatus.track;
 			Q_EMIT q->playoutTrackChanged(m_track);
+
+			// The engine goes on into the next track by itself.
+			if(m_crossfade || m_silenceTrim)
+				queueTrack(peekNextTrackInPlaylist(m_track));
 		}
 		break;
 
@@ -291,32 +350,30 @@ qDebug() << "m_trackTitles " << m_trackTitles;
 	default:
 		break;
 	}
-
-timerExpiredExit:
-	// Now that we have incurred any delays caused by the signals, we'll start the timer.
-	QTimer::singleShot(1000, this, &KWMLibCompactDiscPrivate::timerExpired);
 }
 
-void KWMLibCompactDiscPrivate::cdtext()
+void KWMLibCompactDiscPrivate::cdtextRead(const KWMLibCdtext &cdtext)
 {
-	struct cdtext_info *info;
+	QStringList artists, titles;
 	unsigned i;
 	Q_Q(KCompactDisc);
 
-	info = wm_cd_get_cdtext(m_handle);
-
-	if(!info || !info->valid || (unsigned)info->count_of_entries != (m_tracks + 1)) {
+	if((unsigned)cdtext->count_of_entries != (m_tracks + 1)) {
         qDebug() << "no or invalid CDTEXT";
 		return;
 	}
 
-	m_trackArtists[0] = QLatin1String( reinterpret_cast<char*>(info->blocks[0]->performer[0]) );
-	m_trackTitles[0] = QLatin1String( reinterpret_cast<char*>(info->blocks[0]->name[0]) );
+	m_cdtext = cdtext;
+	m_cdtextStrings.clear();
 
-	for(i = 1; i <= m_tracks; ++i) {
-            m_trackArtists[i] = QLatin1String( reinterpret_cast<char*>(info->blocks[0]->performer[i]) );
-            m_trackTitles[i] =QLatin1String( reinterpret_cast<char*>(info->blocks[0]->name[i]) );
+	// Only the fields behind discArtist()/trackTitle() etc. are decoded here,
+	// everything else waits for cdtext().
+	for(i = 0; i <= m_tracks; ++i) {
+		artists.append(this->cdtext(KCompactDisc::CdtextPerformer, i, 0));
+		titles.append(this->cdtext(KCompactDisc::CdtextTitle, i, 0));
 	}
+	m_trackArtists = artists;
+	m_trackTitles = titles;
 
     qDebug() << "CDTEXT";
     qDebug() << "m_trackArtists " << m_trackArtists;
@@ -325,4 +382,126 @@ void KWMLibCompactDiscPrivate::cdtext()
 	Q_EMIT q->discInformation(KCompactDisc::Cdtext);
 }
 
+void KWMLibCompactDiscPrivate::codesRead(const KWMLibDiscCodes &codes)
+{
+	Q_Q(KCompactDisc);
+
+	// Late answer for a disc that is gone already.
+	if((unsigned)codes.isrcs.size() != m_tracks)
+		return;
+
+	m_discMcn = codes.mcn;
+	m_trackIsrcs = codes.isrcs;
+
+	Q_EMIT q->discInformation(KCompactDisc::DiscCodes);
+}
+
+void KWMLibCompactDiscPrivate::selectChangerSlot(unsigned slot)
+{
+	Q_EMIT requestChangerSlot(slot);
+}
+
+void KWMLibCompactDiscPrivate::scanChanger()
+{
+	Q_EMIT requestChangerScan();
+}
+
+void KWMLibCompactDiscPrivate::changerInventory(const KWMLibChangerSlots &inventory, unsigned currentSlot)
+{
+	KCompactDiscChangerSlot entry;
+	Q_Q(KCompactDisc);
+
+	m_changerSlots.clear();
+	for(const KWMLibChangerSlot &slot : inventory) {
+		entry.discId = slot.discId;
+		entry.tracks = slot.tracks;
+		entry.artist = slot.artist;
+		entry.title = slot.title;
+		m_changerSlots.append(entry);
+	}
+	m_changerSlot = currentSlot;
+
+	Q_EMIT q->changerChanged();
+}
+
+QList<unsigned> KWMLibCompactDiscPrivate::cdtextBlocks()
+{
+	QList<unsigned> blocks;
+	unsigned i;
+
+	if(m_cdtext) {
+		for(i = 0; i < MAX_LANGUAGE_BLOCKS; ++i) {
+			if(m_cdtext->blocks[i])
+				blocks.append(i);
+		}
+	}
+
+	return blocks;
+}
+
+static const cdtext_string *cdtextField(const struct cdtext_info_block *block, KCompactDisc::CdtextField field)
+{
+	switch(field) {
+	case KCompactDisc::CdtextTitle:
+		return block->name;
+	case KCompactDisc::CdtextPerformer:
+		return block->performer;
+	case KCompactDisc::CdtextSongwriter:
+		return block->songwriter;
+	case KCompactDisc::CdtextComposer:
+		return block->composer;
+	case KCompactDisc::CdtextArranger:
+		return block->arranger;
+	case KCompactDisc::CdtextMessage:
+		return block->message;
+	case KCompactDisc::CdtextCode:
+		return block->UPC_EAN_ISRC_code;
+	}
+
+	return nullptr;
+}
+
+QString KWMLibCompactDiscPrivate::cdtext(KCompactDisc::CdtextField field, unsigned track, unsigned block)
+{
+	const struct cdtext_info_block *cdtextBlock;
+	const cdtext_string *entries;
+	const unsigned key = (block << 16) | (field << 8) | track;
+
+	if(!m_cdtext || block >= MAX_LANGUAGE_BLOCKS || track >= (unsigned)m_cdtext->count_of_entries)
+		return QString();
+
+	cdtextBlock = m_cdtext->blocks[block];
+	if(!cdtextBlock || !(entries = cdtextField(cdtextBlock, field)))
+		return QString();
+
+	QHash<unsigned, QString>::const_iterator it = m_cdtextStrings.constFind(key);
+	if(it != m_cdtextStrings.constEnd())
+		return *it;
+
+	return *m_cdtextStrings.insert(key, wmlibCdtextString(m_cdtext.data(), cdtextBlock, entries[track]));
+}
+
+unsigned KWMLibCompactDiscPrivate::cdtextGenre(unsigned block)
+{
+	const unsigned char *genre;
+
+	if(!m_cdtext || block >= MAX_LANGUAGE_BLOCKS || !m_cdtext->blocks[block])
+		return 0;
+
+	genre = m_cdtext->blocks[block]->binary_genreidentification_info;
+	return (genre[0] << 8) | genre[1];
+}
+
+QString KWMLibCompactDiscPrivate::cdtextGenreText(unsigned block)
+{
+	const char *text;
+
+	if(!m_cdtext || block >= MAX_LANGUAGE_BLOCKS || !m_cdtext->blocks[block])
+		return QString();
+
+	// Genre code followed by ISO-8859-1 text, zero terminated unless it fills the pack.
+	text = reinterpret_cast<const char*>(m_cdtext->blocks[block]->binary_genreidentification_info) + 2;
+	return QString::fromLatin1(text, qstrnlen(text, DATAFIELD_LENGHT_IN_PACK - 2));
+}
+
 #include "moc_wmlib_interface.cpp"
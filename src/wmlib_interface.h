@@ -21,7 +21,10 @@
 #ifndef WMLIB_INTERFACE_H
 #define WMLIB_INTERFACE_H
 
+#include <QHash>
+
 #include "kcompactdisc_p.h"
+#include "wmlib_worker.h"
 
 class KWMLibCompactDiscPrivate : public KCompactDiscPrivate
 {
@@ -40,6 +43,8 @@ class KWMLibCompactDiscPrivate : public KCompactDiscPrivate
 		void stop() override;
 		void eject() override;
 		void closetray() override;
+		void setCrossfade(unsigned, bool) override;
+		void queueTrack(unsigned) override;
 	
 		void setVolume(unsigned) override;
 		void setBalance(unsigned) override;
@@ -48,17 +53,52 @@ class KWMLibCompactDiscPrivate : public KCompactDiscPrivate
 	
 		void queryMetadata() override;
 
+		void selectChangerSlot(unsigned) override;
+		void scanChanger() override;
+
+		QList<unsigned> cdtextBlocks() override;
+		QString cdtext(KCompactDisc::CdtextField, unsigned, unsigned) override;
+		unsigned cdtextGenre(unsigned) override;
+		QString cdtextGenreText(unsigned) override;
 
 	private:
 		KCompactDisc::DiscStatus discStatusTranslate(int);
-		void *m_handle;
+		KWMLibDriveWorker *m_worker;
+		bool m_workerManaged;
+		bool m_driveOpened;
 		QString m_audioSystem;
 		QString m_audioDevice;
 
-	
+		KWMLibDiscToc m_toc;
+		unsigned m_volume;
+		unsigned m_balance;
+
+		KWMLibCdtext m_cdtext;
+		QHash<unsigned, QString> m_cdtextStrings; // decoded on first access
+
+	Q_SIGNALS:
+		void requestOpen(int firstPollDelay);
+		void requestPlay(unsigned firstTrack, unsigned position, unsigned lastTrack);
+		void requestPause();
+		void requestStop();
+		void requestEject();
+		void requestClosetray();
+		void requestCrossfade(unsigned ms, bool trim);
+		void requestQueue(unsigned track);
+		void requestVolume(unsigned);
+		void requestBalance(unsigned);
+		void requestCdtext();
+		void requestChangerSlot(unsigned);
+		void requestChangerScan();
+
 	private Q_SLOTS:
-		void timerExpired();
-		void cdtext();
+		void driveOpened(bool, const QString &, const QString &, const QString &);
+		void tocChanged(const KWMLibDiscToc &);
+		void statusChanged(const KWMLibDriveStatus &);
+		void volumeChanged(unsigned, unsigned);
+		void cdtextRead(const KWMLibCdtext &);
+		void codesRead(const KWMLibDiscCodes &);
+		void changerInventory(const KWMLibChangerSlots &, unsigned);
 };
 
 #endif // WMLIB_INTERFACE_H
@@ -0,0 +1,165 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "wmlib_manager.h"
+#include "wmlib_worker.h"
+
+#include <QThread>
+
+/* Every drive is polled once per interval. */
+#define POLL_INTERVAL 1000
+/* Lower bound of the tick, for the case of very many drives per thread. */
+#define MIN_TICK 5
+
+Q_GLOBAL_STATIC(KWMLibDriveManager, driveManager)
+
+KWMLibPollScheduler::KWMLibPollScheduler() :
+	QObject(),
+	m_timer(this),
+	m_next(0)
+{
+	connect(&m_timer, &QTimer::timeout, this, &KWMLibPollScheduler::tick);
+}
+
+void KWMLibPollScheduler::add(KWMLibDriveWorker *worker)
+{
+	m_workers.append(worker);
+	reschedule();
+}
+
+void KWMLibPollScheduler::remove(KWMLibDriveWorker *worker)
+{
+	int i = m_workers.indexOf(worker);
+
+	if(i < 0)
+		return;
+
+	m_workers.removeAt(i);
+	if(m_next > i)
+		--m_next;
+	reschedule();
+}
+
+void KWMLibPollScheduler::reschedule()
+{
+	if(m_workers.isEmpty()) {
+		m_timer.stop();
+		return;
+	}
+
+	m_timer.setInterval(qMax(MIN_TICK, POLL_INTERVAL / int(m_workers.size())));
+	if(!m_timer.isActive())
+		m_timer.start();
+}
+
+void KWMLibPollScheduler::tick()
+{
+	if(m_workers.isEmpty())
+		return;
+
+	if(m_next >= m_workers.size())
+		m_next = 0;
+	m_workers[m_next++]->poll();
+}
+
+KWMLibDriveManager::KWMLibDriveManager() :
+	m_maxThreads(qBound(1, QThread::idealThreadCount() / 2, 4))
+{
+}
+
+KWMLibDriveManager::~KWMLibDriveManager()
+{
+	for(const IOThread &io : std::as_const(m_threads)) {
+		io.thread->quit();
+		io.thread->wait();
+	}
+
+	// Detached at exit, their threads stopped before getting to them.
+	qDeleteAll(m_detached);
+
+	for(const IOThread &io : std::as_const(m_threads))
+		delete io.thread;
+}
+
+KWMLibDriveManager *KWMLibDriveManager::instance()
+{
+	return driveManager();
+}
+
+void KWMLibDriveManager::attach(KWMLibDriveWorker *worker)
+{
+	KWMLibPollScheduler *scheduler;
+	int i, least = -1;
+
+	QMutexLocker locker(&m_mutex);
+
+	for(i = 0; i < m_threads.size(); ++i) {
+		if(least < 0 || m_threads[i].drives < m_threads[least].drives)
+			least = i;
+	}
+
+	if(least < 0 || (m_threads[least].drives && m_threads.size() < m_maxThreads)) {
+		IOThread io;
+		io.thread = new QThread();
+		io.thread->setObjectName(QStringLiteral("KCompactDisc I/O %1").arg(m_threads.size()));
+		io.scheduler = new KWMLibPollScheduler();
+		io.scheduler->moveToThread(io.thread);
+		QObject::connect(io.thread, &QThread::finished, io.scheduler, &QObject::deleteLater);
+		io.drives = 0;
+		io.thread->start();
+
+		least = m_threads.size();
+		m_threads.append(io);
+	}
+
+	++m_threads[least].drives;
+	m_workers.insert(worker, least);
+
+	scheduler = m_threads[least].scheduler;
+	worker->setManaged(true);
+	worker->moveToThread(m_threads[least].thread);
+	QMetaObject::invokeMethod(scheduler, [scheduler, worker]() { scheduler->add(worker); });
+}
+
+void KWMLibDriveManager::detach(KWMLibDriveWorker *worker)
+{
+	KWMLibPollScheduler *scheduler;
+
+	{
+		QMutexLocker locker(&m_mutex);
+
+		if(!m_workers.contains(worker))
+			return;
+
+		IOThread &io = m_threads[m_workers.take(worker)];
+		--io.drives;
+		scheduler = io.scheduler;
+		m_detached.insert(worker);
+	}
+
+	// Queued behind any pending command, e.g. the stop() issued by ~KCompactDisc().
+	// Not waited for, the I/O thread may just be busy with the drive.
+	QMetaObject::invokeMethod(scheduler, [this, scheduler, worker]() {
+		scheduler->remove(worker);
+		{
+			QMutexLocker locker(&m_mutex);
+			m_detached.remove(worker);
+		}
+		delete worker;
+	});
+}
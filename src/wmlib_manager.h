@@ -0,0 +1,94 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef WMLIB_MANAGER_H
+#define WMLIB_MANAGER_H
+
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QTimer>
+
+class QThread;
+class KWMLibDriveWorker;
+
+/*
+ * Polls the drives of one I/O thread in turn. With n drives it ticks
+ * every 1000/n ms, so every drive is still polled once a second but the
+ * ioctls are spread evenly over that second instead of piling up.
+ */
+class KWMLibPollScheduler : public QObject
+{
+	Q_OBJECT
+
+	public:
+		KWMLibPollScheduler();
+
+		void add(KWMLibDriveWorker *);
+		void remove(KWMLibDriveWorker *);
+
+	private Q_SLOTS:
+		void tick();
+
+	private:
+		void reschedule();
+
+		QTimer m_timer;
+		QList<KWMLibDriveWorker *> m_workers;
+		int m_next;
+};
+
+/*
+ * Process wide owner of the asynchronous wmlib workers. Drives are
+ * spread over a small pool of I/O threads instead of one thread and one
+ * timer each.
+ */
+class KWMLibDriveManager
+{
+	public:
+		KWMLibDriveManager();
+		~KWMLibDriveManager();
+
+		static KWMLibDriveManager *instance();
+
+		/* Move the worker to the least loaded I/O thread and poll it from there. */
+		void attach(KWMLibDriveWorker *);
+		/*
+		 * Close and delete the worker in its I/O thread after pending
+		 * commands. Returns at once, the caller must not touch it any more.
+		 */
+		void detach(KWMLibDriveWorker *);
+
+	private:
+		struct IOThread
+		{
+			QThread *thread;
+			KWMLibPollScheduler *scheduler;
+			int drives;
+		};
+
+		QMutex m_mutex;
+		QList<IOThread> m_threads;
+		QHash<KWMLibDriveWorker *, int> m_workers;
+		QSet<KWMLibDriveWorker *> m_detached; // not yet deleted by their thread
+		int m_maxThreads;
+};
+
+#endif // WMLIB_MANAGER_H
@@ -0,0 +1,506 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "wmlib_worker.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
+
+extern "C"
+{
+	// We don't have libWorkMan installed already, so get everything
+	// from within our own directory
+	#include "wmlib/include/wm_cdrom.h"
+}
+
+/* WM_VOLUME_MUTE ... WM_VOLUME_MAXIMAL */
+/* WM_BALANCE_ALL_LEFTS .WM_BALANCE_SYMMETRED. WM_BALANCE_ALL_RIGHTS */
+#define RANGE2PERCENT(x, min, max) (((x) - (min)) * 100)/ ((max) - (min))
+#define PERCENT2RANGE(x, min, max) ((((x) * ((max) - (min))) / 100 ) + (min))
+
+/* jobs of the background thread */
+#define READ_CODES   0
+#define SCAN_INDEXES 1
+
+QString wmlibCdtextString(const struct cdtext_info *info, const struct cdtext_info_block *block,
+	const cdtext_string &string)
+{
+	// Decode straight into the storage of the QString, no second conversion.
+	QString text(string.length, Qt::Uninitialized);
+	int length = wm_cdtext_to_utf16(info, block, string, reinterpret_cast<unsigned short*>(text.data()));
+
+	if(length < 0)
+		return QString::fromLatin1(reinterpret_cast<const char*>(CDTEXT_STRING(info, string)), string.length);
+
+	text.truncate(length);
+	return text;
+}
+
+KWMLibDriveWorker::KWMLibDriveWorker(const QString &devicePath,
+	const QString &audioSystem, const QString &audioDevice) :
+	QObject(),
+	m_handle(nullptr),
+	m_devicePath(devicePath),
+	m_audioSystem(audioSystem),
+	m_audioDevice(audioDevice),
+	m_managed(false),
+	m_playCommanded(false),
+	m_background(nullptr),
+	m_backgroundJob(READ_CODES),
+	m_backgroundResult(0),
+	m_codesPending(false),
+	m_indexesPending(false),
+	m_inventorySlot(-1),
+	m_inventoryWait(0),
+	m_returnSlot(0)
+{
+	qRegisterMetaType<KWMLibDriveStatus>();
+	qRegisterMetaType<KWMLibDiscToc>();
+	qRegisterMetaType<KWMLibDiscCodes>();
+	qRegisterMetaType<KWMLibChangerSlots>();
+	qRegisterMetaType<KWMLibCdtext>();
+}
+
+KWMLibDriveWorker::~KWMLibDriveWorker()
+{
+	close();
+}
+
+void KWMLibDriveWorker::setManaged(bool managed)
+{
+	m_managed = managed;
+}
+
+void KWMLibDriveWorker::open(int firstPollDelay)
+{
+	int status = wm_cd_init(
+		m_devicePath.toLatin1().data(),
+		m_audioSystem.toLatin1().data(),
+		m_audioDevice.toLatin1().data(),
+		nullptr,
+		WM_LATENCY_DEFAULT,
+		&m_handle);
+
+	if(WM_CDS_ERROR(status)) {
+		m_handle = nullptr;
+		Q_EMIT opened(false, QString(), QString(), QString());
+		return;
+	}
+
+	Q_EMIT opened(true,
+		QLatin1String(wm_drive_vendor(m_handle)),
+		QLatin1String(wm_drive_model(m_handle)),
+		QLatin1String(wm_drive_revision(m_handle)));
+
+	const QString cdtextCache = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+		+ QLatin1String("/kcompactdisc/cdtext");
+	if(QDir().mkpath(cdtextCache))
+		wm_cd_set_cdtext_cache(m_handle, QFile::encodeName(cdtextCache).constData());
+
+	publishVolume();
+
+	// Other processes read the digital audio through this socket.
+	const QByteArray pcmExport = qgetenv("KCOMPACTDISC_PCM_EXPORT");
+	if(!pcmExport.isEmpty() && wm_cd_cdda_export(m_handle, pcmExport.constData()))
+		qWarning() << "Unable to export the audio on" << pcmExport;
+	const QByteArray pcmStream = qgetenv("KCOMPACTDISC_PCM_STREAM");
+	if(!pcmStream.isEmpty() && wm_cd_cdda_stream(m_handle, pcmStream.constData()))
+		qWarning() << "Unable to stream the audio on" << pcmStream;
+
+	if(!m_managed)
+		QTimer::singleShot(firstPollDelay, this, &KWMLibDriveWorker::poll);
+
+	if(wm_cd_getcountofslots(m_handle) > 1)
+		QTimer::singleShot(firstPollDelay, this, &KWMLibDriveWorker::scanChanger);
+}
+
+void KWMLibDriveWorker::close()
+{
+	cancelBackground();
+	if(m_handle) {
+		wm_cd_destroy(m_handle);
+		m_handle = nullptr;
+	}
+}
+
+void KWMLibDriveWorker::poll()
+{
+	KWMLibDriveStatus status;
+
+	if(!m_handle)
+		return;
+
+	// The inventory walks through the discs, none of them is the current one.
+	if(m_inventorySlot >= 0 || m_background) {
+		if(!m_managed)
+			QTimer::singleShot(1000, this, &KWMLibDriveWorker::poll);
+		return;
+	}
+
+	status.status = wm_cd_status(m_handle);
+
+	if(wm_cd_getcountoftracks(m_handle) > 0) {
+		if(m_toc.trackStartFrames.isEmpty()) {
+			readToc();
+			Q_EMIT tocChanged(m_toc);
+			m_codesPending = true;
+		}
+	} else if(!m_toc.trackStartFrames.isEmpty()) {
+		m_toc = KWMLibDiscToc();
+		Q_EMIT tocChanged(m_toc);
+		m_codesPending = false;
+		m_indexesPending = false;
+	}
+
+	status.track = wm_cd_getcurtrack(m_handle);
+	status.trackPosition = wm_get_cur_pos_rel(m_handle);
+	status.discPosition = wm_get_cur_pos_abs(m_handle);
+
+	if(status.status != m_status.status || status.track != m_status.track ||
+		status.trackPosition != m_status.trackPosition || status.discPosition != m_status.discPosition ||
+		(m_playCommanded && (status.status == WM_CDM_STOPPED || status.status == WM_CDM_TRACK_DONE))) {
+		m_status = status;
+		Q_EMIT statusChanged(status);
+	}
+
+	// Right behind the TOC while the disc is still spinning. The index
+	// scan seeks all over the disc, it waits until nothing is played.
+	if(m_codesPending)
+		readCodes();
+	else if(m_indexesPending)
+		scanIndexes();
+
+	// Now that we have incurred any delays caused by the signals, we'll start the timer.
+	if(!m_managed)
+		QTimer::singleShot(1000, this, &KWMLibDriveWorker::poll);
+}
+
+void KWMLibDriveWorker::readToc()
+{
+	int i, tracks;
+
+	tracks = wm_cd_getcountoftracks(m_handle);
+
+	for(i = 1; i <= tracks; ++i) {
+		m_toc.trackStartFrames.append(wm_cd_gettrackstart(m_handle, i));
+		m_toc.trackLengths.append(wm_cd_gettracklen(m_handle, i));
+		m_toc.trackAudio.append(!wm_cd_gettrackdata(m_handle, i));
+	}
+	m_toc.trackStartFrames.append(wm_cd_gettrackstart(m_handle, i));
+}
+
+void KWMLibDriveWorker::play(unsigned firstTrack, unsigned position, unsigned lastTrack)
+{
+	cancelBackground();
+	m_playCommanded = true;
+	if(m_handle)
+		wm_cd_play(m_handle, firstTrack, position, lastTrack);
+}
+
+void KWMLibDriveWorker::pause()
+{
+	cancelBackground();
+	m_playCommanded = false;
+	if(m_handle)
+		wm_cd_pause(m_handle);
+}
+
+void KWMLibDriveWorker::stop()
+{
+	cancelBackground();
+	m_playCommanded = false;
+	if(m_handle)
+		wm_cd_stop(m_handle);
+}
+
+void KWMLibDriveWorker::eject()
+{
+	cancelBackground();
+	m_playCommanded = false;
+	if(m_handle)
+		wm_cd_eject(m_handle);
+}
+
+void KWMLibDriveWorker::closetray()
+{
+	cancelBackground();
+	m_playCommanded = false;
+	if(m_handle)
+		wm_cd_closetray(m_handle);
+}
+
+void KWMLibDriveWorker::setCrossfade(unsigned ms, bool trim)
+{
+	cancelBackground();
+	if(m_handle)
+		wm_cd_set_crossfade(m_handle, ms, trim);
+}
+
+void KWMLibDriveWorker::queue(unsigned track)
+{
+	cancelBackground();
+	if(m_handle)
+		wm_cd_queue(m_handle, track);
+}
+
+void KWMLibDriveWorker::setVolume(unsigned volume)
+{
+	int vol, bal;
+
+	cancelBackground();
+	if(!m_handle)
+		return;
+
+	vol = PERCENT2RANGE(volume, WM_VOLUME_MUTE, WM_VOLUME_MAXIMAL);
+	bal = wm_cd_getbalance(m_handle);
+	wm_cd_volume(m_handle, vol, bal);
+
+	publishVolume();
+}
+
+void KWMLibDriveWorker::setBalance(unsigned balance)
+{
+	int vol, bal;
+
+	cancelBackground();
+	if(!m_handle)
+		return;
+
+	vol = wm_cd_getvolume(m_handle);
+	bal = PERCENT2RANGE(balance, WM_BALANCE_ALL_LEFTS, WM_BALANCE_ALL_RIGHTS);
+	wm_cd_volume(m_handle, vol, bal);
+
+	publishVolume();
+}
+
+void KWMLibDriveWorker::publishVolume()
+{
+	int vol = wm_cd_getvolume(m_handle);
+	int bal = wm_cd_getbalance(m_handle);
+
+	Q_EMIT volumeChanged(RANGE2PERCENT(vol, WM_VOLUME_MUTE, WM_VOLUME_MAXIMAL),
+		RANGE2PERCENT(bal, WM_BALANCE_ALL_LEFTS, WM_BALANCE_ALL_RIGHTS));
+}
+
+void KWMLibDriveWorker::readCdtext()
+{
+	struct cdtext_info *info;
+
+	cancelBackground();
+	if(!m_handle)
+		return;
+
+	info = wm_cd_get_cdtext(m_handle);
+
+	if(!info || !info->valid || !info->blocks[0] || info->count_of_entries != (m_toc.trackLengths.size() + 1)) {
+		qDebug() << "no or invalid CDTEXT";
+		return;
+	}
+
+	// Hand over a copy, the text is decoded by the receiver when asked for.
+	KWMLibCdtext cdtext(wm_cdtext_dup(info), wm_cdtext_free);
+	if(!cdtext.isNull())
+		Q_EMIT cdtextRead(cdtext);
+}
+
+void KWMLibDriveWorker::readCodes()
+{
+	if(!m_handle || m_background)
+		return;
+
+	m_codesPending = false;
+	runBackground(READ_CODES);
+}
+
+void KWMLibDriveWorker::scanIndexes()
+{
+	if(!m_handle || m_background)
+		return;
+
+	// The map is used by wmlib itself to tag what the CDDA reader reads.
+	m_indexesPending = true;
+	if(m_status.status == WM_CDM_PLAYING || m_status.status == WM_CDM_PAUSED)
+		return;
+
+	m_indexesPending = false;
+	runBackground(SCAN_INDEXES);
+}
+
+/*
+ * The MCN and ISRC commands and the index scan take a while, so they are
+ * sent from a thread of their own. Neither the I/O thread nor, in
+ * synchronous mode, the GUI thread waits for them. Polling is held
+ * meanwhile, every other drive command cancels them first and they are
+ * tried again later.
+ */
+void KWMLibDriveWorker::runBackground(int job)
+{
+	void *handle = m_handle;
+
+	m_backgroundJob = job;
+	m_background = QThread::create([this, handle, job]() {
+		m_backgroundResult = job == READ_CODES ? wm_cd_read_codes(handle) : wm_cd_scan_indexes(handle);
+	});
+	connect(m_background, &QThread::finished, this, &KWMLibDriveWorker::backgroundFinished);
+	m_background->start();
+}
+
+void KWMLibDriveWorker::cancelBackground()
+{
+	if(!m_background)
+		return;
+
+	wm_cd_cancel(m_handle, 1);
+	m_background->wait();
+	wm_cd_cancel(m_handle, 0);
+
+	// Interrupted by a command, run it again once the drive is free.
+	if(m_backgroundResult) {
+		if(m_backgroundJob == READ_CODES)
+			m_codesPending = true;
+		else
+			m_indexesPending = true;
+	}
+	backgroundFinished();
+}
+
+void KWMLibDriveWorker::backgroundFinished()
+{
+	KWMLibDiscCodes codes;
+	int i, tracks;
+
+	// Already collected by cancelBackground().
+	if(!m_background || !m_background->isFinished())
+		return;
+
+	m_background->wait();
+	delete m_background;
+	m_background = nullptr;
+
+	if(!m_handle || m_backgroundResult || m_backgroundJob != READ_CODES)
+		return;
+
+	codes.mcn = QLatin1String(wm_cd_getmcn(m_handle));
+	tracks = wm_cd_getcountoftracks(m_handle);
+	for(i = 1; i <= tracks; ++i)
+		codes.isrcs.append(QLatin1String(wm_cd_gettrackisrc(m_handle, i)));
+
+	Q_EMIT codesRead(codes);
+
+	m_indexesPending = true;
+}
+
+void KWMLibDriveWorker::selectSlot(unsigned slot)
+{
+	cancelBackground();
+	m_playCommanded = false;
+	if(!m_handle || m_inventorySlot >= 0 || slot == (unsigned)wm_cd_getslot(m_handle) ||
+		wm_cd_selectslot(m_handle, slot))
+		return;
+
+	// To the receiver this is the old disc leaving and a new one arriving.
+	m_toc = KWMLibDiscToc();
+	Q_EMIT tocChanged(m_toc);
+	m_status = KWMLibDriveStatus();
+	m_status.status = WM_CDM_NO_DISC;
+	Q_EMIT statusChanged(m_status);
+
+	if(!m_slots.isEmpty())
+		Q_EMIT changerInventory(m_slots, slot);
+}
+
+/*
+ * Read TOC, disc id and CD-Text of every slot once. One slot is handled
+ * per step, the drive gets time to load the disc in between without
+ * blocking the thread. CD-Text lands in the on-disk cache on the way, so
+ * selecting a slot later shows it at once.
+ */
+void KWMLibDriveWorker::scanChanger()
+{
+	int count, status;
+
+	cancelBackground();
+	if(!m_handle || m_inventorySlot >= 0)
+		return;
+
+	count = wm_cd_getcountofslots(m_handle);
+	status = wm_cd_status(m_handle);
+	if(count < 2 || status == WM_CDM_PLAYING || status == WM_CDM_PAUSED)
+		return;
+
+	m_returnSlot = wm_cd_getslot(m_handle);
+	m_slots = KWMLibChangerSlots(count);
+	Q_EMIT changerInventory(m_slots, m_returnSlot);
+
+	m_inventorySlot = 0;
+	m_inventoryWait = 0;
+	wm_cd_selectslot(m_handle, m_inventorySlot);
+	QTimer::singleShot(500, this, &KWMLibDriveWorker::scanChangerSlot);
+}
+
+void KWMLibDriveWorker::scanChangerSlot()
+{
+	struct cdtext_info *info;
+	int status;
+
+	if(!m_handle) {
+		m_inventorySlot = -1;
+		return;
+	}
+
+	status = wm_cd_status(m_handle);
+	// Still loading, give it up to ten seconds.
+	if(WM_CDS_NO_DISC(status) && status != WM_CDM_NO_DISC && status != WM_CDM_EJECTED &&
+		++m_inventoryWait < 20) {
+		QTimer::singleShot(500, this, &KWMLibDriveWorker::scanChangerSlot);
+		return;
+	}
+
+	if(!WM_CDS_NO_DISC(status) && wm_cd_getcountoftracks(m_handle) > 0) {
+		KWMLibChangerSlot &slot = m_slots[m_inventorySlot];
+		slot.discId = wm_cddb_discid(m_handle);
+		slot.tracks = wm_cd_getcountoftracks(m_handle);
+
+		info = wm_cd_get_cdtext(m_handle);
+		if(info && info->valid && info->blocks[0]) {
+			slot.artist = wmlibCdtextString(info, info->blocks[0], info->blocks[0]->performer[0]);
+			slot.title = wmlibCdtextString(info, info->blocks[0], info->blocks[0]->name[0]);
+		}
+	}
+
+	m_inventoryWait = 0;
+	if(++m_inventorySlot < m_slots.size()) {
+		wm_cd_selectslot(m_handle, m_inventorySlot);
+		QTimer::singleShot(500, this, &KWMLibDriveWorker::scanChangerSlot);
+		return;
+	}
+
+	// Back to the disc the user had. wmlib reads its TOC again, the index
+	// map went with the other discs.
+	wm_cd_selectslot(m_handle, m_returnSlot);
+	m_inventorySlot = -1;
+	m_indexesPending = true;
+
+	Q_EMIT changerInventory(m_slots, m_returnSlot);
+}
+
+#include "moc_wmlib_worker.cpp"
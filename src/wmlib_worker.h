@@ -0,0 +1,183 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef WMLIB_WORKER_H
+#define WMLIB_WORKER_H
+
+#include <QList>
+#include <QMetaType>
+#include <QObject>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+
+class QThread;
+
+extern "C"
+{
+	#include "wmlib/include/wm_cdtext.h"
+}
+
+/*
+ * One CD-Text entry of block as a QString, decoded by wm_cdtext_to_utf16().
+ * Latin-1 for a character code wmlib cannot convert.
+ */
+QString wmlibCdtextString(const struct cdtext_info *info, const struct cdtext_info_block *block,
+	const cdtext_string &string);
+
+/*
+ * Snapshot of the drive state, taken once per poll.
+ */
+struct KWMLibDriveStatus
+{
+	int status = -1;            /* WM_CDM_* as returned by wm_cd_status() */
+	unsigned track = 0;
+	unsigned trackPosition = 0; /* seconds */
+	unsigned discPosition = 0;  /* absolute seconds */
+};
+
+/*
+ * Table of contents of the current disc. Empty if there is no disc.
+ */
+struct KWMLibDiscToc
+{
+	QList<unsigned> trackStartFrames; /* tracks + 1 entries, the last one is the leadout */
+	QList<unsigned> trackLengths;     /* seconds */
+	QList<bool> trackAudio;
+};
+
+/*
+ * Media catalogue number and ISRCs of the current disc, empty strings
+ * where the disc has none.
+ */
+struct KWMLibDiscCodes
+{
+	QString mcn;
+	QStringList isrcs;                /* one per track */
+};
+
+/*
+ * What the changer inventory found in one slot; discId 0 for an empty one.
+ */
+struct KWMLibChangerSlot
+{
+	unsigned discId = 0;
+	unsigned tracks = 0;
+	QString artist;                   /* from CD-Text, if any */
+	QString title;
+};
+
+typedef QList<KWMLibChangerSlot> KWMLibChangerSlots;
+
+/*
+ * CD-Text of the current disc, a copy owned by the receiver. It is never
+ * modified after the worker handed it over.
+ */
+typedef QSharedPointer<const struct cdtext_info> KWMLibCdtext;
+
+Q_DECLARE_METATYPE(KWMLibDriveStatus)
+Q_DECLARE_METATYPE(KWMLibDiscToc)
+Q_DECLARE_METATYPE(KWMLibDiscCodes)
+Q_DECLARE_METATYPE(KWMLibChangerSlots)
+Q_DECLARE_METATYPE(KWMLibCdtext)
+
+/*
+ * Owns the wmlib drive handle. Every wm_cd_* call of the wmlib backend
+ * goes through this object, so moving it to an I/O thread keeps all
+ * drive I/O off the caller's thread. Status is only signalled when it
+ * differs from the last poll, or on every poll while a play command ran
+ * out, so the receiver gets to retry going on to the next track.
+ */
+class KWMLibDriveWorker : public QObject
+{
+	Q_OBJECT
+
+	public:
+		KWMLibDriveWorker(const QString &, const QString &, const QString &);
+		~KWMLibDriveWorker() override;
+
+		/* Polled by KWMLibDriveManager instead of its own timer. */
+		void setManaged(bool);
+
+	public Q_SLOTS:
+		void open(int firstPollDelay);
+		void close();
+		void poll();
+
+		void play(unsigned firstTrack, unsigned position, unsigned lastTrack);
+		void pause();
+		void stop();
+		void eject();
+		void closetray();
+
+		void setCrossfade(unsigned ms, bool trim);
+		void queue(unsigned track);
+
+		void setVolume(unsigned);
+		void setBalance(unsigned);
+
+		void readCdtext();
+		void readCodes();
+		void scanIndexes();
+
+		void selectSlot(unsigned slot);
+		void scanChanger();
+
+	private Q_SLOTS:
+		void backgroundFinished();
+
+	Q_SIGNALS:
+		void opened(bool ok, const QString &vendor, const QString &model, const QString &revision);
+		void tocChanged(const KWMLibDiscToc &toc);
+		void statusChanged(const KWMLibDriveStatus &status);
+		void volumeChanged(unsigned volume, unsigned balance);
+		void cdtextRead(const KWMLibCdtext &cdtext);
+		void codesRead(const KWMLibDiscCodes &codes);
+		void changerInventory(const KWMLibChangerSlots &inventory, unsigned currentSlot);
+
+	private:
+		void readToc();
+		void publishVolume();
+		void scanChangerSlot();
+		void runBackground(int job);
+		void cancelBackground();
+
+		void *m_handle;
+		QString m_devicePath;
+		QString m_audioSystem;
+		QString m_audioDevice;
+		KWMLibDiscToc m_toc;
+		KWMLibDriveStatus m_status;
+		bool m_managed;
+		bool m_playCommanded; /* the last command was play */
+
+		/* drive commands that may take long, polling is held meanwhile */
+		QThread *m_background;
+		int m_backgroundJob;
+		int m_backgroundResult;
+		bool m_codesPending;
+		bool m_indexesPending;
+
+		/* changer inventory in progress, polling is held meanwhile */
+		KWMLibChangerSlots m_slots;
+		int m_inventorySlot;
+		int m_inventoryWait;
+		unsigned m_returnSlot;
+};
+
+#endif // WMLIB_WORKER_H
@@ -0,0 +1,88 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "disc_ids.h"
+
+#include <QTest>
+
+extern "C"
+{
+	// cddb_discid() asks the drive, only cddb_discid_toc() is run here.
+	int wm_cd_getcountoftracks(void *) { return 0; }
+	int wm_cd_gettrackstart(void *, int) { return 0; }
+}
+
+class DiscIdsTest : public QObject
+{
+	Q_OBJECT
+
+	private Q_SLOTS:
+		void audioDisc();
+		void enhancedDisc();
+		void noTracks();
+		void tooManyTracks();
+};
+
+/* The example disc of the MusicBrainz disc id documentation. */
+static const QList<unsigned> audioToc = { 150, 15363, 32314, 46592, 63414, 80489, 95462 };
+
+void DiscIdsTest::audioDisc()
+{
+	const KCompactDiscIds ids(audioToc, true);
+
+	QCOMPARE(ids.cddb, 0x3404f606u);
+	QCOMPARE(ids.musicBrainz, QStringLiteral("49HHV7Eb8UKF3aQiNmu1GR8vKTY-"));
+	QCOMPARE(ids.accurateRip, QStringLiteral("006-000513be-001b2231-3404f606"));
+}
+
+void DiscIdsTest::enhancedDisc()
+{
+	// The data track and the gap before it count for CDDB only.
+	const KCompactDiscIds ids({ 150, 15363, 32314, 46592, 63414, 80489, 100000, 120000 }, false);
+
+	QCOMPARE(ids.cddb, 0x3e063e07u);
+	QCOMPARE(ids.musicBrainz, QStringLiteral("3ZGglxyNPc.x5Oics9ZWod8fj6s-"));
+	QCOMPARE(ids.accurateRip, QStringLiteral("006-0004f8f0-001a668f-3e063e07"));
+}
+
+void DiscIdsTest::noTracks()
+{
+	const KCompactDiscIds ids({ 150 }, true);
+
+	QCOMPARE(ids.cddb, 0u);
+	QVERIFY(ids.musicBrainz.isEmpty());
+	QVERIFY(ids.accurateRip.isEmpty());
+}
+
+void DiscIdsTest::tooManyTracks()
+{
+	QList<unsigned> toc;
+
+	for (unsigned i = 0; i <= 100; ++i)
+		toc.append(150 + i * 1000);
+
+	const KCompactDiscIds ids(toc, true);
+
+	QCOMPARE(ids.cddb, 0u);
+	QVERIFY(ids.musicBrainz.isEmpty());
+	QVERIFY(ids.accurateRip.isEmpty());
+}
+
+QTEST_GUILESS_MAIN(DiscIdsTest)
+
+#include "discidstest.moc"
@@ -0,0 +1,129 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "metadata_index.h"
+
+#include <QDir>
+#include <QTemporaryDir>
+#include <QTest>
+
+class MetadataIndexTest : public QObject
+{
+	Q_OBJECT
+
+	private Q_SLOTS:
+		void initTestCase();
+		void exactMatch();
+		void trackCountFallback();
+		void unknownDisc();
+		void invalidIndex();
+
+	private:
+		void writeDisc(const QString &name, const QByteArray &discIds, const QList<unsigned> &offsets,
+			unsigned seconds, const QByteArray &title, const QList<QByteArray> &tracks);
+
+		QTemporaryDir m_dir;
+		KCompactDiscMetadataIndex m_index;
+};
+
+void MetadataIndexTest::writeDisc(const QString &name, const QByteArray &discIds,
+	const QList<unsigned> &offsets, unsigned seconds, const QByteArray &title,
+	const QList<QByteArray> &tracks)
+{
+	QFile file(m_dir.filePath(QStringLiteral("dump/rock/") + name));
+	QByteArray text = "# xmcd\n#\n# Track frame offsets:\n";
+
+	for (unsigned offset : offsets)
+		text += "#\t" + QByteArray::number(offset) + '\n';
+	text += "#\n# Disc length: " + QByteArray::number(seconds) + " seconds\n#\n";
+	text += "DISCID=" + discIds + "\nDTITLE=" + title + '\n';
+	for (int i = 0; i < tracks.size(); ++i)
+		text += "TTITLE" + QByteArray::number(i) + '=' + tracks[i] + '\n';
+
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	file.write(text);
+}
+
+void MetadataIndexTest::initTestCase()
+{
+	QVERIFY(m_dir.isValid());
+	QVERIFY(QDir(m_dir.path()).mkpath(QStringLiteral("dump/rock")));
+
+	// Two discs sharing an id, and one listed under two ids.
+	writeDisc(QStringLiteral("1"), "12345602", { 150, 20000 }, 600,
+		"Artist / Album", { "One", "Guest / Two" });
+	writeDisc(QStringLiteral("2"), "12345602", { 150, 30000 }, 600,
+		"Other / Record", { "Uno", "Dos" });
+	writeDisc(QStringLiteral("3"), "0a0b0c03,0d0e0f03", { 150, 10000, 20000 }, 400,
+		"Solo", { "A", "B", "C" });
+
+	QVERIFY(KCompactDiscMetadataIndex::build(m_dir.filePath(QStringLiteral("dump")),
+		m_dir.filePath(QStringLiteral("index"))));
+	QVERIFY(m_index.open(m_dir.filePath(QStringLiteral("index"))));
+}
+
+void MetadataIndexTest::exactMatch()
+{
+	QStringList artists, titles;
+
+	QVERIFY(m_index.lookup(0x12345602, { 150, 30000, 45000 }, artists, titles));
+	QCOMPARE(artists, QStringList({ QStringLiteral("Other"), QStringLiteral("Other"), QStringLiteral("Other") }));
+	QCOMPARE(titles, QStringList({ QStringLiteral("Record"), QStringLiteral("Uno"), QStringLiteral("Dos") }));
+
+	QVERIFY(m_index.lookup(0x12345602, { 150, 20000, 45000 }, artists, titles));
+	QCOMPARE(artists, QStringList({ QStringLiteral("Artist"), QStringLiteral("Artist"), QStringLiteral("Guest") }));
+	QCOMPARE(titles, QStringList({ QStringLiteral("Album"), QStringLiteral("One"), QStringLiteral("Two") }));
+}
+
+void MetadataIndexTest::trackCountFallback()
+{
+	QStringList artists, titles;
+
+	// Offsets differ from the dump, the track count still matches.
+	QVERIFY(m_index.lookup(0x0d0e0f03, { 150, 10100, 20100, 30000 }, artists, titles));
+	QCOMPARE(titles, QStringList({ QStringLiteral("Solo"), QStringLiteral("A"), QStringLiteral("B"),
+		QStringLiteral("C") }));
+	QCOMPARE(artists.value(0), QStringLiteral("Solo"));
+
+	QVERIFY(!m_index.lookup(0x12345602, { 150, 10000, 20000, 30000 }, artists, titles));
+}
+
+void MetadataIndexTest::unknownDisc()
+{
+	QStringList artists, titles;
+
+	QVERIFY(!m_index.lookup(0x12345603, { 150, 10000, 20000, 30000 }, artists, titles));
+	QVERIFY(!m_index.lookup(0x0a0b0c03, { 150 }, artists, titles));
+}
+
+void MetadataIndexTest::invalidIndex()
+{
+	KCompactDiscMetadataIndex index;
+	QFile file(m_dir.filePath(QStringLiteral("garbage")));
+
+	QVERIFY(file.open(QIODevice::WriteOnly));
+	file.write(QByteArray(64, 'x'));
+	file.close();
+
+	QVERIFY(!index.open(file.fileName()));
+	QVERIFY(!index.isOpen());
+}
+
+QTEST_GUILESS_MAIN(MetadataIndexTest)
+
+#include "metadataindextest.moc"
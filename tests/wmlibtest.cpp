@@ -0,0 +1,261 @@
+/*
+ *  KCompactDisc - A CD drive interface for the KDE Project.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <QRandomGenerator>
+#include <QTest>
+
+#include <cstring>
+
+extern "C"
+{
+	#include "wm_cdtext.h"
+	#include "wm_helpers.h"
+
+	// Only the drive side of cdtext.c needs these, it is not run here.
+	struct wm_drive;
+	int wm_scsi_get_cdtext(struct wm_drive *, unsigned char **, int *) { return -1; }
+	unsigned long cddb_discid(struct wm_drive *) { return 0; }
+}
+
+typedef struct cdtext_pack_data_header Pack;
+
+/* Bit by bit reference of the CRC the slicing-by-8 one is checked against. */
+static unsigned short referenceCrc(const unsigned char *p, int length)
+{
+	unsigned short crc = 0;
+
+	for (int i = 0; i < length; ++i) {
+		crc ^= p[i] << 8;
+		for (int j = 0; j < 8; ++j)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return ~crc;
+}
+
+static void sealPack(Pack &pack)
+{
+	const unsigned short crc = referenceCrc(reinterpret_cast<const unsigned char *>(&pack), 16);
+
+	pack.crc_byte1 = crc >> 8;
+	pack.crc_byte2 = crc & 0xFF;
+}
+
+/*
+ * Split the NUL separated entries of one field into packs as a disc
+ * carries them, the track number of a pack is the entry its first
+ * character belongs to.
+ */
+static void appendPacks(QList<Pack> &packs, int type, int block, const QByteArray &text)
+{
+	int entry = 0;
+
+	for (int pos = 0; pos < text.size();) {
+		Pack pack;
+		memset(&pack, 0, sizeof(pack));
+		pack.header_field_id1_typ_of_pack = type;
+		pack.header_field_id2_tracknumber = entry;
+		pack.header_field_id3_sequence = packs.size();
+		pack.header_field_id4_block_no = block << 4;
+		for (int i = 0; i < DATAFIELD_LENGHT_IN_PACK && pos < text.size(); ++i, ++pos) {
+			pack.text_data_field[i] = text[pos];
+			if (!text[pos])
+				++entry;
+		}
+		sealPack(pack);
+		packs.append(pack);
+	}
+}
+
+static QByteArray entry(const struct cdtext_info *info, const cdtext_string &string)
+{
+	return QByteArray(reinterpret_cast<const char *>(CDTEXT_STRING(info, string)), string.length);
+}
+
+class WMLibTest : public QObject
+{
+	Q_OBJECT
+
+	private Q_SLOTS:
+		void crcMatchesReference();
+		void crcRejectsCorruption();
+		void parseFields();
+		void parseTruncatedStream();
+		void recoverBadPacks();
+		void wavHeader();
+		void parseBenchmark();
+};
+
+void WMLibTest::crcMatchesReference()
+{
+	QList<Pack> packs(500);
+	QRandomGenerator random(42);
+
+	for (Pack &pack : packs) {
+		unsigned char *p = reinterpret_cast<unsigned char *>(&pack);
+		for (int i = 0; i < 16; ++i)
+			p[i] = random.bounded(256);
+		sealPack(pack);
+	}
+	// Some drives leave the CRC out, such packs pass.
+	packs[0].crc_byte1 = packs[0].crc_byte2 = 0;
+
+	QCOMPARE(wm_cdtext_verify_packs(reinterpret_cast<unsigned char *>(packs.data()), packs.size()), 0);
+}
+
+void WMLibTest::crcRejectsCorruption()
+{
+	QList<Pack> packs;
+
+	appendPacks(packs, 0x80, 0, QByteArray("Album\0One\0Two\0", 14));
+	packs[0].text_data_field[3] ^= 0x10;
+
+	QCOMPARE(wm_cdtext_verify_packs(reinterpret_cast<unsigned char *>(packs.data()), packs.size()), 1);
+	QCOMPARE(int(packs[0].header_field_id1_typ_of_pack), 0);
+	QCOMPARE(int(packs[1].header_field_id1_typ_of_pack), 0x80);
+}
+
+void WMLibTest::parseFields()
+{
+	struct cdtext_info info;
+	QList<Pack> packs;
+
+	// "Two" is continued in the second pack, 0x09 repeats the entry before
+	// and the third performer is a copy of the first one.
+	appendPacks(packs, 0x80, 0, QByteArray("Album\0One\0Two\0", 14));
+	appendPacks(packs, 0x81, 0, QByteArray("Artist\0\t\0Artist\0", 16));
+	appendPacks(packs, 0x80, 1, QByteArray("Disque\0Un\0Deux\0", 15));
+
+	memset(&info, 0, sizeof(info));
+	info.count_of_entries = 3;
+	QCOMPARE(wm_cdtext_parse(&info, reinterpret_cast<const unsigned char *>(packs.constData()),
+		packs.size() * sizeof(Pack)), 0);
+
+	QVERIFY(info.valid);
+	QCOMPARE(info.count_of_valid_packs, int(packs.size()));
+	QVERIFY(info.blocks[0] && info.blocks[1] && !info.blocks[2]);
+
+	QCOMPARE(entry(&info, info.blocks[0]->name[0]), QByteArray("Album"));
+	QCOMPARE(entry(&info, info.blocks[0]->name[1]), QByteArray("One"));
+	QCOMPARE(entry(&info, info.blocks[0]->name[2]), QByteArray("Two"));
+	QCOMPARE(entry(&info, info.blocks[1]->name[2]), QByteArray("Deux"));
+
+	for (int i = 0; i < 3; ++i) {
+		QCOMPARE(entry(&info, info.blocks[0]->performer[i]), QByteArray("Artist"));
+		QCOMPARE(info.blocks[0]->performer[i].offset, info.blocks[0]->performer[0].offset);
+	}
+	QCOMPARE(int(info.blocks[0]->composer[1].length), 0);
+
+	free(info.arena);
+}
+
+void WMLibTest::parseTruncatedStream()
+{
+	struct cdtext_info info;
+	QList<Pack> packs;
+
+	// Entries of tracks beyond the TOC are dropped, a last entry without
+	// end marker is kept. The text fills the last pack up.
+	appendPacks(packs, 0x80, 0, QByteArray("Album\0One\0Extra\0Cut offs", 24));
+
+	memset(&info, 0, sizeof(info));
+	info.count_of_entries = 2;
+	QCOMPARE(wm_cdtext_parse(&info, reinterpret_cast<const unsigned char *>(packs.constData()),
+		packs.size() * sizeof(Pack)), 0);
+	QCOMPARE(entry(&info, info.blocks[0]->name[1]), QByteArray("One"));
+
+	free(info.arena);
+	memset(&info, 0, sizeof(info));
+	info.count_of_entries = 4;
+	QCOMPARE(wm_cdtext_parse(&info, reinterpret_cast<const unsigned char *>(packs.constData()),
+		packs.size() * sizeof(Pack)), 0);
+	QCOMPARE(entry(&info, info.blocks[0]->name[3]), QByteArray("Cut offs"));
+
+	free(info.arena);
+}
+
+void WMLibTest::recoverBadPacks()
+{
+	struct cdtext_info info;
+	QList<Pack> packs, again;
+	int bad;
+
+	appendPacks(packs, 0x80, 0, QByteArray("Album\0One\0Two\0", 14));
+	again = packs;
+
+	packs[1].text_data_field[0] ^= 0x01;
+	bad = wm_cdtext_verify_packs(reinterpret_cast<unsigned char *>(packs.data()), packs.size());
+	QCOMPARE(bad, 1);
+
+	// The second read is broken elsewhere, only the good half is taken.
+	again[0].text_data_field[0] ^= 0x01;
+	bad = wm_cdtext_merge_packs(reinterpret_cast<unsigned char *>(packs.data()),
+		reinterpret_cast<unsigned char *>(again.data()), packs.size(), bad);
+	QCOMPARE(bad, 0);
+	QCOMPARE(int(packs[0].text_data_field[0]), int('A'));
+
+	memset(&info, 0, sizeof(info));
+	info.count_of_entries = 3;
+	QCOMPARE(wm_cdtext_parse(&info, reinterpret_cast<const unsigned char *>(packs.constData()),
+		packs.size() * sizeof(Pack)), 0);
+	QCOMPARE(entry(&info, info.blocks[0]->name[2]), QByteArray("Two"));
+	QCOMPARE(info.count_of_invalid_packs, 0);
+
+	free(info.arena);
+}
+
+void WMLibTest::wavHeader()
+{
+	unsigned char header[WM_WAV_HEADER_SIZE];
+
+	wm_wav_header(header, 1000);
+
+	QCOMPARE(QByteArray(reinterpret_cast<const char *>(header), sizeof(header)).toHex(),
+		QByteArray("52494646" "0c040000" "57415645" "666d7420" "10000000" "0100" "0200"
+			"44ac0000" "10b10200" "0400" "1000" "64617461" "e8030000"));
+}
+
+void WMLibTest::parseBenchmark()
+{
+	struct cdtext_info info;
+	QList<Pack> packs;
+	QByteArray text;
+
+	// As much as a disc can carry: 8 blocks with every text field of
+	// 99 tracks and the disc.
+	for (int i = 0; i < 100; ++i)
+		text += QByteArray::number(i % 10) + "ab" + '\0';
+	for (int block = 0; block < 8; ++block) {
+		for (int type : { 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x8E })
+			appendPacks(packs, type, block, text);
+	}
+
+	QBENCHMARK {
+		memset(&info, 0, sizeof(info));
+		info.count_of_entries = 100;
+		wm_cdtext_parse(&info, reinterpret_cast<const unsigned char *>(packs.constData()),
+			packs.size() * sizeof(Pack));
+		free(info.arena);
+	}
+
+	QCOMPARE(info.count_of_valid_packs, int(packs.size()));
+}
+
+QTEST_GUILESS_MAIN(WMLibTest)
+
+#include "wmlibtest.moc"